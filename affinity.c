@@ -0,0 +1,286 @@
+// affinity.c
+//
+// CPU placement of pipelines and background jobs.
+//
+// PIPE_AFFINITY (a local of the first stage or in the environment) pins the
+// stages of a pipeline before they exec:
+//
+//   core   stage i on one CPU each, adjacent stages on adjacent CPUs in
+//          topology order: SMT siblings first, then other cores sharing the
+//          last-level cache, then the next cache domain and NUMA node;
+//   cache  all stages on the CPUs of one last-level cache domain;
+//   node   all stages on the CPUs of one NUMA node.
+//
+// Successive pipelines start in successive domains, so concurrent pipelines
+// spread out while each keeps its producer/consumer pairs close.  With
+// BG_AFFINITY set, each & job (and everything it runs) is pinned to the next
+// NUMA node in turn, or to the next cache domain on a single-node machine.
+//
+// The topology is read once from /sys/devices/system/cpu and /sys/devices/
+// system/node; only the CPUs the shell itself may run on are used.
+
+#include "process.h"
+#include <dirent.h>
+#include <sched.h>
+
+//Where one CPU sits
+typedef struct cpuInfo {
+	int cpu;
+	int node;                                   //NUMA node
+	int llc;                                    //First CPU sharing its last-level cache
+	int core;                                   //First CPU of its SMT siblings
+} cpuInfo;
+
+struct placement {
+	int* cpus;
+	int nCpus;
+	bool each;                                  //Stage i gets cpus[i] alone, otherwise all of them
+};
+
+static cpuInfo* topology = NULL;
+static int nTopology = -1;                      //-1 until loaded
+static int nextPipeline = 0, nextJob = 0;       //Domain rotation
+
+//Parse a CPU list such as "0-3,8,10-11" at TEXT into SET
+static void parseCpuList(const char* text, cpu_set_t* set) {
+	CPU_ZERO(set);
+	while (*text != '\0' && *text != '\n') {
+		char* end;
+		long first = strtol(text, &end, 10), last = first;
+		if (end == text) {
+			return;
+		}
+		if (*end == '-') {
+			text = end + 1;
+			last = strtol(text, &end, 10);
+		}
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, set);
+		}
+		text = (*end == ',' ? end + 1 : end);
+	}
+}
+
+//Read the CPU list in file PATH into SET; false if it can't be read
+static bool readCpuList(const char* path, cpu_set_t* set) {
+	FILE* file = fopen(path, "re");
+	if (file == NULL) {
+		return false;
+	}
+	char line[4096];
+	bool read = fgets(line, sizeof(line), file) != NULL;
+	fclose(file);
+	if (read) {
+		parseCpuList(line, set);
+	}
+	return read;
+}
+
+//Lowest CPU in the CPU list file PATH, or -1
+static int firstCpu(const char* path) {
+	cpu_set_t set;
+	if (!readCpuList(path, &set)) {
+		return -1;
+	}
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &set)) {
+			return cpu;
+		}
+	}
+	return -1;
+}
+
+//Order CPUs by node, cache domain, core and number
+static int compareCpus(const void* a, const void* b) {
+	const cpuInfo* x = a;
+	const cpuInfo* y = b;
+	if (x->node != y->node) {
+		return x->node - y->node;
+	}
+	if (x->llc != y->llc) {
+		return x->llc - y->llc;
+	}
+	if (x->core != y->core) {
+		return x->core - y->core;
+	}
+	return x->cpu - y->cpu;
+}
+
+//Read the topology the first time it is needed
+static void loadTopology(void) {
+	if (nTopology >= 0) {
+		return;
+	}
+	nTopology = 0;
+	cpu_set_t online;
+	if (!readCpuList("/sys/devices/system/cpu/online", &online)) {
+		CPU_ZERO(&online);
+		for (long cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN) && cpu < CPU_SETSIZE; cpu++) {
+			CPU_SET(cpu, &online);
+		}
+	}
+
+	int* nodeOf = calloc(CPU_SETSIZE, sizeof(int));
+	DIR* nodes = opendir("/sys/devices/system/node");
+	struct dirent* d;
+	while (nodes != NULL && (d = readdir(nodes)) != NULL) {
+		int node;
+		char path[PATH_MAX];
+		cpu_set_t set;
+		if (sscanf(d->d_name, "node%d", &node) != 1) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", d->d_name);
+		if (readCpuList(path, &set)) {
+			for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+				if (CPU_ISSET(cpu, &set)) {
+					nodeOf[cpu] = node;
+				}
+			}
+		}
+	}
+	if (nodes != NULL) {
+		closedir(nodes);
+	}
+
+	topology = malloc(sizeof(cpuInfo) * CPU_COUNT(&online));
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &online)) {
+			continue;
+		}
+		char path[PATH_MAX];
+		cpuInfo* c = &topology[nTopology++];
+		c->cpu = cpu;
+		c->node = nodeOf[cpu];
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+		c->core = firstCpu(path);
+		c->llc = -1;
+		for (int index = 3; index >= 0 && c->llc < 0; index--) { //Highest cache level listed
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+			c->llc = firstCpu(path);
+		}
+		if (c->core < 0) {
+			c->core = cpu;
+		}
+		if (c->llc < 0) {
+			c->llc = c->core;
+		}
+	}
+	free(nodeOf);
+	qsort(topology, nTopology, sizeof(cpuInfo), compareCpus);
+}
+
+//Store in ALLOWED the topology entries of the CPUs this process may use; return their number
+//START[k] is set to the first of the K-th domain (cache domain, or node if NODES), *DOMAINS to their number
+static int allowedCpus(int* allowed, int* start, int* domains, bool nodes) {
+	loadTopology();
+	cpu_set_t mask;
+	if (sched_getaffinity(0, sizeof(mask), &mask) == -1) {
+		return 0;
+	}
+	int n = 0;
+	*domains = 0;
+	for (int k = 0; k < nTopology; k++) {
+		if (!CPU_ISSET(topology[k].cpu, &mask)) {
+			continue;
+		}
+		const cpuInfo* previous = (n > 0? &topology[allowed[n - 1]] : NULL);
+		if (previous == NULL || (nodes? previous->node != topology[k].node : previous->llc != topology[k].llc)) {
+			start[(*domains)++] = n;
+		}
+		allowed[n++] = k;
+	}
+	return n;
+}
+
+//Placement of the CPUs of domain number NEXT (mod their number), by node if NODES; NULL if there are none
+static placement* domainPlacement(int next, bool nodes) {
+	loadTopology();
+	int* allowed = malloc(sizeof(int) * (nTopology + 1));
+	int* start = malloc(sizeof(int) * (nTopology + 1));
+	int domains;
+	int n = allowedCpus(allowed, start, &domains, nodes);
+	placement* p = NULL;
+	if (n > 0) {
+		int d = next % domains;
+		int end = (d + 1 < domains? start[d + 1] : n);
+		p = malloc(sizeof(placement));
+		p->each = false;
+		p->nCpus = end - start[d];
+		p->cpus = malloc(sizeof(int) * p->nCpus);
+		for (int i = 0; i < p->nCpus; i++) {
+			p->cpus[i] = topology[allowed[start[d] + i]].cpu;
+		}
+	}
+	free(allowed);
+	free(start);
+	return p;
+}
+
+placement* pipelinePlacement(const CMD* cmdList, int stages) {
+	char* policy = localOrEnv(cmdList, "PIPE_AFFINITY");
+	if (policy == NULL || *policy == '\0') {
+		return NULL;
+	}
+	if (strcmp(policy, "cache") == 0 || strcmp(policy, "node") == 0) {
+		return domainPlacement(nextPipeline++, policy[0] == 'n');
+	}
+	if (strcmp(policy, "core") != 0) {
+		fprintf(stderr, "PIPE_AFFINITY: expected core, cache or node\n");
+		return NULL;
+	}
+
+	loadTopology();
+	int* allowed = malloc(sizeof(int) * (nTopology + 1));
+	int* start = malloc(sizeof(int) * (nTopology + 1));
+	int domains;
+	int n = allowedCpus(allowed, start, &domains, false);
+	placement* p = NULL;
+	if (n > 0) {                                //Consecutive CPUs from the start of the next cache domain
+		int first = start[nextPipeline++ % domains];
+		p = malloc(sizeof(placement));
+		p->each = true;
+		p->nCpus = stages;
+		p->cpus = malloc(sizeof(int) * stages);
+		for (int i = 0; i < stages; i++) {
+			p->cpus[i] = topology[allowed[(first + i) % n]].cpu;
+		}
+	}
+	free(allowed);
+	free(start);
+	return p;
+}
+
+placement* backgroundPlacement(void) {
+	if (getenv("BG_AFFINITY") == NULL) {
+		return NULL;
+	}
+	loadTopology();
+	bool nodes = nTopology > 0 && topology[0].node != topology[nTopology - 1].node;
+	return domainPlacement(nextJob++, nodes); //Sorted by node: several nodes iff first and last differ
+}
+
+void placeProcess(const placement* p, int stage, int pid) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (p->each) {
+		CPU_SET(p->cpus[stage % p->nCpus], &set);
+	}
+	else {
+		for (int i = 0; i < p->nCpus; i++) {
+			CPU_SET(p->cpus[i], &set);
+		}
+	}
+	sched_setaffinity(pid, sizeof(set), &set); //Best effort: the CPU may have gone offline
+}
+
+void freePlacement(placement* p) {
+	if (p != NULL) {
+		free(p->cpus);
+		free(p);
+	}
+}
+
+void affinityMemory(memoryUsage* u) {
+	countBlock(u, topology);
+}
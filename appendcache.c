@@ -0,0 +1,184 @@
+// appendcache.c
+//
+// Optional cache of ">> FILE" fds (enabled by APPEND_CACHE).  The shell keeps
+// the last APPEND_CACHE_SIZE files it appended to open (O_APPEND, close-on-exec)
+// and hands every redirection to one of them a dup() of the cached fd, so a
+// script that appends to the same log thousands of times does a single path
+// lookup per file instead of one per command.
+//
+// Each entry is keyed by its path and the (dev, inode) it was opened as, and
+// carries an inotify watch on that inode.  The cache is revalidated by draining
+// the inotify queue, a single nonblocking read() with no path lookup: a file
+// that was moved or deleted is dropped at once, and one whose link count or
+// attributes changed is dropped if its path no longer names the same inode
+// (e.g. another file was renamed over it).  Renaming a parent directory is not
+// noticed, so the cache is best used for files whose directories stay put.  A
+// relative path names a different file after cd, pushd or popd, so an entry
+// for one is used only until the working directory next changes.
+//
+// Only the shell itself fills the cache and consumes the inotify queue.  A
+// forked child sees the entries its shell validated just before fork(), and
+// uses them only while no event is pending on the (shared) queue.
+
+#include "process.h"
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define APPEND_CACHE_SIZE 8                 //Files kept open
+#define APPEND_EVENTS (IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+
+//One cached file
+typedef struct appendEntry {
+	char* path;                             //NULL if the slot is free
+	int fd;
+	int watch;                              //inotify watch descriptor of the inode
+	dev_t dev;
+	ino_t ino;
+	unsigned long directory;                //Relative path: the directory it was opened in (see directory)
+	unsigned long used;                     //Tick of the last use, for LRU eviction
+} appendEntry;
+
+static appendEntry cache[APPEND_CACHE_SIZE];
+static unsigned long tick = 0;
+static int events = -1;                     //inotify fd, -1 until the cache is set up
+static pid_t owner = 0;                     //Process that owns the cache (the shell)
+static unsigned long directory = 0;         //Changes of the working directory so far
+
+//Set up the cache on first use; false if it is disabled or inotify is unavailable
+static bool appendCacheOn(void) {
+	if (events >= 0) {
+		return true;
+	}
+	if (owner != 0 || !getenv("APPEND_CACHE")) {
+		return false;
+	}
+	owner = getpid();
+	events = holdFd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC));
+	return events >= 0;
+}
+
+//Close and forget entry E, dropping its watch unless another entry shares the inode
+static void evictEntry(appendEntry* e) {
+	bool shared = false;
+	for (int i = 0; i < APPEND_CACHE_SIZE; i++) {
+		if (&cache[i] != e && cache[i].path != NULL && cache[i].watch == e->watch) {
+			shared = true;
+		}
+	}
+	if (!shared) {
+		inotify_rm_watch(events, e->watch);
+	}
+	closeFd(e->fd);
+	free(e->path);
+	e->path = NULL;
+}
+
+//Does entry E's path still name the inode it was opened as?
+static bool stillValid(const appendEntry* e) {
+	struct stat info;
+	return stat(e->path, &info) == 0 && info.st_dev == e->dev && info.st_ino == e->ino;
+}
+
+//Drain the inotify queue and drop every entry an event invalidates
+static void revalidate(void) {
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+	while ((n = read(events, buffer, sizeof(buffer))) > 0) {
+		for (char* p = buffer; p < buffer + n; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len) {
+			const struct inotify_event* event = (const struct inotify_event*) p;
+			for (int i = 0; i < APPEND_CACHE_SIZE; i++) {
+				if (cache[i].path != NULL && cache[i].watch == event->wd
+						&& ((event->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) || !stillValid(&cache[i]))) {
+					evictEntry(&cache[i]);
+				}
+			}
+		}
+	}
+}
+
+//Cached entry for PATH, or NULL
+static appendEntry* findEntry(const char* path) {
+	for (int i = 0; i < APPEND_CACHE_SIZE; i++) {
+		if (cache[i].path != NULL && strcmp(cache[i].path, path) == 0 && (path[0] == '/' || cache[i].directory == directory)) {
+			cache[i].used = ++tick;
+			return &cache[i];
+		}
+	}
+	return NULL;
+}
+
+//Open PATH for appending and cache it in the least recently used slot; NULL with errno set on failure
+static appendEntry* addEntry(const char* path) {
+	int fd = openFd(path, O_WRONLY | O_CREAT | O_APPEND, 00666);
+	struct stat info;
+	if (fd < 0) {
+		return NULL;
+	}
+	int watch = inotify_add_watch(events, path, APPEND_EVENTS);
+	if (watch < 0 || fstat(fd, &info) == -1) {
+		close(fd);                          //Can't be watched, so can't be cached
+		return NULL;
+	}
+
+	appendEntry* e = &cache[0];
+	for (int i = 0; i < APPEND_CACHE_SIZE && e->path != NULL; i++) {
+		if (cache[i].path == NULL || cache[i].used < e->used) {
+			e = &cache[i];
+		}
+	}
+	if (e->path != NULL) {
+		evictEntry(e);
+	}
+	e->path = strdup(path);
+	e->fd = holdFd(fd);
+	e->watch = watch;
+	e->dev = info.st_dev;
+	e->ino = info.st_ino;
+	e->directory = directory;
+	e->used = ++tick;
+	return e;
+}
+
+void appendDirectoryChanged(void) {
+	directory++;                            //Entries for relative paths age out of the LRU
+}
+
+//Make sure PATH is cached and valid before the shell forks a command that appends to it
+void cacheAppendFile(const char* path) {
+	if (appendCacheOn() && getpid() == owner && !isCoproc(path)) { //> %NAME is no file
+		revalidate();
+		if (findEntry(path) == NULL) {
+			addEntry(path);                 //On error the child's own open() reports it
+		}
+	}
+}
+
+//Open PATH for appending: a dup() of the cached fd when there is a valid one, else a fresh open()
+//Returns an fd the caller owns, or -1 with errno set
+int openAppend(const char* path) {
+	appendEntry* e = NULL;
+	if (appendCacheOn()) {
+		if (getpid() == owner) {
+			revalidate();
+			if ((e = findEntry(path)) == NULL) {
+				e = addEntry(path);
+			}
+		}
+		else {
+			int pending = 0;                //A child must leave the queue to the shell
+			if (ioctl(events, FIONREAD, &pending) == 0 && pending == 0) {
+				e = findEntry(path);
+			}
+		}
+	}
+	if (e != NULL) {
+		return dupFd(e->fd);                //Callers close what they get, the cache keeps its fd
+	}
+	return openFd(path, O_WRONLY | O_CREAT | O_APPEND, 00666);
+}
+
+void appendCacheMemory(memoryUsage* u) {
+	for (int i = 0; i < APPEND_CACHE_SIZE; i++) {
+		countBlock(u, cache[i].path);
+	}
+}
@@ -0,0 +1,180 @@
+// batch.c
+//
+// ARG_MAX-aware argument batching (enabled by ARG_BATCH=P).  A simple command
+// whose argv and environment would not fit the kernel's limit (execvp would
+// fail with E2BIG) is run as several commands instead, like xargs: each gets
+// the fixed head of argv plus as many of the trailing arguments as fit.  Up to
+// P batches run at once (1 if P is not a positive number), and the status is
+// the last nonzero status of the batches in argument order, as for pipelines.
+//
+// The head is the first ARG_BATCH_KEEP words if that is set (e.g.
+// "ARG_BATCH_KEEP=3 grep -e PAT ...").  Otherwise it is argv[0] alone, or
+// argv[0] and the options up to and including a "--".  The shell can't tell
+// whether an option takes an argument (grep -e PAT), so a command with options
+// and no "--" is not split without ARG_BATCH_KEEP: it runs as one command and
+// fails with E2BIG, as it would without ARG_BATCH.  All batches read the same
+// < file and share one > / >> file, opened once.
+
+#include "process.h"
+
+#define ARG_HEADROOM 2048           //Bytes kept free below ARG_MAX, as xargs does
+
+extern char** environ;
+
+//Bytes that the strings and pointers of the NULL-terminated vector V take on the new stack
+static size_t vectorSize(char** v) {
+	size_t size = sizeof(char*);
+	for ( ; *v; v++) {
+		size += strlen(*v) + 1 + sizeof(char*);
+	}
+	return size;
+}
+
+//Start one batch: cmdList with argument vector ARGV
+static int spawnBatch(const CMD* cmdList, char** argv) {
+	CMD batch = *cmdList;
+	batch.argv = argv;
+	for (batch.argc = 0; argv[batch.argc] != NULL; batch.argc++)
+		;
+	batch.toType = NONE;                    //The shared output is already on fd 1
+	return spawnSingle(&batch);
+}
+
+//Running batch with process id PID (0 if the slot is free, -1 once reaped)
+typedef struct batchSlot {
+	int pid;
+	int batch;
+} batchSlot;
+
+//Slot of PID in the open-addressing TABLE of MASK + 1 slots: the one holding it, or the free one ending its probe
+static batchSlot* findSlot(batchSlot* table, unsigned mask, int pid) {
+	unsigned i = ((unsigned) pid * 2654435761u) & mask;
+	while (table[i].pid != 0 && table[i].pid != pid) {
+		i = (i + 1) & mask;
+	}
+	return &table[i];
+}
+
+//Bytes that the environment of cmdList (with its local variables) takes on the new stack
+static size_t environmentSize(const CMD* cmdList) {
+	size_t environment = vectorSize(environ);
+	for (int i = 0; i < cmdList->nLocal; i++) {
+		environment += strlen(cmdList->locVar[i]) + strlen(cmdList->locVal[i]) + 2 + sizeof(char*);
+	}
+	return environment;
+}
+
+bool argumentsTooLong(const CMD* cmdList) {
+	return vectorSize(cmdList->argv) + environmentSize(cmdList) > sysconf(_SC_ARG_MAX) - ARG_HEADROOM;
+}
+
+//Run cmdList in batches if its arguments are too long for one execvp; false if they fit
+bool executeBatches(const CMD* cmdList) {
+	size_t limit = sysconf(_SC_ARG_MAX) - ARG_HEADROOM;
+	size_t environment = environmentSize(cmdList);
+	if (!argumentsTooLong(cmdList)) {
+		return false;
+	}
+
+	int keep = 1;
+	char* fixed = localOrEnv(cmdList, "ARG_BATCH_KEEP");
+	if (fixed != NULL && atoi(fixed) > 0) {
+		keep = atoi(fixed);
+	}
+	else {
+		while (cmdList->argv[keep] != NULL && cmdList->argv[keep][0] == '-' && cmdList->argv[keep][1] != '\0'
+				&& strcmp(cmdList->argv[keep - 1], "--") != 0) {
+			keep++;
+		}
+		if (keep > 1 && strcmp(cmdList->argv[keep - 1], "--") != 0) { //Its last option may take the next word
+			fprintf(stderr, "ARG_BATCH: %s: set ARG_BATCH_KEEP to the number of words to repeat in each batch\n",
+				cmdList->argv[0]);
+			return false;
+		}
+	}
+	if (keep >= cmdList->argc) {            //Nothing to split
+		return false;
+	}
+
+	int out = openOutput(cmdList);
+	if (out < 0) {
+		errorStatus(cmdList->argv[0], false);
+		return true;
+	}
+	fflush(stdout);
+	int saved = dupFd(1);
+	if (out != 1) {
+		dup2(out, 1);
+		close(out);
+	}
+
+	int workers = atoi(localOrEnv(cmdList, "ARG_BATCH"));
+	if (workers <= 0) {
+		workers = 1;
+	}
+	char** argv = malloc(sizeof(char*) * (cmdList->argc + 1));
+	memcpy(argv, cmdList->argv, sizeof(char*) * keep);
+	size_t head = environment + sizeof(char*);
+	for (int i = 0; i < keep; i++) {
+		head += strlen(argv[i]) + 1 + sizeof(char*);
+	}
+
+	int nBatches = 0, running = 0, status = 0, next = keep;
+	int* statuses = malloc(sizeof(int) * cmdList->argc);
+	unsigned mask = 1;                      //Pid table: at most half full, so probes stay short
+	while (mask < 2u * cmdList->argc) {
+		mask *= 2;
+	}
+	batchSlot* pids = calloc(mask--, sizeof(batchSlot));
+	while (next < cmdList->argc || running > 0) {
+		if (next < cmdList->argc && running < workers) {
+			int count = keep;
+			size_t size = head;
+			do {                            //At least one argument, even if it alone is too long
+				size += strlen(cmdList->argv[next]) + 1 + sizeof(char*);
+				argv[count++] = cmdList->argv[next++];
+			} while (next < cmdList->argc && size + strlen(cmdList->argv[next]) + 1 + sizeof(char*) <= limit);
+			argv[count] = NULL;
+			int pid = spawnBatch(cmdList, argv);
+			statuses[nBatches] = (pid < 0? atoi(getenv("?")) : 0);
+			if (pid > 0) {
+				*findSlot(pids, mask, pid) = (batchSlot) {pid, nBatches};
+				running++;
+			}
+			nBatches++;
+			continue;
+		}
+
+		int result = -1;
+		int pid = waitpid(-1, &result, 0);
+		if (pid < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;                          //Reaped elsewhere
+		}
+		batchSlot* reaped = findSlot(pids, mask, pid);
+		if (reaped->pid != pid) {           //Background zombie
+			reapedBackground(pid, result);
+			continue;
+		}
+		reaped->pid = -1;                   //Keeps the probe chains of the others intact; a reused pid can't match it
+		statuses[reaped->batch] = STATUS(result);
+		running--;
+	}
+
+	for (int k = 0; k < nBatches; k++) {
+		if (statuses[k] != 0) {
+			status = statuses[k];
+		}
+	}
+	dup2(saved, 1);
+	close(saved);
+	char buffer[4];
+	sprintf(buffer, "%d", status);
+	setenv("?", buffer, 1);
+	free(argv);
+	free(pids);
+	free(statuses);
+	return true;
+}
@@ -0,0 +1,250 @@
+// builtin.c
+//
+// In-process implementations of common filters.  A builtin reads from fd IN,
+// writes to fd OUT and returns an exit status, so it can run either in the
+// shell itself (simple command) or in place of execvp() in a pipeline stage.
+
+#include "process.h"
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#define COPY_CHUNK (1 << 20)        //Bytes moved per zero-copy system call
+#define COPY_BUFFER (128 * 1024)    //Buffer size for the read/write fallback
+
+//Errors from a zero-copy call that just mean "try the next mechanism"
+static bool unsupported(int error) {
+	return error == EINVAL || error == EXDEV || error == ENOSYS || error == EOPNOTSUPP || error == EBADF;
+}
+
+//Write all LEN bytes of BUF to fd OUT, return -1 on error
+static int writeAll(int out, const char* buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(out, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+//Copy everything from fd IN to fd OUT, picking the cheapest mechanism the two fds support:
+//copy_file_range (file to file), sendfile (file to anything), splice (pipe on either side),
+//and finally a large-buffer read/write loop. Returns 0 on success, -1 on error with errno set
+int copyData(int in, int out) {
+	struct stat inStat, outStat;
+	if (fstat(in, &inStat) == -1 || fstat(out, &outStat) == -1) {
+		return -1;
+	}
+	ssize_t n = -1;
+	bool sized = S_ISREG(inStat.st_mode) && inStat.st_size > 0; //procfs/sysfs files report size 0 and can't be copied in-kernel
+
+	if (sized && S_ISREG(outStat.st_mode)) {
+		while ((n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0)) > 0)
+			;
+		if (n == 0) {
+			return 0;
+		}
+		if (!unsupported(errno)) {
+			return -1;
+		}
+	}
+
+	if (sized) {
+		while ((n = sendfile(out, in, NULL, COPY_CHUNK)) > 0)
+			;
+		if (n == 0) {
+			return 0;
+		}
+		if (!unsupported(errno)) {
+			return -1;
+		}
+	}
+
+	if (S_ISFIFO(inStat.st_mode) || S_ISFIFO(outStat.st_mode)) {
+		while ((n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0)
+			;
+		if (n == 0) {
+			return 0;
+		}
+		if (!unsupported(errno)) {
+			return -1;
+		}
+	}
+
+	char* buffer = malloc(COPY_BUFFER);
+	while ((n = read(in, buffer, COPY_BUFFER)) != 0) {
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 || writeAll(out, buffer, n) == -1) {
+			free(buffer);
+			return -1;
+		}
+	}
+	free(buffer);
+	return 0;
+}
+
+//Report a failed builtin operation on NAME and return its exit status (128+SIGPIPE for a closed reader, like a killed process)
+static int failure(const char* builtin, const char* name) {
+	if (errno == EPIPE) {
+		return 128 + SIGPIPE;
+	}
+	fprintf(stderr, "%s: %s: %s\n", builtin, name, strerror(errno));
+	return 1;
+}
+
+//cat [FILE...]: concatenate files (or "-" / no arguments for IN) to OUT
+int builtinCat(char** argv, int in, int out) {
+	int status = 0;
+	if (argv[1] == NULL) {
+		return (copyData(in, out) == -1? failure(argv[0], "-") : 0);
+	}
+	for (char** file = argv + 1; *file; file++) {
+		int fd = (strcmp(*file, "-") == 0? in : openFd(*file, O_RDONLY, 0));
+		if (fd < 0) {
+			status = failure(argv[0], *file);
+			continue;
+		}
+		int copied = copyData(fd, out);
+		int error = errno;
+		if (fd != in) {
+			close(fd);
+		}
+		if (copied == -1) {
+			errno = error;
+			status = failure(argv[0], *file);
+			if (status != 1) { //Reader went away, nothing more to do
+				return status;
+			}
+		}
+	}
+	return status;
+}
+
+//Duplicate a pipe IN into pipe OUT with tee(2) and move the same bytes into the single FILE with splice(2)
+//Returns 1 if the pipes can't be teed (caller falls back), 0 on EOF, -1 on error
+static int teeSplice(int in, int out, int file) {
+	char* buffer = NULL;
+	ssize_t n;
+	while ((n = tee(in, out, COPY_CHUNK, 0)) > 0) {
+		ssize_t left = n;
+		while (left > 0) { //Consume exactly what was duplicated
+			ssize_t moved = (buffer == NULL? splice(in, NULL, file, NULL, left, SPLICE_F_MOVE) : -1);
+			if (moved < 0 && (buffer != NULL || unsupported(errno))) { //e.g. O_APPEND files refuse splice
+				if (buffer == NULL) {
+					buffer = malloc(COPY_BUFFER);
+				}
+				moved = read(in, buffer, (left < COPY_BUFFER? left : COPY_BUFFER));
+				if (moved > 0 && writeAll(file, buffer, moved) == -1) {
+					moved = -1;
+				}
+			}
+			if (moved <= 0) {
+				free(buffer);
+				return -1;
+			}
+			left -= moved;
+		}
+	}
+	free(buffer);
+	return (n == 0? 0 : (unsupported(errno)? 1 : -1));
+}
+
+//tee [-a] [FILE...]: copy IN to OUT and to every FILE
+int builtinTee(char** argv, int in, int out) {
+	bool append = (argv[1] != NULL && strcmp(argv[1], "-a") == 0);
+	char** names = argv + (append? 2 : 1);
+	int count = 0;
+	while (names[count] != NULL) {
+		count++;
+	}
+	if (count == 0) {
+		return (copyData(in, out) == -1? failure(argv[0], "-") : 0);
+	}
+
+	int status = 0;
+	int* files = malloc(sizeof(int) * count);
+	for (int i = 0; i < count; i++) {
+		files[i] = openFd(names[i], O_WRONLY | O_CREAT | (append? O_APPEND : O_TRUNC), 00666);
+		if (files[i] < 0) {
+			status = failure(argv[0], names[i]);
+		}
+	}
+
+	int result = 1;
+	struct stat inStat, outStat;
+	if (count == 1 && files[0] >= 0 && fstat(in, &inStat) == 0 && fstat(out, &outStat) == 0
+			&& S_ISFIFO(inStat.st_mode) && S_ISFIFO(outStat.st_mode)) {
+		result = teeSplice(in, out, files[0]);
+	}
+	if (result == 1) { //One user-space copy, written to every destination
+		char* buffer = malloc(COPY_BUFFER);
+		ssize_t n;
+		result = 0;
+		while (result == 0 && (n = read(in, buffer, COPY_BUFFER)) != 0) {
+			if (n < 0) {
+				result = (errno == EINTR? 0 : -1);
+				continue;
+			}
+			if (writeAll(out, buffer, n) == -1) {
+				result = -1;
+			}
+			for (int i = 0; i < count && result == 0; i++) {
+				if (files[i] >= 0 && writeAll(files[i], buffer, n) == -1) {
+					result = -1;
+				}
+			}
+		}
+		free(buffer);
+	}
+	if (result == -1) {
+		status = failure(argv[0], "write");
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (files[i] >= 0) {
+			close(files[i]);
+		}
+	}
+	free(files);
+	return status;
+}
+
+//Table of builtins dispatched by argv[0]
+static const struct {
+	const char* name;
+	builtinFn function;
+	const char* options; //Leading options the builtin understands (others fall back to the external command)
+} builtins[] = {
+	{"cat", builtinCat, ""},
+	{"tee", builtinTee, "a"},
+};
+
+//Return the in-process implementation of ARGV, or NULL if it must be run externally
+builtinFn findBuiltin(char** argv) {
+	if (getenv("NO_BUILTINS")) {
+		return NULL;
+	}
+	for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+		if (strcmp(argv[0], builtins[i].name) != 0) {
+			continue;
+		}
+		bool leading = true;
+		for (char** arg = argv + 1; *arg; arg++) {
+			if ((*arg)[0] != '-' || (*arg)[1] == '\0') {
+				leading = false;
+			}
+			else if (!leading || (*arg)[2] != '\0' || strchr(builtins[i].options, (*arg)[1]) == NULL) {
+				return NULL; //Unknown or misplaced option
+			}
+		}
+		return builtins[i].function;
+	}
+	return filterBuiltin(argv);
+}
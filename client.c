@@ -0,0 +1,67 @@
+// client.c
+// Run a command line in a shell server (see server.c) with this process's
+// stdin, stdout, stderr, working directory and environment; e.g.,
+// "BashClient /tmp/bash.sock 'ls | wc -l'" is equivalent to "ls | wc -l"
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "fdpass.h"
+
+extern char **environ;
+
+// Print error message and die with STATUS
+#define errorExit(status)  perror("BashClient"), exit(status)
+
+int main (int argc, char *argv[])
+{
+    if (argc < 3) {
+	fprintf (stderr, "usage: BashClient SOCKET COMMAND...\n");
+	exit (EXIT_FAILURE);
+    }
+
+    char *cwd = getcwd (NULL, 0);                 // Working directory
+    if (cwd == NULL)
+	errorExit (EXIT_FAILURE);
+
+    serverRequest request = {0, 0};             // Size the request: command
+    for (int i = 2; i < argc; i++)              //   line (arguments joined
+	request.length += strlen (argv[i]) + 1; //   by blanks), cwd, environ
+    request.length += strlen (cwd) + 1;
+    for (char **p = environ; *p; p++, request.envc++)
+	request.length += strlen (*p) + 1;
+
+    char *strings = malloc (request.length), *s = strings;
+    for (int i = 2; i < argc; i++) {
+	s = stpcpy (s, argv[i]);
+	*s++ = (i < argc-1 ? ' ' : '\0');
+    }
+    s = stpcpy (s, cwd) + 1;
+    for (char **p = environ; *p; p++)
+	s = stpcpy (s, *p) + 1;
+
+    struct sockaddr_un address;
+    memset (&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy (address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+
+    int sock = socket (AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect (sock, (struct sockaddr *) &address, sizeof(address)) < 0)
+	errorExit (EXIT_FAILURE);
+
+    int fds[3] = {0, 1, 2}, status;
+    if (!sendFds (sock, &request, sizeof(request), fds, 3)
+	  || !writeFully (sock, strings, request.length)
+	  || !readFully (sock, &status, sizeof(status))) {
+	fprintf (stderr, "BashClient: no reply from %s\n", argv[1]);
+	exit (EXIT_FAILURE);
+    }
+
+    free (strings);
+    free (cwd);
+    return status;
+}
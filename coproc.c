@@ -0,0 +1,360 @@
+// coproc.c
+//
+// Coprocesses: long-lived helpers (bc, jq, a lookup tool, ...) that many
+// commands talk to, instead of paying a fork, exec and tool startup per use.
+//
+//   coproc NAME COMMAND [ARG]...   start COMMAND as coprocess NAME
+//   coproc -q NAME [ARG]...        write the ARGs as one line to NAME, print
+//                                  the one line it answers
+//   coproc -k NAME                 close NAME
+//   coproc                         list the coprocesses
+//
+// A coprocess runs in a process group of its own (like a & job) with its
+// stdin and stdout on two pipes whose other ends the shell keeps, so any
+// later command can use it by name: CMD > %NAME (or >> %NAME) writes to its
+// stdin and CMD < %NAME reads from its stdout.  A reader gets EOF only when
+// the coprocess exits, so < %NAME is for commands that stop by themselves
+// (head -c N, a tool that reads one reply).  The shell reads the reply of
+// coproc -q one byte at a time, so it never takes output meant for another
+// reader; the coprocess has to flush each line it writes (jq --unbuffered,
+// stdbuf -oL, ...).
+//
+// A coprocess that exits is reported like a & job and restarted (with the
+// same command and local variables) the next time it is used.  coproc -k
+// closes its stdin and sends its group SIGTERM if it has not exited within
+// CLOSE_MSEC; all coprocesses are closed this way when the shell exits.
+
+#include "process.h"
+#include <sys/wait.h>
+
+#define CLOSE_MSEC 500                      //Grace period between EOF and SIGTERM
+#define CLOSE_POLL_NSEC 10000000
+
+typedef struct coproc {
+	char* name;
+	char** argv;                            //Of the command, NULL-terminated
+	int nLocal;
+	char** locVar;                          //Its local variables
+	char** locVal;
+	int pid;                                //0 once it has exited
+	int in, out;                            //Shell's ends: its stdin, its stdout (-1 once closed)
+	int starts;
+	int lastStatus;                         //Of its last exit
+} coproc;
+
+static coproc* coprocs = NULL;
+static int nCoprocs = 0;
+
+//Copy of the NULL-terminated vector V (of N strings if N >= 0)
+static char** copyVector(char** v, int n) {
+	if (n < 0) {
+		for (n = 0; v[n] != NULL; n++)
+			;
+	}
+	char** copy = malloc(sizeof(char*) * (n + 1));
+	for (int i = 0; i < n; i++) {
+		copy[i] = strdup(v[i]);
+	}
+	copy[n] = NULL;
+	return copy;
+}
+
+static void freeVector(char** v) {
+	if (v != NULL) {
+		for (char** p = v; *p != NULL; p++) {
+			free(*p);
+		}
+		free(v);
+	}
+}
+
+static coproc* findCoproc(const char* name) {
+	for (int i = 0; i < nCoprocs; i++) {
+		if (strcmp(coprocs[i].name, name) == 0) {
+			return &coprocs[i];
+		}
+	}
+	return NULL;
+}
+
+//Close the shell's ends of the pipes of C
+static void closePipes(coproc* c) {
+	closeFd(c->in);
+	closeFd(c->out);
+	c->in = c->out = -1;
+}
+
+//Note that C exited with wait status RESULT
+static void exited(coproc* c, int result) {
+	fprintf(stderr, "Coprocess %s: %d exited (%d)\n", c->name, c->pid, STATUS(result));
+	c->pid = 0;
+	c->lastStatus = STATUS(result);
+}
+
+//Start the command of C; false if it could not be (reported)
+static bool startCoproc(coproc* c) {
+	int toChild[2], fromChild[2];
+	if (pipeFds(toChild) == -1) {
+		perror("coproc: pipe");
+		return false;
+	}
+	if (pipeFds(fromChild) == -1) {
+		perror("coproc: pipe");
+		close(toChild[0]);
+		close(toChild[1]);
+		return false;
+	}
+	fflush(stdout);
+	int pid = fork();
+	if (pid < 0) {
+		perror("coproc: fork");
+		close(toChild[0]);
+		close(toChild[1]);
+		close(fromChild[0]);
+		close(fromChild[1]);
+		return false;
+	}
+	else if (pid == 0) {
+		setpgid(0, 0);                      //Neither Ctrl-C nor a pipeline's group reaches it
+		signal(SIGINT, SIG_DFL);
+		for (int i = 0; i < c->nLocal; i++) {
+			setenv(c->locVar[i], c->locVal[i], 1);
+		}
+		moveFd(toChild[0], 0);
+		moveFd(fromChild[1], 1);
+		closeExtraFds();
+		execvp(c->argv[0], c->argv);
+		int error = errno;
+		perror(c->argv[0]);
+		exit(error);
+	}
+	setpgid(pid, pid);
+	close(toChild[0]);
+	close(fromChild[1]);
+	closePipes(c);                          //Those of the run before, if any
+	c->in = holdFd(toChild[1]);
+	c->out = holdFd(fromChild[0]);
+	c->pid = pid;
+	c->starts++;
+	return true;
+}
+
+//C, restarted if it has exited; NULL if it could not be
+static coproc* running(coproc* c) {
+	int result;
+	if (c->pid > 0 && waitpid(c->pid, &result, WNOHANG) == c->pid) {
+		exited(c, result);
+	}
+	if (c->pid == 0 && !startCoproc(c)) {
+		return NULL;
+	}
+	return c;
+}
+
+//Close C: EOF on its stdin, SIGTERM to its group after CLOSE_MSEC, and reap it
+static void closeCoproc(coproc* c) {
+	closePipes(c);
+	if (c->pid > 0) {
+		int result = -1;
+		struct timespec pause = {0, CLOSE_POLL_NSEC};
+		for (int waited = 0; waitpid(c->pid, &result, WNOHANG) == 0; waited += CLOSE_POLL_NSEC / 1000000) {
+			if (waited >= CLOSE_MSEC) {
+				kill(-c->pid, SIGTERM);
+				kill(-c->pid, SIGCONT);
+				waitChild(c->pid, &result);
+				break;
+			}
+			nanosleep(&pause, NULL);
+		}
+		c->pid = 0;
+	}
+	free(c->name);
+	freeVector(c->argv);
+	freeVector(c->locVar);
+	freeVector(c->locVal);
+	*c = coprocs[--nCoprocs];               //Order does not matter
+}
+
+bool isCoproc(const char* file) {
+	return file != NULL && file[0] == '%' && findCoproc(file + 1) != NULL;
+}
+
+int coprocFd(const char* file, bool input) {
+	if (!isCoproc(file)) {
+		return -2;
+	}
+	coproc* c = running(findCoproc(file + 1));
+	if (c == NULL) {
+		errno = ECHILD;
+		return -1;
+	}
+	return dupFd(input? c->out : c->in);
+}
+
+bool coprocExited(int pid, int result) {
+	for (int i = 0; i < nCoprocs; i++) {
+		if (coprocs[i].pid == pid && pid > 0) {
+			exited(&coprocs[i], result);
+			return true;
+		}
+	}
+	return false;
+}
+
+void closeCoprocs(void) {
+	while (nCoprocs > 0) {
+		closeCoproc(&coprocs[nCoprocs - 1]);
+	}
+	free(coprocs);
+	coprocs = NULL;
+}
+
+//Write the line ARGV to C and copy the line it answers to fd OUT; returns the status
+static int query(coproc* c, char** argv, int out) {
+	size_t length = 1;
+	for (char** p = argv; *p != NULL; p++) {
+		length += strlen(*p) + 1;
+	}
+	char* line = malloc(length);
+	line[0] = '\0';
+	for (char** p = argv; *p != NULL; p++) {
+		strcat(line, *p);
+		strcat(line, (p[1] != NULL? " " : ""));
+	}
+	strcat(line, "\n");
+
+	struct sigaction ignore, previous;
+	memset(&ignore, 0, sizeof(ignore));
+	ignore.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &ignore, &previous); //A coprocess that has exited must not kill the shell
+	bool sent = write(c->in, line, strlen(line)) == strlen(line);
+	if (!sent && errno == EPIPE && running(c) == c) { //Exited since it was last used: once more
+		sent = write(c->in, line, strlen(line)) == strlen(line);
+	}
+	sigaction(SIGPIPE, &previous, NULL);
+	free(line);
+	if (!sent) {
+		perror("coproc");
+		return 1;
+	}
+
+	char reply[512], last = '\0';
+	size_t n = 0;
+	ssize_t got = 0;
+	while (last != '\n' && (got = read(c->out, &last, 1)) > 0) { //No further than the newline
+		reply[n++] = last;
+		if (last == '\n' || n == sizeof(reply)) {
+			write(out, reply, n);
+			n = 0;
+		}
+	}
+	write(out, reply, n);                   //Cut short by EOF or a Ctrl-C
+	if (got == 0) {
+		fprintf(stderr, "coproc: %s closed its output\n", c->name);
+	}
+	return (got > 0? 0 : 1);
+}
+
+//List the coprocesses on fd OUT
+static void listCoprocs(int out) {
+	for (int i = 0; i < nCoprocs; i++) {
+		coproc* c = &coprocs[i];
+		dprintf(out, "%-12s pid=%d  starts=%d  ", c->name, c->pid, c->starts);
+		if (c->pid == 0) {
+			dprintf(out, "exited (%d)  ", c->lastStatus);
+		}
+		for (char** p = c->argv; *p != NULL; p++) {
+			dprintf(out, "%s%s", *p, (p[1] != NULL? " " : "\n"));
+		}
+	}
+}
+
+void executeCoproc(const CMD* cmdList) {
+	char** argv = cmdList->argv;
+	bool option = argv[1] != NULL && (strcmp(argv[1], "-q") == 0 || strcmp(argv[1], "-k") == 0);
+	char* name = argv[(option? 2 : 1)];
+	if ((name == NULL && argv[1] != NULL) || (name != NULL && *name == '-')
+			|| (option && argv[1][1] == 'k' && argv[3] != NULL) || (!option && name != NULL && argv[2] == NULL)) {
+		fprintf(stderr, "usage: coproc [NAME COMMAND [ARG]... | -q NAME [ARG]... | -k NAME]\n");
+		setenv("?", "2", 1);
+		return;
+	}
+	coproc* c = (name != NULL? findCoproc(name) : NULL);
+	if (option && c == NULL) {
+		fprintf(stderr, "coproc: %s: no such coprocess\n", name);
+		setenv("?", "1", 1);
+		return;
+	}
+
+	if (!option && name != NULL) {          //Start one
+		if (c != NULL) {
+			fprintf(stderr, "coproc: %s already exists\n", name);
+			setenv("?", "1", 1);
+			return;
+		}
+		REALLOC(coprocs, nCoprocs + 1);
+		c = &coprocs[nCoprocs++];
+		c->name = strdup(name);
+		c->argv = copyVector(argv + 2, -1);
+		c->nLocal = cmdList->nLocal;
+		c->locVar = copyVector(cmdList->locVar, cmdList->nLocal);
+		c->locVal = copyVector(cmdList->locVal, cmdList->nLocal);
+		c->pid = 0;
+		c->in = c->out = -1;
+		c->starts = 0;
+		c->lastStatus = 0;
+		if (!startCoproc(c)) {
+			closeCoproc(c);
+			setenv("?", "1", 1);
+			return;
+		}
+		fprintf(stderr, "Coprocess %s: %d\n", c->name, c->pid);
+		setenv("?", "0", 1);
+		return;
+	}
+	if (option && argv[1][1] == 'k') {
+		closeCoproc(c);
+		setenv("?", "0", 1);
+		return;
+	}
+
+	int out = openOutput(cmdList);          //-q and the listing
+	if (out < 0) {
+		errorStatus(argv[0], false);
+		return;
+	}
+	fflush(stdout);
+	int status = 0;
+	if (c == NULL) {
+		listCoprocs(out);
+	}
+	else if (running(c) == NULL) {
+		status = 1;
+	}
+	else {
+		status = query(c, argv + 3, out);
+	}
+	if (out != 1) {
+		close(out);
+	}
+	char buffer[4];
+	sprintf(buffer, "%d", status);
+	setenv("?", buffer, 1);
+}
+
+void coprocMemory(memoryUsage* u) {
+	countBlock(u, coprocs);
+	for (int i = 0; i < nCoprocs; i++) {
+		countBlock(u, coprocs[i].name);
+		countBlock(u, coprocs[i].argv);
+		for (char** p = coprocs[i].argv; *p != NULL; p++) {
+			countBlock(u, *p);
+		}
+		countBlock(u, coprocs[i].locVar);
+		countBlock(u, coprocs[i].locVal);
+		for (int j = 0; j < coprocs[i].nLocal; j++) {
+			countBlock(u, coprocs[i].locVar[j]);
+			countBlock(u, coprocs[i].locVal[j]);
+		}
+	}
+}
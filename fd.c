@@ -0,0 +1,126 @@
+// fd.c
+//
+// File descriptors of the shell.  Every fd the shell opens -- for itself, for
+// a builtin or for a child to dup2 onto its stdin or stdout -- is opened
+// close-on-exec (openFd(), pipe2(), F_DUPFD_CLOEXEC, mkostemp(), ...), so a
+// command inherits only its stdin, stdout and stderr: dup2() clears the flag
+// on the copy it makes, and moveFd() clears it when the fd already is the
+// target.  Just before a child execs a command, closeExtraFds() closes every
+// fd above stderr with close_range(), which also covers any fd the shell was
+// itself started with.
+//
+// The fds the shell keeps from one command line to the next (the current
+// directory, the pushd stack, the append cache, the zygote's socket, ...) are
+// registered with holdFd() and given back with closeFd().  With FD_CHECK set,
+// after each command line any other open fd above stderr that the shell did
+// not inherit is reported on stderr as a leak.
+
+#include "process.h"
+#include <dirent.h>
+
+static bool* held = NULL;               //held[FD]: kept across command lines, or inherited
+static int nHeld = 0;
+
+int openFd(const char* path, int flags, mode_t mode) {
+	return open(path, flags | O_CLOEXEC, mode);
+}
+
+int openFdAt(int dir, const char* path, int flags, mode_t mode) {
+	return openat(dir, path, flags | O_CLOEXEC, mode);
+}
+
+int pipeFds(int fd[2]) {
+	return pipe2(fd, O_CLOEXEC);
+}
+
+int dupFd(int fd) {
+	return fcntl(fd, F_DUPFD_CLOEXEC, 3);   //Never onto a closed stdin, stdout or stderr
+}
+
+void moveFd(int fd, int target) {
+	if (fd != target) {
+		dup2(fd, target);
+		close(fd);
+	}
+	else {
+		fcntl(fd, F_SETFD, 0);              //Opened close-on-exec, and dup2() can't clear it on itself
+	}
+}
+
+int holdFd(int fd) {
+	if (fd >= nHeld) {
+		int n = (fd + 1 > 2 * nHeld? fd + 1 : 2 * nHeld);
+		REALLOC(held, n);
+		memset(held + nHeld, 0, sizeof(bool) * (n - nHeld));
+		nHeld = n;
+	}
+	if (fd >= 0) {
+		held[fd] = true;
+	}
+	return fd;
+}
+
+void closeFd(int fd) {
+	if (fd >= 0) {
+		if (fd < nHeld) {
+			held[fd] = false;
+		}
+		close(fd);
+	}
+}
+
+void closeExtraFds(void) {
+	if (close_range(3, ~0U, 0) == -1) {     //Kernels before 5.9
+		long max = sysconf(_SC_OPEN_MAX);
+		for (int fd = 3; fd < max && fd < 65536; fd++) {
+			close(fd);
+		}
+	}
+}
+
+//Call FN(FD) for every open fd above stderr except the one reading /proc/self/fd
+static void forEachFd(void (*fn)(int fd)) {
+	DIR* dir = opendir("/proc/self/fd");
+	if (dir == NULL) {
+		return;
+	}
+	struct dirent* d;
+	while ((d = readdir(dir)) != NULL) {
+		int fd = atoi(d->d_name);
+		if (d->d_name[0] != '.' && fd > 2 && fd != dirfd(dir)) {
+			fn(fd);
+		}
+	}
+	closedir(dir);
+}
+
+//Hold FD (inherited) unconditionally
+static void holdInherited(int fd) {
+	holdFd(fd);
+}
+
+void noteInheritedFds(void) {
+	forEachFd(holdInherited);
+}
+
+//Report FD unless it is held
+static void reportLeak(int fd) {
+	if (fd < nHeld && held[fd]) {
+		return;
+	}
+	char path[32], target[PATH_MAX];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	ssize_t n = readlink(path, target, sizeof(target) - 1);
+	target[(n < 0? 0 : n)] = '\0';
+	fprintf(stderr, "FD_CHECK: fd %d (%s) left open\n", fd, target);
+}
+
+void checkFds(void) {
+	if (getenv("FD_CHECK")) {
+		forEachFd(reportLeak);
+	}
+}
+
+void fdMemory(memoryUsage* u) {
+	countBlock(u, held);
+}
@@ -0,0 +1,91 @@
+// fdpass.c
+//
+// Whole-buffer I/O and file descriptor passing over Unix domain sockets.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "fdpass.h"
+
+#define MAX_FDS 8               //Most descriptors passed with one message
+
+bool readFully(int fd, void* buf, size_t len) {
+	char* p = buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool writeFully(int fd, const void* buf, size_t len) {
+	const char* p = buf;
+	while (len > 0) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL); //A vanished peer is an error, not SIGPIPE
+		if (n < 0 && errno == ENOTSOCK) {
+			n = write(fd, p, len);
+		}
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool sendFds(int sock, const void* buf, size_t len, const int* fds, int nFds) {
+	char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+	memset(control, 0, sizeof(control));
+	struct iovec data = {(void*) buf, len};
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &data;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = CMSG_SPACE(sizeof(int) * nFds);
+	struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+	header->cmsg_level = SOL_SOCKET;
+	header->cmsg_type = SCM_RIGHTS;
+	header->cmsg_len = CMSG_LEN(sizeof(int) * nFds);
+	memcpy(CMSG_DATA(header), fds, sizeof(int) * nFds);
+
+	ssize_t n;
+	while ((n = sendmsg(sock, &message, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+		;
+	return n >= 0 && writeFully(sock, (const char*) buf + n, len - n); //Descriptors travel with the first byte
+}
+
+bool receiveFds(int sock, void* buf, size_t len, int* fds, int nFds) {
+	char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+	struct iovec data = {buf, len};
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &data;
+	message.msg_iovlen = 1;
+	message.msg_control = control;
+	message.msg_controllen = CMSG_SPACE(sizeof(int) * nFds);
+
+	ssize_t n;
+	while ((n = recvmsg(sock, &message, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+		;
+	struct cmsghdr* header = CMSG_FIRSTHDR(&message);
+	if (n <= 0 || header == NULL || header->cmsg_type != SCM_RIGHTS
+			|| header->cmsg_len != CMSG_LEN(sizeof(int) * nFds)) {
+		return false;
+	}
+	memcpy(fds, CMSG_DATA(header), sizeof(int) * nFds);
+	return readFully(sock, (char*) buf + n, len - n);
+}
@@ -0,0 +1,41 @@
+// fdpass.h
+//
+// Whole-buffer I/O and file descriptor passing (SCM_RIGHTS) over Unix domain
+// sockets, shared by the zygote, the shell server and its client.
+
+#ifndef FDPASS_INCLUDED
+#define FDPASS_INCLUDED         // fdpass.h has been #include-d
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+// Read exactly LEN bytes from FD into BUF; false on end of file or error
+bool readFully (int fd, void *buf, size_t len);
+
+
+// Write exactly LEN bytes of BUF to FD; false on error
+bool writeFully (int fd, const void *buf, size_t len);
+
+
+// Send the LEN bytes of BUF over socket SOCK with the NFDS descriptors FDS
+// attached; false on error
+bool sendFds (int sock, const void *buf, size_t len, const int *fds, int nFds);
+
+
+// Receive LEN bytes into BUF and the NFDS descriptors attached to them
+// (opened close-on-exec) from socket SOCK; false on end of file or error
+bool receiveFds (int sock, void *buf, size_t len, int *fds, int nFds);
+
+
+// A request to a shell server (see server.c) is this header with stdin,
+// stdout and stderr attached, followed by LENGTH bytes of NUL-terminated
+// strings: the command line, the working directory, and ENVC environment
+// entries.  The server replies with the exit status of the command line (int).
+
+typedef struct serverRequest {
+  size_t length;                //   Bytes of strings after the header
+  int envc;                     //   Number of environment entries
+} serverRequest;
+
+#endif
@@ -0,0 +1,708 @@
+// filter.c
+//
+// Simple line filters (cat, head, tail, wc, grep -F) that run in-process.
+// head, tail, wc and grep -F are also builtins (see findBuiltin()); the inner
+// loops of wc and grep -F use AVX2 or SSE2 when available (NO_SIMD forces the
+// scalar code).
+//
+// With THREAD_STAGES set, executePipe() forks one helper process for each run
+// of adjacent filter stages; inside it the stages are threads connected by
+// single-producer/single-consumer ring buffers, and kernel pipes are only used
+// at the edges of the run (fd 0 and fd 1 of the helper).
+//
+// A filter reads its input stream and writes its output stream.  When the
+// reader of a ring has finished early (e.g. head), the writer gets EPIPE and
+// stops with status 128+SIGPIPE, as if it had been killed by SIGPIPE.
+
+#include "process.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SIMD_X86                    //SSE2 is always there, AVX2 is checked at run time
+#endif
+
+#define RING_SIZE (256 * 1024)      //Capacity of each ring buffer (power of two)
+#define BATCH_SIZE (64 * 1024)      //Output is handed to the next stage in batches of this size
+
+//Lock-free ring buffer between two adjacent threads
+typedef struct channel {
+	_Atomic size_t head;            //Total bytes written by the producer
+	_Atomic size_t tail;            //Total bytes consumed by the consumer
+	atomic_bool writerDone;         //Producer has finished (EOF once drained)
+	atomic_bool readerDone;         //Consumer has finished (producer gets EPIPE)
+	atomic_int wakeups;             //Futex word, bumped on every change a sleeper may wait for
+	atomic_int sleepers;            //Threads blocked in futex wait
+	char data[RING_SIZE];
+} channel;
+
+//One end of a filter: a ring buffer if RING is set, otherwise file descriptor FD
+struct stream {
+	channel* ring;
+	int fd;
+	char* batch;                    //Output only: bytes not yet handed on
+	size_t batched;
+};
+
+static void channelWait(channel* c, int seen) {
+	atomic_fetch_add(&c->sleepers, 1);
+	syscall(SYS_futex, &c->wakeups, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+	atomic_fetch_sub(&c->sleepers, 1);
+}
+
+static void channelWake(channel* c) {
+	atomic_fetch_add(&c->wakeups, 1);
+	if (atomic_load(&c->sleepers) > 0) {
+		syscall(SYS_futex, &c->wakeups, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+//Read up to LEN bytes from IN into BUF: returns number read, 0 at EOF, -1 on error
+ssize_t streamRead(stream* in, char* buf, size_t len) {
+	if (in->ring == NULL) {
+		ssize_t n;
+		while ((n = read(in->fd, buf, len)) < 0 && errno == EINTR)
+			;
+		return n;
+	}
+
+	channel* c = in->ring;
+	for ( ; ; ) {
+		int seen = atomic_load(&c->wakeups);
+		size_t tail = atomic_load_explicit(&c->tail, memory_order_relaxed);
+		size_t available = atomic_load_explicit(&c->head, memory_order_acquire) - tail;
+		if (available > 0) {
+			size_t n = (available < len? available : len);
+			size_t offset = tail & (RING_SIZE - 1);
+			size_t first = (n < RING_SIZE - offset? n : RING_SIZE - offset);
+			memcpy(buf, c->data + offset, first);
+			memcpy(buf + first, c->data, n - first);
+			atomic_store_explicit(&c->tail, tail + n, memory_order_release);
+			channelWake(c);
+			return n;
+		}
+		if (atomic_load(&c->writerDone)) { //The last batch may have come in after head was read above
+			if (atomic_load_explicit(&c->head, memory_order_acquire) == tail) {
+				return 0;
+			}
+			continue;
+		}
+		channelWait(c, seen);
+	}
+}
+
+//Hand LEN bytes of BUF straight to OUT: returns 0, or -1 with errno set (EPIPE if the reader has finished)
+static int streamPut(stream* out, const char* buf, size_t len) {
+	if (out->ring == NULL) {
+		while (len > 0) {
+			ssize_t n = write(out->fd, buf, len);
+			if (n < 0 && errno == EINTR) {
+				continue;
+			}
+			if (n < 0) {
+				return -1;
+			}
+			buf += n;
+			len -= n;
+		}
+		return 0;
+	}
+
+	channel* c = out->ring;
+	while (len > 0) {
+		int seen = atomic_load(&c->wakeups);
+		if (atomic_load(&c->readerDone)) {
+			errno = EPIPE;
+			return -1;
+		}
+		size_t head = atomic_load_explicit(&c->head, memory_order_relaxed);
+		size_t space = RING_SIZE - (head - atomic_load_explicit(&c->tail, memory_order_acquire));
+		if (space == 0) {
+			channelWait(c, seen);
+			continue;
+		}
+		size_t n = (space < len? space : len);
+		size_t offset = head & (RING_SIZE - 1);
+		size_t first = (n < RING_SIZE - offset? n : RING_SIZE - offset);
+		memcpy(c->data + offset, buf, first);
+		memcpy(c->data, buf + first, n - first);
+		atomic_store_explicit(&c->head, head + n, memory_order_release);
+		channelWake(c);
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+//Hand on everything batched for OUT
+int streamFlush(stream* out) {
+	size_t batched = out->batched;
+	out->batched = 0;
+	return (batched == 0? 0 : streamPut(out, out->batch, batched));
+}
+
+//Write LEN bytes of BUF to OUT, batching small writes: returns 0, or -1 with errno set
+int streamWrite(stream* out, const char* buf, size_t len) {
+	if (out->batched + len > BATCH_SIZE && streamFlush(out) == -1) {
+		return -1;
+	}
+	if (len >= BATCH_SIZE) {
+		return streamPut(out, buf, len);
+	}
+	memcpy(out->batch + out->batched, buf, len);
+	out->batched += len;
+	return 0;
+}
+
+//Set up S as the stream for file descriptor FD (OUTPUT if it will be written)
+void streamOpen(stream* s, int fd, bool output) {
+	s->ring = NULL;
+	s->fd = fd;
+	s->batch = (output? malloc(BATCH_SIZE) : NULL);
+	s->batched = 0;
+}
+
+//Finish with S: flush and signal EOF on output, tell the writer we are done on input
+void streamClose(stream* s, bool output) {
+	if (output) {
+		streamFlush(s);
+		free(s->batch);
+	}
+	if (s->ring != NULL) {
+		atomic_store(output? &s->ring->writerDone : &s->ring->readerDone, true);
+		channelWake(s->ring);
+	}
+	else {
+		close(s->fd);               //Let the process on the other side of the pipe see EOF / SIGPIPE now
+	}
+}
+
+//Exit status for a failed write: 128+SIGPIPE if the reader has gone, else report and return 1
+static int writeFailure(const char* name) {
+	if (errno == EPIPE) {
+		return 128 + SIGPIPE;
+	}
+	fprintf(stderr, "%s: write error: %s\n", name, strerror(errno));
+	return 1;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Filters
+
+//cat [FILE...]
+static int filterCat(char** argv, stream* in, stream* out) {
+	char* buffer = malloc(BATCH_SIZE);
+	int status = 0;
+	char* stdinName[] = {"-", NULL};
+	for (char** file = (argv[1] == NULL? stdinName : argv + 1); *file; file++) {
+		stream source;
+		bool useIn = (strcmp(*file, "-") == 0);
+		if (!useIn) {
+			int fd = openFd(*file, O_RDONLY, 0);
+			if (fd < 0) {
+				fprintf(stderr, "%s: %s: %s\n", argv[0], *file, strerror(errno));
+				status = 1;
+				continue;
+			}
+			streamOpen(&source, fd, false);
+		}
+		ssize_t n;
+		while ((n = streamRead(useIn? in : &source, buffer, BATCH_SIZE)) > 0) {
+			if (streamPut(out, buffer, n) == -1) { //Already a full batch, no need to copy it again
+				status = writeFailure(argv[0]);
+				break;
+			}
+		}
+		if (!useIn) {
+			close(source.fd);
+		}
+		if (status > 1) {
+			break;
+		}
+	}
+	free(buffer);
+	return status;
+}
+
+//Parse "head/tail [-n N | -nN | -N]" into *LINES, return false if ARGV is not of that form (+N and -N included)
+bool lineOption(char** argv, long* lines) {
+	*lines = 10;
+	char* value = NULL;
+	if (argv[1] == NULL) {
+		return true;
+	}
+	else if (strcmp(argv[1], "-n") == 0 && argv[2] != NULL && argv[3] == NULL) {
+		value = argv[2];
+	}
+	else if (strncmp(argv[1], "-n", 2) == 0 && argv[2] == NULL) {
+		value = argv[1] + 2;
+	}
+	else if (argv[1][0] == '-' && argv[2] == NULL) {
+		value = argv[1] + 1;
+	}
+	else {
+		return false;
+	}
+	if (*value < '0' || *value > '9') { //Not a count: tail -n +N starts at line N, head -n -N drops N
+		return false;
+	}
+	char* end;
+	*lines = strtol(value, &end, 10);
+	return *end == '\0';
+}
+
+//head [-n N]: copy the first N lines, then stop reading so upstream sees a closed reader
+static int filterHead(char** argv, stream* in, stream* out) {
+	long lines;
+	lineOption(argv, &lines);
+	char* buffer = malloc(BATCH_SIZE);
+	ssize_t n = 0;
+	while (lines > 0 && (n = streamRead(in, buffer, BATCH_SIZE)) > 0) {
+		char* end = buffer;
+		while (lines > 0 && (end = memchr(end, '\n', buffer + n - end)) != NULL) {
+			end++;
+			lines--;
+		}
+		size_t keep = (lines == 0? (size_t) (end - buffer) : (size_t) n);
+		if (streamWrite(out, buffer, keep) == -1) {
+			free(buffer);
+			return writeFailure(argv[0]);
+		}
+	}
+	free(buffer);
+	return 0;
+}
+
+//Offset in the SIZE bytes at BUF where its last LINES lines start (an unterminated last line counts)
+static size_t lastLines(const char* buf, size_t size, long lines) {
+	if (lines == 0) {
+		return size;
+	}
+	size_t pos = (size > 0 && buf[size - 1] == '\n'? size - 1 : size);
+	while (lines-- > 0) {
+		const char* newline = memrchr(buf, '\n', pos);
+		if (newline == NULL) {
+			return 0;
+		}
+		pos = newline - buf;
+	}
+	return pos + 1;
+}
+
+//tail [-n N]: copy the last N lines. Only a suffix holding at least N lines is kept while reading
+static int filterTail(char** argv, stream* in, stream* out) {
+	long lines;
+	lineOption(argv, &lines);
+	size_t capacity = 2 * BATCH_SIZE, size = 0, trimmed = BATCH_SIZE; //Trim again once size doubles
+	char* buffer = malloc(capacity);
+	ssize_t n;
+	while ((n = streamRead(in, buffer + size, capacity - size)) > 0) {
+		size += n;
+		if (size > 2 * trimmed) {
+			size_t start = lastLines(buffer, size, lines);
+			memmove(buffer, buffer + start, size - start);
+			size -= start;
+			trimmed = (size > BATCH_SIZE? size : BATCH_SIZE);
+		}
+		if (capacity - size < BATCH_SIZE) {
+			capacity *= 2;
+			buffer = realloc(buffer, capacity);
+		}
+	}
+	size_t start = lastLines(buffer, size, lines);
+	int status = (streamWrite(out, buffer + start, size - start) == -1? writeFailure(argv[0]) : 0);
+	free(buffer);
+	return status;
+}
+
+//Parse "wc [-lwc...]" into the counts to print, return false if ARGV is not of that form
+bool wcOptions(char** argv, bool* lines, bool* words, bool* bytes) {
+	*lines = *words = *bytes = false;
+	for (char** arg = argv + 1; *arg; arg++) {
+		if ((*arg)[0] != '-' || (*arg)[1] == '\0') {
+			return false;                   //Files are left to the external wc
+		}
+		for (char* option = *arg + 1; *option; option++) {
+			if (*option == 'l') {
+				*lines = true;
+			}
+			else if (*option == 'w') {
+				*words = true;
+			}
+			else if (*option == 'c') {
+				*bytes = true;
+			}
+			else {
+				return false;
+			}
+		}
+	}
+	if (!*lines && !*words && !*bytes) {
+		*lines = *words = *bytes = true;
+	}
+	return true;
+}
+
+//Vector width in use: 32 (AVX2), 16 (SSE2) or 0 (scalar)
+static int simdWidth(void) {
+	static int width = -1;
+	if (width < 0) {
+		width = 0;
+#ifdef SIMD_X86
+		if (!getenv("NO_SIMD")) {
+			width = (__builtin_cpu_supports("avx2")? 32 : 16);
+		}
+#endif
+	}
+	return width;
+}
+
+#ifdef SIMD_X86
+//Count newlines (and word starts if WORDS) in the 16-byte blocks of BUF, return the number of bytes consumed
+static size_t countSSE2(const char* buf, size_t len, size_t* lines, size_t* words, bool* inWord) {
+	const __m128i newline = _mm_set1_epi8('\n'), blank = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), four = _mm_set1_epi8(4);
+	unsigned previous = !*inWord;           //Bit 0: byte before the block was white space
+	size_t i = 0;
+	for ( ; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (buf + i));
+		*lines += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)));
+		if (words != NULL) {
+			__m128i control = _mm_sub_epi8(v, tab);     //\t..\r become 0..4
+			__m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, blank), _mm_cmpeq_epi8(_mm_min_epu8(control, four), control));
+			unsigned spaces = _mm_movemask_epi8(space);
+			*words += __builtin_popcount(~spaces & ((spaces << 1) | previous) & 0xFFFF); //Non-space after space
+			previous = spaces >> 15;
+		}
+	}
+	*inWord = !previous;
+	return i;
+}
+
+//AVX2 version of countSSE2()
+__attribute__((target("avx2")))
+static size_t countAVX2(const char* buf, size_t len, size_t* lines, size_t* words, bool* inWord) {
+	const __m256i newline = _mm256_set1_epi8('\n'), blank = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'), four = _mm256_set1_epi8(4);
+	unsigned previous = !*inWord;
+	size_t i = 0;
+	for ( ; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i*) (buf + i));
+		*lines += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline)));
+		if (words != NULL) {
+			__m256i control = _mm256_sub_epi8(v, tab);
+			__m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(v, blank), _mm256_cmpeq_epi8(_mm256_min_epu8(control, four), control));
+			unsigned spaces = _mm256_movemask_epi8(space);
+			*words += __builtin_popcount(~spaces & ((spaces << 1) | previous));
+			previous = spaces >> 31;
+		}
+	}
+	*inWord = !previous;
+	return i;
+}
+#endif
+
+//Count newlines (and words if WORDS is not NULL) in the LEN bytes at BUF. *INWORD carries word state across calls
+void countText(const char* buf, size_t len, size_t* lines, size_t* words, bool* inWord) {
+	size_t i = 0;
+#ifdef SIMD_X86
+	if (simdWidth() == 32) {
+		i = countAVX2(buf, len, lines, words, inWord);
+	}
+	else if (simdWidth() == 16) {
+		i = countSSE2(buf, len, lines, words, inWord);
+	}
+#endif
+	for ( ; i < len; i++) {
+		unsigned char c = buf[i];
+		*lines += (c == '\n');
+		if (words != NULL) {
+			bool space = (c == ' ' || (c >= '\t' && c <= '\r'));
+			*words += (!space && !*inWord);
+			*inWord = !space;
+		}
+	}
+}
+
+//Print counts the way wc prints them for standard input
+int printCounts(stream* out, bool showLines, bool showWords, bool showBytes, size_t lines, size_t words, size_t bytes) {
+	char text[80];
+	int fields = showLines + showWords + showBytes;
+	int width = (fields == 1? 1 : 7);
+	int length = 0;
+	if (showLines) {
+		length += sprintf(text + length, "%*zu", width, lines);
+	}
+	if (showWords) {
+		length += sprintf(text + length, "%s%*zu", (length? " " : ""), width, words);
+	}
+	if (showBytes) {
+		length += sprintf(text + length, "%s%*zu", (length? " " : ""), width, bytes);
+	}
+	text[length++] = '\n';
+	return streamWrite(out, text, length);
+}
+
+//wc [-lwc]: count standard input
+static int filterWc(char** argv, stream* in, stream* out) {
+	bool showLines, showWords, showBytes, inWord = false;
+	wcOptions(argv, &showLines, &showWords, &showBytes);
+	size_t lines = 0, words = 0, bytes = 0;
+	char* buffer = malloc(BATCH_SIZE);
+	ssize_t n;
+	while ((n = streamRead(in, buffer, BATCH_SIZE)) > 0) {
+		countText(buffer, n, &lines, (showWords? &words : NULL), &inWord);
+		bytes += n;
+	}
+	free(buffer);
+	if (printCounts(out, showLines, showWords, showBytes, lines, words, bytes) == -1) {
+		return writeFailure(argv[0]);
+	}
+	return 0;
+}
+
+//Parse "grep -F PATTERN" (or "grep PATTERN" without regex metacharacters), return the pattern or NULL
+char* grepPattern(char** argv) {
+	if (argv[1] != NULL && strcmp(argv[1], "-F") == 0 && argv[2] != NULL && argv[3] == NULL) {
+		return argv[2];
+	}
+	if (argv[1] != NULL && argv[1][0] != '-' && argv[2] == NULL && strpbrk(argv[1], ".[]*^$\\") == NULL) {
+		return argv[1];
+	}
+	return NULL;
+}
+
+#ifdef SIMD_X86
+//Find PATTERN (LEN >= 2) by comparing its first and last bytes against 16 positions at once, then memcmp
+static const char* findSSE2(const char* text, size_t size, const char* pattern, size_t len) {
+	const __m128i first = _mm_set1_epi8(pattern[0]), last = _mm_set1_epi8(pattern[len - 1]);
+	size_t i = 0;
+	for ( ; i + len - 1 + 16 <= size; i += 16) {
+		__m128i head = _mm_loadu_si128((const __m128i*) (text + i));
+		__m128i tail = _mm_loadu_si128((const __m128i*) (text + i + len - 1));
+		unsigned candidates = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+		for ( ; candidates != 0; candidates &= candidates - 1) {
+			size_t at = i + __builtin_ctz(candidates);
+			if (memcmp(text + at + 1, pattern + 1, len - 2) == 0) {
+				return text + at;
+			}
+		}
+	}
+	return memmem(text + i, size - i, pattern, len);
+}
+
+//AVX2 version of findSSE2()
+__attribute__((target("avx2")))
+static const char* findAVX2(const char* text, size_t size, const char* pattern, size_t len) {
+	const __m256i first = _mm256_set1_epi8(pattern[0]), last = _mm256_set1_epi8(pattern[len - 1]);
+	size_t i = 0;
+	for ( ; i + len - 1 + 32 <= size; i += 32) {
+		__m256i head = _mm256_loadu_si256((const __m256i*) (text + i));
+		__m256i tail = _mm256_loadu_si256((const __m256i*) (text + i + len - 1));
+		unsigned candidates = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first), _mm256_cmpeq_epi8(tail, last)));
+		for ( ; candidates != 0; candidates &= candidates - 1) {
+			size_t at = i + __builtin_ctz(candidates);
+			if (memcmp(text + at + 1, pattern + 1, len - 2) == 0) {
+				return text + at;
+			}
+		}
+	}
+	return memmem(text + i, size - i, pattern, len);
+}
+#endif
+
+//Return the first occurrence of the LEN-byte PATTERN in the SIZE bytes at TEXT, or NULL
+const char* findFixed(const char* text, size_t size, const char* pattern, size_t len) {
+	if (len < 2 || size < len) {
+		return (len == 0? text : (len == 1? memchr(text, pattern[0], size) : NULL));
+	}
+#ifdef SIMD_X86
+	if (simdWidth() == 32) {
+		return findAVX2(text, size, pattern, len);
+	}
+	else if (simdWidth() == 16) {
+		return findSSE2(text, size, pattern, len);
+	}
+#endif
+	return memmem(text, size, pattern, len);
+}
+
+//grep -F PATTERN: copy the lines containing PATTERN, exit status 1 if there were none
+static int filterGrep(char** argv, stream* in, stream* out) {
+	char* pattern = grepPattern(argv);
+	size_t patternLen = strlen(pattern);
+	bool matched = false;
+	size_t capacity = 2 * BATCH_SIZE, kept = 0; //kept = bytes of an unfinished line at the start of buffer
+	char* buffer = malloc(capacity);
+	ssize_t n;
+	for ( ; ; ) {
+		if (capacity - kept < BATCH_SIZE) { //Very long line, make room
+			capacity *= 2;
+			buffer = realloc(buffer, capacity);
+		}
+		n = streamRead(in, buffer + kept, capacity - kept);
+		if (n < 0) {
+			break;
+		}
+		size_t size = kept + n;
+		if (n == 0 && size > 0 && buffer[size - 1] != '\n') {
+			buffer[size++] = '\n';          //Unterminated last line (there is always room: n == 0)
+		}
+		char* line = buffer;
+		char* end = buffer + size;
+		char* hit;
+		while (line < end && (hit = (char*) findFixed(line, end - line, pattern, patternLen)) != NULL) {
+			char* start = memrchr(line, '\n', hit - line);
+			start = (start == NULL? line : start + 1);
+			char* stop = memchr(hit, '\n', end - hit); //PATTERN itself never holds a newline
+			if (stop == NULL) {             //Match in the unfinished line, wait for the rest
+				line = start;
+				break;
+			}
+			matched = true;
+			if (streamWrite(out, start, stop + 1 - start) == -1) {
+				free(buffer);
+				return writeFailure(argv[0]);
+			}
+			line = stop + 1;
+		}
+		if (n == 0) {
+			break;
+		}
+		char* last = memrchr(line, '\n', end - line); //Everything before the last newline has been searched
+		if (last != NULL) {
+			line = last + 1;
+		}
+		kept = end - line;
+		memmove(buffer, line, kept);
+	}
+	free(buffer);
+	return (matched? 0 : 1);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Running a run of filter stages as threads
+
+typedef int (*filterFn)(char** argv, stream* in, stream* out);
+
+//Filter implementing ARGV, or NULL if ARGV has to be run externally
+static filterFn findFilter(char** argv) {
+	long lines;
+	bool l, w, c;
+	if (strcmp(argv[0], "cat") == 0) {
+		for (char** arg = argv + 1; *arg; arg++) {
+			if ((*arg)[0] == '-' && (*arg)[1] != '\0') {
+				return NULL;
+			}
+		}
+		return filterCat;
+	}
+	else if (strcmp(argv[0], "head") == 0 && lineOption(argv, &lines)) {
+		return filterHead;
+	}
+	else if (strcmp(argv[0], "tail") == 0 && lineOption(argv, &lines)) {
+		return filterTail;
+	}
+	else if (strcmp(argv[0], "wc") == 0 && wcOptions(argv, &l, &w, &c)) {
+		return filterWc;
+	}
+	else if (strcmp(argv[0], "grep") == 0 && grepPattern(argv) != NULL) {
+		return filterGrep;
+	}
+	return NULL;
+}
+
+//Can STAGE of a pipeline run as a filter thread?
+bool threadableStage(const CMD* stage) {
+	return stage->type == SIMPLE && stage->nLocal == 0 && stage->fromType == NONE && stage->toType == NONE
+		&& stage->errType == NONE && findFilter(stage->argv) != NULL;
+}
+
+typedef struct stageThread {
+	pthread_t thread;
+	char** argv;
+	stream in, out;
+	int status;
+} stageThread;
+
+static void* runFilter(void* arg) {
+	stageThread* stage = arg;
+	stage->status = findFilter(stage->argv)(stage->argv, &stage->in, &stage->out);
+	streamClose(&stage->out, true);
+	streamClose(&stage->in, false);
+	return NULL;
+}
+
+//Run the COUNT filter STAGES as threads reading fd 0 and writing fd 1; return the status of the last stage that failed
+int runStageThreads(const CMD** stages, int count) {
+	stageThread* threads = malloc(sizeof(stageThread) * count);
+	channel** rings = malloc(sizeof(channel*) * count);
+	for (int i = 0; i < count; i++) {
+		threads[i].argv = stages[i]->argv;
+		streamOpen(&threads[i].in, 0, false);
+		streamOpen(&threads[i].out, 1, true);
+		if (i > 0) {
+			rings[i] = calloc(1, sizeof(channel));
+			threads[i-1].out.ring = rings[i];
+			threads[i].in.ring = rings[i];
+		}
+	}
+
+	for (int i = 1; i < count; i++) {
+		if (pthread_create(&threads[i].thread, NULL, runFilter, &threads[i]) != 0) {
+			DIE("%s: cannot create thread\n", stages[i]->argv[0]);
+		}
+	}
+	runFilter(&threads[0]);                 //First stage runs on the main thread
+
+	int status = threads[0].status;
+	for (int i = 1; i < count; i++) {
+		pthread_join(threads[i].thread, NULL);
+		free(rings[i]);
+		if (threads[i].status != 0) {
+			status = threads[i].status;
+		}
+	}
+	free(rings);
+	free(threads);
+	return status;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Filters as builtins on file descriptors
+
+//Run FILTER on fds IN and OUT (which stay open)
+static int runOnFds(filterFn filter, char** argv, int in, int out) {
+	stream input, output;
+	streamOpen(&input, in, false);
+	streamOpen(&output, out, true);
+	int status = filter(argv, &input, &output);
+	if (streamFlush(&output) == -1 && status == 0) {
+		status = writeFailure(argv[0]);
+	}
+	free(output.batch);
+	return status;
+}
+
+static int builtinHead(char** argv, int in, int out) {
+	return runOnFds(filterHead, argv, in, out);
+}
+
+static int builtinTail(char** argv, int in, int out) {
+	return runOnFds(filterTail, argv, in, out);
+}
+
+static int builtinWc(char** argv, int in, int out) {
+	return runOnFds(filterWc, argv, in, out);
+}
+
+static int builtinGrep(char** argv, int in, int out) {
+	return runOnFds(filterGrep, argv, in, out);
+}
+
+//Builtin for the head, tail, wc or grep -F command ARGV, or NULL if it has to be run externally
+builtinFn filterBuiltin(char** argv) {
+	filterFn filter = findFilter(argv);
+	return (filter == filterHead? builtinHead : filter == filterTail? builtinTail
+		: filter == filterWc? builtinWc : filter == filterGrep? builtinGrep : NULL);
+}
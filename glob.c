@@ -0,0 +1,430 @@
+// glob.c
+//
+// Pathname expansion (enabled by GLOB).  When a simple command is about to
+// run -- in process(), as a stage of a pipeline, or as a $(...) builtin --
+// every argument that contains *, ? or [...] is replaced by the sorted list
+// of the paths it matches, or left alone if there are none (as in bash).  So
+// in "touch new.c ; ls *.c" the ls sees new.c, and a pipeline's stages are
+// expanded together as it starts.  Redirection targets are not expanded.
+// With PARALLEL, a command with a pattern is a barrier (see schedule.c),
+// since the files it uses are only known once it runs.  Names
+// starting with . are only matched by a component starting with a literal .,
+// and a trailing / matches directories only.  The parser has already removed
+// quotes, so a quoted pattern is expanded too; a \ before a metacharacter
+// still makes it literal.
+//
+// Each component of a pattern is compiled once into a sequence of byte sets
+// and stars and then matched against every name with a backtracking matcher
+// that never backs up more than one star.  Directories are read with
+// getdents64 into a single buffer per directory, and the last
+// LISTING_CACHE_SIZE listings are kept for later globs: a listing is reused
+// while stat() shows the directory with the same inode and mtime.  A listing
+// read less than two seconds after the directory last changed is re-read on
+// its next use, since a change within the same clock tick would not move the
+// mtime.
+
+#include "process.h"
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define LISTING_CACHE_SIZE 16       //Directory listings kept
+#define DIRENT_BUFFER (256 * 1024)  //Bytes read per getdents64 call
+
+//Record returned by getdents64
+struct linuxDirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+//One element of a compiled pattern component: a star, or a set of bytes matching one character
+typedef struct globToken {
+	bool star;
+	unsigned char set[32];          //Bit c is set if byte c matches
+} globToken;
+
+//Names in a directory
+typedef struct listing {
+	char* path;                     //NULL if the slot is free
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	bool racy;                      //Read too soon after the last change to be reused
+	char* names;                    //All names, NUL-terminated, back to back
+	size_t* offsets;                //Offset of each name in names
+	unsigned char* types;           //d_type of each name
+	int count;
+	unsigned long used;
+} listing;
+
+//Matched paths of one pattern
+typedef struct matchList {
+	char** paths;
+	int count;
+} matchList;
+
+static listing listings[LISTING_CACHE_SIZE];
+static unsigned long tick = 0;
+
+//Is byte C in the set of token T?
+static bool inSet(const globToken* t, unsigned char c) {
+	return t->set[c >> 3] & (1 << (c & 7));
+}
+
+//Add byte C to the set of token T
+static void addToSet(globToken* t, unsigned char c) {
+	t->set[c >> 3] |= 1 << (c & 7);
+}
+
+//Length of the bracket expression starting at P (at a '['), or 0 if it is not terminated
+static size_t bracketLength(const char* p) {
+	size_t i = 1;
+	if (p[i] == '!' || p[i] == '^') {
+		i++;
+	}
+	if (p[i] == ']') {              //A leading ] is literal
+		i++;
+	}
+	while (p[i] != '\0' && p[i] != ']') {
+		i++;
+	}
+	return (p[i] == ']'? i + 1 : 0);
+}
+
+//Does pattern word P contain an unescaped *, ? or [...]?
+static bool hasGlob(const char* p) {
+	for ( ; *p; p++) {
+		if (*p == '\\' && p[1] != '\0') {
+			p++;
+		}
+		else if (*p == '*' || *p == '?' || (*p == '[' && bracketLength(p) > 0)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+//Compile the pattern component P into *TOKENS; returns the number of tokens
+static int compileComponent(const char* p, globToken** tokens) {
+	*tokens = malloc(sizeof(globToken) * (strlen(p) + 1));
+	int n = 0;
+	while (*p) {
+		globToken* t = &(*tokens)[n];
+		memset(t, 0, sizeof(*t));
+		size_t length;
+		if (*p == '*') {
+			if (n == 0 || !(*tokens)[n - 1].star) { //** is the same as *
+				t->star = true;
+				n++;
+			}
+			p++;
+			continue;
+		}
+		if (*p == '?') {
+			memset(t->set, 0xff, sizeof(t->set));
+			p++;
+		}
+		else if (*p == '[' && (length = bracketLength(p)) > 0) {
+			bool negate = (p[1] == '!' || p[1] == '^');
+			for (size_t i = (negate? 2 : 1); i < length - 1; i++) {
+				unsigned char low = p[i];
+				if (i + 2 < length - 1 && p[i + 1] == '-') { //Range a-z
+					for (unsigned c = low; c <= (unsigned char) p[i + 2]; c++) {
+						addToSet(t, c);
+					}
+					i += 2;
+				}
+				else {
+					addToSet(t, low);
+				}
+			}
+			if (negate) {
+				for (size_t i = 0; i < sizeof(t->set); i++) {
+					t->set[i] = ~t->set[i];
+				}
+			}
+			t->set[0] &= ~1;            //Never matches NUL
+			p += length;
+		}
+		else {
+			if (*p == '\\' && p[1] != '\0') {
+				p++;
+			}
+			addToSet(t, *p++);
+		}
+		n++;
+	}
+	return n;
+}
+
+//Does NAME match the N compiled TOKENS?
+static bool matchName(const globToken* tokens, int n, const char* name) {
+	int t = 0, starT = -1;
+	const char* s = name;
+	const char* starS = NULL;
+	while (*s) {
+		if (t < n && tokens[t].star) {  //Let the star match nothing for now
+			starT = ++t;
+			starS = s;
+		}
+		else if (t < n && inSet(&tokens[t], *s)) {
+			t++;
+			s++;
+		}
+		else if (starT >= 0) {          //Let the last star match one more byte
+			t = starT;
+			s = ++starS;
+		}
+		else {
+			return false;
+		}
+	}
+	while (t < n && tokens[t].star) {
+		t++;
+	}
+	return t == n;
+}
+
+//Read directory PATH (already stat'ed as INFO) into listing L with getdents64; false with errno set on error
+static bool readListing(listing* l, const char* path, const struct stat* info) {
+	int fd = openFd(path, O_RDONLY | O_DIRECTORY, 0);
+	if (fd < 0) {
+		return false;
+	}
+	char* buffer = malloc(DIRENT_BUFFER);
+	size_t capacity = 4096, used = 0;
+	int slots = 64;
+	l->names = malloc(capacity);
+	l->offsets = malloc(sizeof(size_t) * slots);
+	l->types = malloc(slots);
+	l->count = 0;
+	long n;
+	while ((n = syscall(SYS_getdents64, fd, buffer, DIRENT_BUFFER)) > 0) {
+		for (long pos = 0; pos < n; pos += ((struct linuxDirent64*) (buffer + pos))->d_reclen) {
+			struct linuxDirent64* d = (struct linuxDirent64*) (buffer + pos);
+			if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+				continue;
+			}
+			size_t length = strlen(d->d_name) + 1;
+			while (used + length > capacity) {
+				REALLOC(l->names, capacity *= 2);
+			}
+			if (l->count == slots) {
+				REALLOC(l->offsets, slots *= 2);
+				REALLOC(l->types, slots);
+			}
+			memcpy(l->names + used, d->d_name, length);
+			l->offsets[l->count] = used;
+			l->types[l->count++] = d->d_type;
+			used += length;
+		}
+	}
+	int error = errno;
+	free(buffer);
+	close(fd);
+	if (n < 0) {
+		free(l->names);
+		free(l->offsets);
+		free(l->types);
+		errno = error;
+		return false;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	l->path = strdup(path);
+	l->dev = info->st_dev;
+	l->ino = info->st_ino;
+	l->mtime = info->st_mtim;
+	l->racy = (now.tv_sec - info->st_mtim.tv_sec < 2);
+	l->used = ++tick;
+	return true;
+}
+
+//Release listing L
+static void freeListing(listing* l) {
+	free(l->path);
+	free(l->names);
+	free(l->offsets);
+	free(l->types);
+	l->path = NULL;
+}
+
+//Names in directory PATH, from the cache if the directory hasn't changed; NULL on error
+static listing* directoryListing(const char* path) {
+	struct stat info;
+	if (stat(path, &info) == -1 || !S_ISDIR(info.st_mode)) {
+		return NULL;
+	}
+	listing* slot = &listings[0];
+	for (int i = 0; i < LISTING_CACHE_SIZE; i++) {
+		listing* l = &listings[i];
+		if (l->path != NULL && strcmp(l->path, path) == 0) {
+			if (!l->racy && l->dev == info.st_dev && l->ino == info.st_ino
+					&& l->mtime.tv_sec == info.st_mtim.tv_sec && l->mtime.tv_nsec == info.st_mtim.tv_nsec) {
+				l->used = ++tick;
+				return l;
+			}
+			slot = l;                   //Stale: re-read into the same slot
+			break;
+		}
+		if (l->path == NULL || (slot->path != NULL && l->used < slot->used)) {
+			slot = l;
+		}
+	}
+	if (slot->path != NULL) {
+		freeListing(slot);
+	}
+	return (readListing(slot, path, &info)? slot : NULL);
+}
+
+//PREFIX joined to NAME with a / if needed
+static char* joinPath(const char* prefix, const char* name) {
+	size_t length = strlen(prefix);
+	char* path = malloc(length + strlen(name) + 2);
+	sprintf(path, "%s%s%s", prefix, (length == 0 || prefix[length - 1] == '/'? "" : "/"), name);
+	return path;
+}
+
+//Add PATH (taken over) to the matches
+static void addMatch(matchList* matches, char* path) {
+	REALLOC(matches->paths, matches->count + 1);
+	matches->paths[matches->count++] = path;
+}
+
+//Match COMPONENTS[I..N-1] below directory PREFIX ("" for the current directory); DIRECTORY is set if the
+//pattern ended with / and so only matches directories
+static void expandComponents(const char* prefix, char** components, int i, int n, bool directory, matchList* matches) {
+	bool last = (i == n - 1);
+	if (!hasGlob(components[i])) {      //No need to list the directory
+		char* path = joinPath(prefix, components[i]);
+		struct stat info;
+		if (!last) {
+			expandComponents(path, components, i + 1, n, directory, matches);
+			free(path);
+		}
+		else if ((directory? stat(path, &info) == 0 && S_ISDIR(info.st_mode) : lstat(path, &info) == 0)) {
+			addMatch(matches, path);
+		}
+		else {
+			free(path);
+		}
+		return;
+	}
+
+	listing* l = directoryListing(prefix[0] == '\0'? "." : prefix);
+	if (l == NULL) {
+		return;
+	}
+	globToken* tokens;
+	int nTokens = compileComponent(components[i], &tokens);
+	bool dots = (components[i][0] == '.');
+	int count = l->count;                   //Recursion may evict l, so collect the names first
+	char** names = malloc(sizeof(char*) * (count + 1));
+	int nNames = 0;
+	for (int k = 0; k < count; k++) {
+		const char* name = l->names + l->offsets[k];
+		if ((name[0] != '.' || dots) && matchName(tokens, nTokens, name)) {
+			unsigned char type = l->types[k];
+			char* path = joinPath(prefix, name);
+			struct stat info;
+			if ((last && !directory) || type == DT_DIR
+					|| ((type == DT_LNK || type == DT_UNKNOWN) && stat(path, &info) == 0 && S_ISDIR(info.st_mode))) {
+				names[nNames++] = path;
+			}
+			else {
+				free(path);
+			}
+		}
+	}
+	free(tokens);
+	for (int k = 0; k < nNames; k++) {
+		if (last) {
+			addMatch(matches, names[k]);
+		}
+		else {
+			expandComponents(names[k], components, i + 1, n, directory, matches);
+			free(names[k]);
+		}
+	}
+	free(names);
+}
+
+//qsort() comparison of two paths
+static int comparePaths(const void* a, const void* b) {
+	return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+//Expand the pattern WORD into the sorted list of paths it matches
+static matchList expandWord(const char* word) {
+	matchList matches = {NULL, 0};
+	char* copy = strdup(word);
+	size_t length = strlen(copy);
+	bool directory = (length > 1 && copy[length - 1] == '/');
+	char** components = malloc(sizeof(char*) * (length + 1));
+	int n = 0;
+	for (char* p = strtok(copy, "/"); p != NULL; p = strtok(NULL, "/")) {
+		components[n++] = p;
+	}
+	if (n > 0) {
+		expandComponents((word[0] == '/'? "/" : ""), components, 0, n, directory, &matches);
+	}
+	for (int k = 0; directory && k < matches.count; k++) {
+		char* path = joinPath(matches.paths[k], "");
+		free(matches.paths[k]);
+		matches.paths[k] = path;
+	}
+	qsort(matches.paths, matches.count, sizeof(char*), comparePaths);
+	free(components);
+	free(copy);
+	return matches;
+}
+
+bool hasGlobs(const CMD* cmd) {
+	if (!getenv("GLOB") || cmd->type != SIMPLE) {
+		return false;
+	}
+	for (int i = 0; i < cmd->argc; i++) {
+		if (hasGlob(cmd->argv[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void expandGlobs(const CMD* cmd) {
+	if (!hasGlobs(cmd)) {
+		return;
+	}
+	CMD* c = (CMD*) cmd;                //The shell's own tree: freeCMD() frees whatever argv holds
+	for (int i = 0; i < c->argc; i++) {
+		if (!hasGlob(c->argv[i])) {
+			continue;
+		}
+		matchList matches = expandWord(c->argv[i]);
+		if (matches.count == 0) {       //No match: the word stays as it is
+			continue;
+		}
+		REALLOC(c->argv, c->argc + matches.count);
+		memmove(c->argv + i + matches.count, c->argv + i + 1, sizeof(char*) * (c->argc - i)); //Including the NULL
+		free(c->argv[i]);
+		memcpy(c->argv + i, matches.paths, sizeof(char*) * matches.count);
+		c->argc += matches.count - 1;
+		i += matches.count - 1;
+		free(matches.paths);
+	}
+}
+
+void globMemory(memoryUsage* u) {
+	for (int i = 0; i < LISTING_CACHE_SIZE; i++) {
+		if (listings[i].path != NULL) {
+			countBlock(u, listings[i].path);
+			countBlock(u, listings[i].names);
+			countBlock(u, listings[i].offsets);
+			countBlock(u, listings[i].types);
+		}
+	}
+}
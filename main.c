@@ -5,6 +5,13 @@
 //
 // Bash version based on expression tree
 // Dumps token list or CMD tree if DUMP_LIST or DUMP_TREE is set.
+// Replaces $(COMMAND) by the output of COMMAND (see subst.c).
+// Expands *, ? and [...] in arguments as commands run if GLOB is set (glob.c).
+// Optimizes the CMD tree if OPTIMIZE is set (dumped again if DUMP_OPTIMIZED).
+// Skips up-to-date COMMAND < IN > OUT lines if INCREMENTAL is set (uptodate.c).
+// Serves command lines over the Unix socket $SHELL_SERVER if set (see server.c).
+// Reports fds left open after each command line if FD_CHECK is set (fd.c).
+// Closes the coprocesses started by coproc when it exits (coproc.c).
 
 #include "process.h"
 
@@ -18,14 +25,27 @@ int main()
     setenv ("?", "0", 1);                       // Initial status
 
     setvbuf (stdin, NULL, _IONBF, 1);           // Disable buffering of stdin
+    noteInheritedFds ();                        // Not leaks, whatever they are
+    startShell ();                              // Not a subshell
+
+    if (getenv ("SHELL_SERVER"))                // Run requests from clients
+	return serveRequests (getenv ("SHELL_SERVER"));  //   instead of stdin
+
+    if (getenv ("ZYGOTE"))                      // Fork spawn helper while the
+	startZygote ();                         //   shell is still small
 
     size_t nLine = 0;                           // #chars allocated
     for ( ; ; ) {
 	printf ("(%d)$ ", nCmd);                // Prompt for command
 	fflush (stdout);
 
-	if (getline (&line,&nLine, stdin) <= 0) // Read line
+	if (getline (&line,&nLine, stdin) <= 0) { // Read line
+	    if (ferror (stdin) && errno == EINTR) {  //   Prompt again after
+		clearerr (stdin);               //     a Ctrl-C
+		continue;
+	    }
 	    break;                              //   Break on end of file
+	}
 
 	list = tokenize (line);                 // Lex line into tokens
 	if (list == NULL)
@@ -33,6 +53,9 @@ int main()
 	else if (getenv ("DUMP_LIST"))          // Dump token list only if
 	    dumpList (list);                    //   environment variable set
 
+	if (!substituteCommands (&list) || list == NULL)  // Run $(...)
+	    continue;
+
 	cmd = parse (list);                     // Parsed command
 	freeList (list);                        // Free token list
 	if (cmd == NULL)
@@ -43,6 +66,16 @@ int main()
 	    fflush (stdout);
 	}
 
+	if (getenv ("OPTIMIZE")) {              // Rewrite command tree if
+	    cmd = optimize (cmd);               //   environment variable set
+	    if (getenv ("DUMP_OPTIMIZED")) {    // Dump rewritten tree and
+		dumpTree (cmd, 0);              //   rewrite counts
+		dumpOptimizeStats ();
+		printf ("\n");
+		fflush (stdout);
+	    }
+	}
+
 	process (cmd);                          // Execute command
 
 	if (getenv ("DUMP_TREE_AGAIN")) {       // Dump command tree again if
@@ -52,9 +85,15 @@ int main()
 	}
 
 	freeCMD (cmd);                          // Free CMD tree
+	checkFds ();                            // Report leaked fds if FD_CHECK
 	nCmd++;                                 // Adjust prompt
     }
 
+    closeCoprocs ();                            // EOF, then SIGTERM if need be
+
+    if (getenv ("INCREMENTAL"))                 // Report skipped commands
+	dumpUpToDateStats ();
+
     free (line);
     return EXIT_SUCCESS;
 }
@@ -108,12 +147,9 @@ CMD *mallocCMD (void)
 }
 
 
-// Free tree of commands rooted at *C
-void freeCMD (CMD *c)
+// Free the command structure *C itself, not its children
+static void freeNode (CMD *c)
 {
-    if (!c)
-	return;
-
     for (int i = 0; i < c->nLocal; i++) {
 	free (c->locVar[i]);
 	free (c->locVal[i]);
@@ -129,13 +165,30 @@ void freeCMD (CMD *c)
     free (c->toFile);
     free (c->errFile);
 
-    freeCMD (c->left);
-    freeCMD (c->right);
-
     free (c);
 }
 
 
+// Free tree of commands rooted at *C, without recursion: a node with a left
+// child is first rotated right, so a left-deep tree of any depth (a long
+// chain of ;, && or |) takes no stack
+void freeCMD (CMD *c)
+{
+    while (c) {
+	if (c->left) {                          // Rotate right
+	    CMD *left = c->left;
+	    c->left = left->right;
+	    left->right = c;
+	    c = left;
+	    continue;
+	}
+	CMD *right = c->right;
+	freeNode (c);
+	c = right;
+    }
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 // Dump CMD structure in tree format
 
@@ -224,14 +277,9 @@ void dumpRedirect (CMD *c)
 }
 
 
-// Print in in-order command data structure rooted at *C at depth LEVEL
-void dumpTree (CMD *c, int level)
+// Print the command data structure *C (not its children) at depth LEVEL
+static void dumpNode (CMD *c, int level)
 {
-    if (!c)
-	return;
-
-    dumpTree (c->left, level+1);
-
 ////fprintf (stdout, "CMD (Level = %d):  ", level);
     fprintf (stdout, "CMD (Depth = %d):  ", level);
 
@@ -288,6 +336,34 @@ void dumpTree (CMD *c, int level)
     }
 
     fprintf (stdout, "\n");
+}
+
+
+// Print in in-order command data structure rooted at *C at depth LEVEL,
+// with a stack of the nodes whose left subtrees are being printed rather
+// than recursion
+void dumpTree (CMD *c, int level)
+{
+    struct pending {                            // Node and its depth
+	CMD *c;
+	int level;
+    } *stack = NULL;
+    int nStack = 0, room = 0;
 
-    dumpTree (c->right, level+1);
+    for ( ; ; ) {
+	for ( ;  c;  c = c->left, level++) {    // Walk down left spine
+	    if (nStack == room)
+		REALLOC (stack, room = (room ? 2*room : 16));
+	    stack[nStack].c = c;
+	    stack[nStack++].level = level;
+	}
+	if (nStack == 0)
+	    break;
+	c = stack[--nStack].c;                  // Print deepest pending node
+	level = stack[nStack].level;
+	dumpNode (c, level);
+	c = c->right;                           //   and then its right
+	level++;                                //   subtree
+    }
+    free (stack);
 }
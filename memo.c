@@ -0,0 +1,352 @@
+// memo.c
+//
+// The cache builtin: memoize the results of deterministic commands.
+//
+//   cache [-i FILE]... [-e NAME]... COMMAND [ARG]...
+//   cache -s
+//
+// The key of a run is a 128-bit FNV-1a hash of COMMAND's argv, its local
+// assignments, the current directory, the variables named with -e, the
+// contents of its < file (or here document) and of every input FILE declared
+// with -i.  On a hit the stored stdout (to the > / >> redirection, if any),
+// stderr and exit status are replayed without forking.  On a miss COMMAND is
+// run through executeSingle() with stdout and stderr captured, the result is
+// stored and then replayed.  COMMAND reads /dev/null unless it has a <
+// redirection, and its output only appears once it has finished.  Only runs
+// that exit with status 0 are stored: a command that could not be executed
+// exits with its errno (ENOENT, EACCES, ...), which can't be told from a
+// status of its own, and must not be replayed once it has been installed.
+//
+// Results live in $CACHE_DIR (default ${XDG_CACHE_HOME:-$HOME/.cache}/minibash),
+// one directory per key holding stdout, stderr and status.  A hit touches
+// status, and the store is trimmed to $CACHE_SIZE bytes (default 64 MiB) by
+// evicting the least recently used entries.  "cache -s" prints hit/miss counts.
+
+#include "process.h"
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define CACHE_SIZE_DEFAULT (64L << 20)
+#define HASH_BUFFER (128 * 1024)
+
+#define FNV_PRIME ((((hash128) 1) << 88) | 0x13b)
+
+//Number of lookups, stores and evictions in this shell
+static struct {
+	int hits;
+	int misses;
+	int stored;
+	int evicted;
+} memoStats;
+
+//Add the LEN bytes of BUF to hash *H
+void hashBytes(hash128* h, const void* buf, size_t len) {
+	const unsigned char* p = buf;
+	for (size_t i = 0; i < len; i++) {
+		*h = (*h ^ p[i]) * FNV_PRIME;
+	}
+}
+
+//Add the string S, including its NUL (so that adjacent strings can't run together), to hash *H
+void hashString(hash128* h, const char* s) {
+	hashBytes(h, s, strlen(s) + 1);
+}
+
+//Add the name and contents of FILE to hash *H; false with errno set if it can't be read
+bool hashFile(hash128* h, const char* file) {
+	int fd = openFd(file, O_RDONLY, 0);
+	if (fd < 0) {
+		return false;
+	}
+	hashString(h, file);
+	char* buffer = malloc(HASH_BUFFER);
+	ssize_t n;
+	while ((n = read(fd, buffer, HASH_BUFFER)) > 0 || (n < 0 && errno == EINTR)) {
+		if (n > 0) {
+			hashBytes(h, buffer, n);
+		}
+	}
+	int error = errno;
+	free(buffer);
+	close(fd);
+	errno = error;
+	return n == 0;
+}
+
+//Directory holding the cache (created if needed), or NULL with errno set
+static char* storeDirectory(void) {
+	static char* directory = NULL;
+	if (directory != NULL) {
+		return directory;
+	}
+	char* path;
+	if (getenv("CACHE_DIR")) {
+		path = strdup(getenv("CACHE_DIR"));
+	}
+	else if (getenv("XDG_CACHE_HOME") || getenv("HOME")) {
+		const char* base = getenv("XDG_CACHE_HOME");
+		path = malloc(strlen(base? base : getenv("HOME")) + sizeof("/.cache/minibash"));
+		sprintf(path, "%s%s", (base? base : getenv("HOME")), (base? "/minibash" : "/.cache/minibash"));
+	}
+	else {
+		errno = ENOENT;
+		return NULL;
+	}
+	for (char* slash = strchr(path + 1, '/'); ; slash = strchr(slash + 1, '/')) { //mkdir -p
+		if (slash != NULL) {
+			*slash = '\0';
+		}
+		if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+			free(path);
+			return NULL;
+		}
+		if (slash == NULL) {
+			break;
+		}
+		*slash = '/';
+	}
+	return directory = path;
+}
+
+//Remove the entry directory NAME in the store open as DIRFD
+static void removeEntry(int dirfd, const char* name) {
+	int entry = openFdAt(dirfd, name, O_RDONLY | O_DIRECTORY, 0);
+	if (entry >= 0) {
+		unlinkat(entry, "stdout", 0);
+		unlinkat(entry, "stderr", 0);
+		unlinkat(entry, "status", 0);
+		close(entry);
+	}
+	unlinkat(dirfd, name, AT_REMOVEDIR);
+}
+
+//Evict least recently used entries until the store fits in $CACHE_SIZE bytes
+static void trimStore(const char* store) {
+	long limit = (getenv("CACHE_SIZE")? atol(getenv("CACHE_SIZE")) : CACHE_SIZE_DEFAULT);
+	DIR* dir = opendir(store);
+	if (dir == NULL) {
+		return;
+	}
+	int count = 0, capacity = 16;
+	struct { char name[33]; time_t used; long size; }* entries = malloc(sizeof(*entries) * capacity);
+	long total = 0;
+	struct dirent* d;
+	while ((d = readdir(dir)) != NULL) {
+		if (strlen(d->d_name) != 32) { //Only finished entries, not "." or temporaries
+			continue;
+		}
+		struct stat info;
+		long size = 0;
+		time_t used = 0;
+		for (int i = 0; i < 3; i++) {
+			char path[NAME_MAX + sizeof("/stdout")];
+			snprintf(path, sizeof(path), "%s/%s", d->d_name, (i == 0? "stdout" : i == 1? "stderr" : "status"));
+			if (fstatat(dirfd(dir), path, &info, 0) == 0) {
+				size += info.st_size;
+				used = info.st_mtime; //status is stat'ed last
+			}
+		}
+		if (count == capacity) {
+			REALLOC(entries, capacity *= 2);
+		}
+		strcpy(entries[count].name, d->d_name);
+		entries[count].used = used;
+		entries[count++].size = size;
+		total += size;
+	}
+	while (total > limit && count > 0) {
+		int oldest = 0;
+		for (int i = 1; i < count; i++) {
+			if (entries[i].used < entries[oldest].used) {
+				oldest = i;
+			}
+		}
+		removeEntry(dirfd(dir), entries[oldest].name);
+		memoStats.evicted++;
+		total -= entries[oldest].size;
+		entries[oldest] = entries[--count];
+	}
+	free(entries);
+	closedir(dir);
+}
+
+//Replay the entry in directory ENTRY for command cmdList: stdout, stderr and exit status
+static void replayEntry(const CMD* cmdList, const char* entry) {
+	char path[PATH_MAX];
+	int status = 1;
+	snprintf(path, sizeof(path), "%s/status", entry);
+	FILE* file = fopen(path, "re");
+	if (file == NULL || fscanf(file, "%d", &status) != 1) {
+		status = 1;
+	}
+	if (file != NULL) {
+		fclose(file);
+	}
+
+	fflush(stdout);
+	int out = openOutput(cmdList);
+	if (out < 0) {
+		errorStatus(cmdList->argv[0], false);
+		return;
+	}
+	for (int i = 0; i < 2; i++) {
+		snprintf(path, sizeof(path), "%s/%s", entry, (i == 0? "stdout" : "stderr"));
+		int fd = openFd(path, O_RDONLY, 0);
+		if (fd >= 0) {
+			copyData(fd, (i == 0? out : 2));
+			close(fd);
+		}
+	}
+	if (out != 1) {
+		close(out);
+	}
+	char buffer[4];
+	sprintf(buffer, "%d", status);
+	setenv("?", buffer, 1);
+}
+
+//Run COMMAND (cmdList minus the cache prefix) with stdout and stderr captured in directory ENTRY
+//Returns its exit status
+static int captureEntry(const CMD* command, const char* entry) {
+	char out[PATH_MAX], err[PATH_MAX];
+	snprintf(out, sizeof(out), "%s/stdout", entry);
+	snprintf(err, sizeof(err), "%s/stderr", entry);
+	int errFd = openFd(err, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	int saved = dupFd(2);
+	if (errFd < 0 || saved < 0) {
+		errorStatus("cache", false);
+		if (errFd >= 0) {
+			close(errFd);
+		}
+		return -1;
+	}
+
+	CMD captured = *command; //Same command, stdout to the entry, stdin from < or /dev/null
+	captured.toType = RED_OUT;
+	captured.toFile = out;
+	if (captured.fromType == NONE) {
+		captured.fromType = RED_IN;
+		captured.fromFile = "/dev/null";
+	}
+	fflush(stderr);
+	dup2(errFd, 2); //Inherited by the child as its stderr
+	close(errFd);
+	executeSingle(&captured);
+	dup2(saved, 2);
+	close(saved);
+	return atoi(getenv("?"));
+}
+
+//Print the statistics of the cache builtin
+static void dumpMemoStats(void) {
+	printf("CACHE:  hits=%d  misses=%d  stored=%d  evicted=%d\n",
+		memoStats.hits, memoStats.misses, memoStats.stored, memoStats.evicted);
+}
+
+void executeCache(const CMD* cmdList) {
+	char** argv = cmdList->argv + 1;
+	hash128 key = FNV_OFFSET;
+	bool usage = false;
+	if (argv[0] != NULL && strcmp(argv[0], "-s") == 0 && argv[1] == NULL) {
+		dumpMemoStats();
+		setenv("?", "0", 1);
+		return;
+	}
+	for ( ; argv[0] != NULL && argv[0][0] == '-'; argv += 2) {
+		if (strcmp(argv[0], "--") == 0) {
+			argv++;
+			break;
+		}
+		if (argv[1] == NULL || (strcmp(argv[0], "-i") != 0 && strcmp(argv[0], "-e") != 0)) {
+			usage = true;
+			break;
+		}
+		if (argv[0][1] == 'i' && !hashFile(&key, argv[1])) {
+			errorStatus(argv[1], false);
+			return;
+		}
+		if (argv[0][1] == 'e') {
+			hashString(&key, argv[1]);
+			hashString(&key, (getenv(argv[1])? getenv(argv[1]) : ""));
+			hashBytes(&key, (getenv(argv[1])? "=" : "-"), 1); //Unset differs from empty
+		}
+	}
+	if (usage || argv[0] == NULL) {
+		fprintf(stderr, "usage: cache [-i FILE]... [-e NAME]... COMMAND [ARG]... OR cache -s\n");
+		setenv("?", "1", 1);
+		return;
+	}
+
+	CMD command = *cmdList; //cmdList without the prefix
+	command.argv = argv;
+	command.argc = cmdList->argc - (argv - cmdList->argv);
+	for (char** arg = argv; *arg; arg++) {
+		hashString(&key, *arg);
+	}
+	for (int i = 0; i < command.nLocal; i++) {
+		hashString(&key, command.locVar[i]);
+		hashString(&key, command.locVal[i]);
+	}
+	char* cwd = getcwd(NULL, 0);
+	hashString(&key, (cwd? cwd : ""));
+	free(cwd);
+	if (command.fromType == RED_IN_HERE) {
+		hashString(&key, command.fromFile);
+	}
+	else if (command.fromType == RED_IN && !hashFile(&key, command.fromFile)) {
+		errorStatus(command.fromFile, false);
+		return;
+	}
+
+	char* store = storeDirectory();
+	if (store == NULL) {
+		errorStatus("cache", false);
+		return;
+	}
+	char name[33];
+	sprintf(name, "%016llx%016llx", (unsigned long long) (key >> 64), (unsigned long long) key);
+	char* entry = malloc(strlen(store) + sizeof(name) + 8);
+	sprintf(entry, "%s/%s", store, name);
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/status", entry);
+	if (access(path, R_OK) == 0) { //Hit
+		memoStats.hits++;
+		utimensat(AT_FDCWD, path, NULL, 0); //Most recently used
+		replayEntry(&command, entry);
+		free(entry);
+		return;
+	}
+
+	memoStats.misses++;
+	char* temporary = malloc(strlen(store) + sizeof("/tmp.XXXXXX"));
+	sprintf(temporary, "%s/tmp.XXXXXX", store);
+	if (mkdtemp(temporary) == NULL) {
+		errorStatus("cache", false);
+		free(temporary);
+		free(entry);
+		return;
+	}
+	int status = captureEntry(&command, temporary);
+	snprintf(path, sizeof(path), "%s/status", temporary);
+	FILE* file = (status >= 0? fopen(path, "we") : NULL);
+	if (file != NULL) {
+		fprintf(file, "%d\n", status);
+		fclose(file);
+	}
+	if (status >= 0) {
+		replayEntry(&command, temporary); //Sets $? from the status just written, as a hit would
+		char buffer[12];
+		sprintf(buffer, "%d", status);  //(Even if it could not be written)
+		setenv("?", buffer, 1);
+	}
+	if (status == 0 && file != NULL && rename(temporary, entry) == 0) { //Don't remember failures (nor runs that were
+		memoStats.stored++;                 //killed); rename fails if another shell stored it first
+		trimStore(store);
+	}
+	else {
+		removeEntry(AT_FDCWD, temporary);
+	}
+	free(temporary);
+	free(entry);
+}
@@ -0,0 +1,94 @@
+// memory.c
+//
+// The memory builtin: what a long-running shell holds between commands.
+//
+//   memory
+//
+// prints the heap in use (mallinfo2), the resident set size, the number of
+// open file descriptors and, for each subsystem that keeps state from one
+// command line to the next, the live bytes and heap blocks it owns.  All
+// other allocations are released before the command line that made them
+// finishes, so in a steady state none of these numbers should grow.
+
+#include "process.h"
+#include <dirent.h>
+#include <malloc.h>
+
+//Add heap block P (if not NULL) to usage U
+void countBlock(memoryUsage* u, const void* p) {
+	if (p != NULL) {
+		u->bytes += malloc_usable_size((void*) p);
+		u->blocks++;
+	}
+}
+
+//Number of open file descriptors of the shell, or -1
+static int openFds(void) {
+	DIR* dir = opendir("/proc/self/fd");
+	if (dir == NULL) {
+		return -1;
+	}
+	int count = 0;
+	struct dirent* d;
+	while ((d = readdir(dir)) != NULL) {
+		count += (d->d_name[0] != '.');
+	}
+	closedir(dir);
+	return count - 1;                           //Not the one reading the directory
+}
+
+//Resident set size in KiB, or -1
+static long residentKiB(void) {
+	FILE* file = fopen("/proc/self/statm", "re");
+	long size, resident;
+	bool read = file != NULL && fscanf(file, "%ld %ld", &size, &resident) == 2;
+	if (file != NULL) {
+		fclose(file);
+	}
+	return (read? resident * (sysconf(_SC_PAGESIZE) / 1024) : -1);
+}
+
+void executeMemory(const CMD* cmdList) {
+	if (cmdList->argv[1] != NULL) {
+		fprintf(stderr, "usage: memory\n");
+		setenv("?", "1", 1);
+		return;
+	}
+	static const struct {
+		const char* name;
+		void (*usage)(memoryUsage* u);
+	} subsystems[] = {
+		{"directories", directoryMemory},       //pushd stack and logical PWD
+		{"glob", globMemory},                   //Directory listings
+		{"appendcache", appendCacheMemory},     //Paths of cached >> fds
+		{"incremental", upToDateMemory},        //INCREMENTAL state
+		{"affinity", affinityMemory},           //CPU topology
+		{"fds", fdMemory},                      //Which fds are held
+		{"coproc", coprocMemory},               //Names and commands of coprocesses
+	};
+
+	int fds = openFds();                        //Before the redirection adds its own
+	int out = openOutput(cmdList);
+	if (out < 0) {
+		errorStatus(cmdList->argv[0], false);
+		return;
+	}
+	fflush(stdout);
+	int saved = dupFd(1);
+	if (out != 1) {
+		dup2(out, 1);
+		close(out);
+	}
+
+	struct mallinfo2 heap = mallinfo2();
+	printf("MEMORY:  heap=%zu  mmapped=%zu  rss=%ldk  fds=%d\n", heap.uordblks, heap.hblkhd, residentKiB(), fds);
+	for (int i = 0; i < sizeof(subsystems) / sizeof(subsystems[0]); i++) {
+		memoryUsage u = {0, 0};
+		subsystems[i].usage(&u);
+		printf("  %-12s bytes=%zu  blocks=%ld\n", subsystems[i].name, u.bytes, u.blocks);
+	}
+	fflush(stdout);
+	dup2(saved, 1);
+	close(saved);
+	setenv("?", "0", 1);
+}
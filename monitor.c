@@ -0,0 +1,208 @@
+// monitor.c
+//
+// Pipeline bottleneck monitor (enabled by PIPE_MONITOR=MSEC, a local of the
+// first stage or in the environment).  While a pipeline runs, the shell keeps
+// the read end of every pipe (as PIPE_SIZE=adaptive does) and every MSEC
+// milliseconds (100 if MSEC is not a positive number) samples
+//
+//   the fill level of each pipe (FIONREAD against F_GETPIPE_SZ), and
+//   the CPU time of each stage (utime + stime in /proc/PID/stat),
+//
+// taking the exact CPU time of a stage from wait4() when it is reaped.  When
+// the pipeline finishes it reports on stderr, for each stage, its CPU use and
+// how often its input pipe was full or empty.  The saturated stage (the
+// bottleneck) is the one whose input is most often full and whose output is
+// most often empty (a stage whose output is full is merely held up by the
+// stages after it); a stage whose input is empty most of the time is starved,
+// waiting for the stages before it.  With PIPE_MONITOR_LIVE set it also prints
+// the fill levels and CPU use once a second while the pipeline runs.
+//
+// Only the processes of the stages are measured, not their own children (the
+// commands of a ( ... ) stage, say).
+
+#include "process.h"
+#include <sys/resource.h>
+
+#define MONITOR_MSEC_DEFAULT 100
+#define LIVE_INTERVAL 1.0                       //Seconds between live reports
+#define PIPE_PAGE 4096                          //A pipe this close to capacity blocks writers
+
+struct monitor {
+	const CMD** stages;
+	int count;                                  //Stages; pipes are one fewer
+	const int* pids;                            //Of the stages, as filled in by executePipe()
+	const int* readEnds;                        //Of the pipes, -1 once closed
+	int msec;
+	bool live;
+	double begin, last, lastLive;               //Seconds
+	long samples;
+	double* fill;                               //Sum of sampled fill fractions of each pipe
+	long* seen;                                 //Samples taken of it
+	long* full;                                 //  with it (nearly) full
+	long* empty;                                //  with it empty
+	double* cpu;                                //CPU seconds of each stage so far
+	double* end;                                //When it was reaped, 0 until then
+};
+
+//Monotonic time in seconds
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+monitor* startMonitor(const CMD** stages, int count, const int* pids, const int* readEnds) {
+	char* setting = localOrEnv(stages[0], "PIPE_MONITOR");
+	if (setting == NULL || *setting == '\0') {
+		return NULL;
+	}
+	monitor* m = malloc(sizeof(monitor));
+	m->stages = stages;
+	m->count = count;
+	m->pids = pids;
+	m->readEnds = readEnds;
+	m->msec = (atoi(setting) > 0? atoi(setting) : MONITOR_MSEC_DEFAULT);
+	m->live = localOrEnv(stages[0], "PIPE_MONITOR_LIVE") != NULL;
+	m->begin = m->last = m->lastLive = now();
+	m->samples = 0;
+	m->fill = calloc(count, sizeof(double));
+	m->seen = calloc(count, sizeof(long));
+	m->full = calloc(count, sizeof(long));
+	m->empty = calloc(count, sizeof(long));
+	m->cpu = calloc(count, sizeof(double));
+	m->end = calloc(count, sizeof(double));
+	return m;
+}
+
+int monitorInterval(const monitor* m) {
+	return m->msec;
+}
+
+//CPU seconds used so far by process PID, or -1
+static double processCpu(int pid) {
+	char path[32], buffer[1024];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	int fd = openFd(path, O_RDONLY, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	ssize_t n = read(fd, buffer, sizeof(buffer) - 1);
+	close(fd);
+	if (n <= 0) {
+		return -1;
+	}
+	buffer[n] = '\0';
+	char* fields = strrchr(buffer, ')');        //The command name may contain anything
+	unsigned long long utime, stime;
+	if (fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+		return -1;
+	}
+	return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+//Print the current fill levels and CPU use
+static void reportLive(monitor* m, double t) {
+	fprintf(stderr, "MONITOR %.1fs:  pipes", t - m->begin);
+	for (int k = 0; k < m->count - 1; k++) {
+		int queued = 0;
+		int capacity = (m->readEnds[k] < 0? -1 : fcntl(m->readEnds[k], F_GETPIPE_SZ));
+		if (capacity > 0 && ioctl(m->readEnds[k], FIONREAD, &queued) == 0) {
+			fprintf(stderr, " %3d%%", (int) (100.0 * queued / capacity));
+		}
+		else {
+			fprintf(stderr, "    -");
+		}
+	}
+	fprintf(stderr, "   cpu");
+	for (int i = 0; i < m->count; i++) {
+		double lifetime = (m->end[i] > 0? m->end[i] : t) - m->begin;
+		fprintf(stderr, " %3d%%", (int) (lifetime > 0? 100 * m->cpu[i] / lifetime : 0));
+	}
+	fprintf(stderr, "\n");
+}
+
+void monitorSample(monitor* m) {
+	double t = now();
+	if ((t - m->last) * 1000 < m->msec) {
+		return;
+	}
+	m->last = t;
+	m->samples++;
+	for (int k = 0; k < m->count - 1; k++) {
+		int queued = 0;
+		int capacity = (m->readEnds[k] < 0? -1 : fcntl(m->readEnds[k], F_GETPIPE_SZ));
+		if (capacity <= 0 || ioctl(m->readEnds[k], FIONREAD, &queued) == -1) {
+			continue;
+		}
+		m->seen[k]++;
+		m->fill[k] += (double) queued / capacity;
+		m->full[k] += (capacity - queued < PIPE_PAGE);
+		m->empty[k] += (queued == 0);
+	}
+	for (int i = 0; i < m->count; i++) {
+		double cpu;
+		if (m->end[i] == 0 && m->pids[i] > 0 && (cpu = processCpu(m->pids[i])) >= 0) {
+			m->cpu[i] = cpu;
+		}
+	}
+	if (m->live && t - m->lastLive >= LIVE_INTERVAL) {
+		m->lastLive = t;
+		reportLive(m, t);
+	}
+}
+
+void monitorReaped(monitor* m, int pid, const struct rusage* usage) {
+	for (int i = 0; i < m->count; i++) {
+		if (m->pids[i] == pid && m->end[i] == 0) {
+			m->end[i] = now();
+			m->cpu[i] = usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6
+				+ usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+			return;
+		}
+	}
+}
+
+//Fraction of the samples of pipe K with COUNT[K] set (0 if it was never sampled)
+static double share(const monitor* m, const long* count, int k) {
+	return (k < 0 || k >= m->count - 1 || m->seen[k] == 0? 0 : (double) count[k] / m->seen[k]);
+}
+
+void finishMonitor(monitor* m) {
+	if (m == NULL) {
+		return;
+	}
+	double t = now();
+	int bottleneck = -1;
+	double worst = 0;
+	for (int i = 0; i < m->count; i++) {        //Input backed up, output drained (a full output is backpressure)
+		double pressure = share(m, m->full, i - 1) - share(m, m->empty, i - 1) + share(m, m->empty, i) - share(m, m->full, i);
+		if (pressure > worst) {
+			worst = pressure;
+			bottleneck = i;
+		}
+	}
+	fprintf(stderr, "MONITOR:  stages=%d  wall=%.3fs  samples=%ld  interval=%dms\n", m->count, t - m->begin, m->samples, m->msec);
+	for (int i = 0; i < m->count; i++) {
+		double lifetime = (m->end[i] > 0? m->end[i] : t) - m->begin;
+		fprintf(stderr, "  %d %-12s cpu=%.3fs (%3d%%)", i, (m->stages[i]->type == SIMPLE? m->stages[i]->argv[0] : "(...)"),
+			m->cpu[i], (int) (lifetime > 0? 100 * m->cpu[i] / lifetime : 0));
+		if (i > 0 && m->seen[i - 1] > 0) {
+			fprintf(stderr, "  input: fill=%3d%% full=%3d%% empty=%3d%%", (int) (100 * m->fill[i - 1] / m->seen[i - 1]),
+				(int) (100 * share(m, m->full, i - 1)), (int) (100 * share(m, m->empty, i - 1)));
+		}
+		if (i == bottleneck && m->samples > 0) {
+			fprintf(stderr, "  <- saturated");
+		}
+		else if (i > 0 && share(m, m->empty, i - 1) > 0.5) {
+			fprintf(stderr, "  <- starved");
+		}
+		fprintf(stderr, "\n");
+	}
+	free(m->fill);
+	free(m->seen);
+	free(m->full);
+	free(m->empty);
+	free(m->cpu);
+	free(m->end);
+	free(m);
+}
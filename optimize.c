@@ -0,0 +1,218 @@
+// optimize.c
+//
+// Optional rewrite pass over a parsed CMD tree (enabled by OPTIMIZE).  Each
+// rule below keeps the tree in the shape documented in parse.h and only fires
+// when the exit status the shell would report ($?) cannot change:
+//
+//   cat FILE | X       =>  X < FILE        FILE readable and fits in one pipe
+//   cat | X            =>  X               (cat's < redirection moves to X)
+//   X | cat            =>  X               (cat's > redirection moves to X)
+//                                          a moved < F / > F must open
+//   true | X           =>  X < /dev/null
+//   true ; X           =>  X               also for &&
+//   NOOP > /dev/null ; X  =>  X            NOOP = true, echo or a readable cat FILE
+//
+// A pipeline reports the last nonzero status of its stages, and cat/true as
+// used above can only fail by being killed with SIGPIPE, which the original
+// pipeline would only do depending on scheduling.  The pipeline rewrites are
+// not applied when the stage that would be left alone is one of the shell's
+// own builtins (cd, pushd, coproc, ...): as a stage it runs in a child.
+// The pass runs before GLOB expands anything, so a cat FILE whose FILE is a
+// pattern is left alone.  It also runs before any command of the line, so the
+// rules that look at FILE only fire for the first command of the line: an
+// earlier one could remove, move or grow FILE, or cd away from it.
+
+#include "process.h"
+#include <sys/stat.h>
+
+//Number of times each rewrite was applied in this shell
+static struct {
+	int catToRedirect;
+	int catDropped;
+	int trueStage;
+	int trueDropped;
+	int discardDropped;
+} rewrites;
+
+//Is C the simple command NAME with ARGC arguments, no local variables and no redirection?
+static bool isPlain(const CMD* c, const char* name, int argc) {
+	return c->type == SIMPLE && c->argc == argc && c->nLocal == 0 && strcmp(c->argv[0], name) == 0
+		&& c->fromType == NONE && c->toType == NONE && c->errType == NONE;
+}
+
+//Is FILE a regular file we can read that fits into SIZE bytes?
+static bool readableFile(const char* file, off_t size) {
+	struct stat info;
+	return access(file, R_OK) == 0 && stat(file, &info) == 0 && S_ISREG(info.st_mode) && info.st_size <= size;
+}
+
+//Can FILE be opened for writing (created if need be)?
+static bool writableFile(const char* file) {
+	if (access(file, W_OK) == 0) {
+		return true;
+	}
+	if (errno != ENOENT) {
+		return false;
+	}
+	char* directory = strdup(file);
+	char* slash = strrchr(directory, '/');
+	if (slash == directory) {
+		slash[1] = '\0';
+	}
+	else if (slash != NULL) {
+		*slash = '\0';
+	}
+	bool writable = access((slash == NULL? "." : directory), W_OK | X_OK) == 0;
+	free(directory);
+	return writable;
+}
+
+//Is C a command without side effects whose output is thrown away and whose status is always 0?  LEADING is
+//set if C is the first command of the line, which a cat FILE has to be
+static bool discarded(const CMD* c, bool leading) {
+	if (c->type != SIMPLE || c->nLocal != 0 || c->fromType != NONE || c->errType != NONE
+			|| (c->toType != RED_OUT && c->toType != RED_OUT_APP) || strcmp(c->toFile, "/dev/null") != 0) {
+		return false;
+	}
+	return strcmp(c->argv[0], "true") == 0 || strcmp(c->argv[0], "echo") == 0
+		|| (strcmp(c->argv[0], "cat") == 0 && c->argc == 2 && c->argv[1][0] != '-' && leading && !hasGlobs(c)
+			&& readableFile(c->argv[1], LONG_MAX));
+}
+
+//Would C, standing alone, run in the shell itself (cd, pushd, coproc, ...)?  As a pipeline stage it runs in a
+//child, where it can't change the shell's state, so it must stay one
+static bool runsInShell(const CMD* c) {
+	return c->type == SIMPLE && isShellBuiltin(c->argv);
+}
+
+//Free node C after detaching the child KEEP, and return KEEP
+static CMD* replaceBy(CMD* c, CMD* keep) {
+	if (c->left == keep) {
+		c->left = NULL;
+	}
+	else {
+		c->right = NULL;
+	}
+	freeCMD(c);
+	return keep;
+}
+
+//Apply the rewrites at PIPE node C whose children are already optimized. PIPED is set if C is itself
+//the left child of a PIPE, i.e. c->right is not the last stage of the pipeline; LEADING if the pipeline
+//is the first command of the line
+static CMD* optimizePipe(CMD* c, bool piped, bool leading) {
+	CMD* first = c->left;   //Stage feeding c->right (only a single stage if c is the leftmost PIPE)
+	CMD* last = (c->left->type == PIPE? c->left->right : c->left);
+	CMD* next = c->right;
+
+	if (runsInShell(next) || runsInShell(last)) {
+		return c;
+	}
+	if (leading && first->type == SIMPLE && first->argc == 2 && first->nLocal == 0 && strcmp(first->argv[0], "cat") == 0
+			&& first->argv[1][0] != '-' && !hasGlobs(first) && first->fromType == NONE && first->toType == NONE && first->errType == NONE
+			&& next->fromType == NONE && readableFile(first->argv[1], PIPE_SIZE_DEFAULT)) { //cat never blocks on the pipe
+		next->fromType = RED_IN;            //cat FILE | X  =>  X < FILE
+		next->fromFile = first->argv[1];
+		first->argv[1] = NULL;
+		rewrites.catToRedirect++;
+		return replaceBy(c, next);
+	}
+
+	if (isPlain(first, "true", 1) && next->fromType == NONE) {
+		next->fromType = RED_IN;            //true | X  =>  X < /dev/null
+		next->fromFile = strdup("/dev/null");
+		rewrites.trueStage++;
+		return replaceBy(c, next);
+	}
+
+	if (first->type == SIMPLE && first->argc == 1 && first->nLocal == 0 && strcmp(first->argv[0], "cat") == 0
+			&& first->toType == NONE && first->errType == NONE
+			&& (first->fromType == NONE? !isatty(0) : next->fromType == NONE) //X must not see a tty where it saw a pipe
+			&& (first->fromType != RED_IN || (leading && readableFile(first->fromFile, LONG_MAX)))) { //Nor fail to open F
+		if (first->fromType != NONE) {      //cat < F | X  =>  X < F
+			next->fromType = first->fromType;
+			next->fromFile = first->fromFile;
+			first->fromType = NONE;
+			first->fromFile = NULL;
+		}
+		rewrites.catDropped++;
+		return replaceBy(c, next);
+	}
+
+	if (next->type == SIMPLE && next->argc == 1 && next->nLocal == 0 && strcmp(next->argv[0], "cat") == 0
+			&& next->fromType == NONE && next->errType == NONE
+			&& (next->toType == NONE? piped || !isatty(1) : last->toType == NONE && leading && writableFile(next->toFile))) {
+		if (next->toType != NONE) {         //X | cat > F  =>  X > F
+			last->toType = next->toType;
+			last->toFile = next->toFile;
+			next->toType = NONE;
+			next->toFile = NULL;
+		}
+		rewrites.catDropped++;
+		return replaceBy(c, c->left);
+	}
+
+	return c;
+}
+
+//Apply the rewrites at node C whose children are already optimized and return its replacement; PIPED and
+//LEADING as for optimizePipe()
+static CMD* optimizeNode(CMD* c, bool piped, bool leading) {
+	if (c->type == PIPE) {
+		return optimizePipe(c, piped, leading);
+	}
+	if ((c->type == SEP_END || c->type == SEP_AND) && c->right != NULL && isPlain(c->left, "true", 1)) {
+		rewrites.trueDropped++;             //true ; X  =>  X
+		return replaceBy(c, c->right);
+	}
+	if (c->type == SEP_END && c->right != NULL && discarded(c->left, leading)) {
+		rewrites.discardDropped++;          //NOOP > /dev/null ; X  =>  X
+		return replaceBy(c, c->right);
+	}
+	return c;
+}
+
+//A subtree still to optimize: the pointer to it in its parent (or to the root)
+typedef struct pendingNode {
+	CMD** slot;
+	bool piped;
+	bool leading;                           //On the left spine of the line: nothing runs before it
+	bool expanded;                          //Its children are on the stack above it (or done)
+} pendingNode;
+
+//Rewrite wasteful shapes in the command tree CMD and return the new root
+CMD* optimize(CMD* cmd) {
+	//Children before parents, with a stack rather than recursion: a chain of thousands of ; && || or | is
+	//as deep as it is long
+	int depth = 0, room = 16;
+	pendingNode* stack = malloc(sizeof(pendingNode) * room);
+	stack[depth++] = (pendingNode) {&cmd, false, true, false};
+	while (depth > 0) {
+		pendingNode* top = &stack[depth - 1];
+		CMD* c = *top->slot;
+		if (c == NULL) {
+			depth--;
+		}
+		else if (top->expanded) {
+			*top->slot = optimizeNode(c, top->piped, top->leading);
+			depth--;
+		}
+		else {
+			top->expanded = true;
+			bool leading = top->leading;
+			if (depth + 2 > room) {
+				REALLOC(stack, room *= 2);  //Moves top
+			}
+			stack[depth++] = (pendingNode) {&c->right, false, false, false};
+			stack[depth++] = (pendingNode) {&c->left, c->type == PIPE, leading, false}; //Left first, as before
+		}
+	}
+	free(stack);
+	return cmd;
+}
+
+//Print how often each rewrite has been applied
+void dumpOptimizeStats(void) {
+	printf("OPTIMIZE:  cat FILE|X=%d  cat-stage=%d  true|X=%d  true;X=%d  >/dev/null;X=%d\n",
+		rewrites.catToRedirect, rewrites.catDropped, rewrites.trueStage, rewrites.trueDropped, rewrites.discardDropped);
+}
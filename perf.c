@@ -0,0 +1,200 @@
+// perf.c
+//
+// Performance counters of commands (enabled by PERF_STAT, a local of the
+// simple command or first stage, or in the environment).  Each process the
+// shell forks for a simple command or pipeline stage waits, before it runs
+// anything, until the shell has attached perf_event_open() counters to it:
+//
+//   task-clock        CPU time, in milliseconds
+//   cycles            CPU cycles        (hardware: "-" without a PMU, as in
+//   instructions      and IPC            most virtual machines)
+//   cache-misses      last-level cache misses
+//   page-faults       minor and major
+//   context-switches  voluntary and involuntary
+//
+// The counters inherit, so they also count the processes a stage starts
+// itself (the commands of a ( ... ) stage, say), as long as those have
+// exited by the time the stage is reaped: the shell reads them then.  When
+// the command finishes it reports them on stderr, per stage and in total.
+// Counters the kernel multiplexed are scaled to the whole run.  Where
+// kernel.perf_event_paranoid allows only user-space counting, kernel time
+// is left out (and context switches can't be counted).
+//
+// Commands spawned through the zygote can't be made to wait, so PERF_STAT
+// forks them from the shell instead.
+
+#include "process.h"
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+enum {TASK_CLOCK, CYCLES, INSTRUCTIONS, CACHE_MISSES, PAGE_FAULTS, CONTEXT_SWITCHES};
+
+static const struct {
+	const char* name;
+	int type;
+	int config;
+} events[PERF_FDS] = {
+	{"task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+	{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{"cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+	{"page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+	{"context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+struct perfStat {
+	const CMD** stages;
+	int count;
+	int (*fds)[PERF_FDS];                   //Of each stage, -1 if not counted (or once read)
+	double (*values)[PERF_FDS];             //-1 if not counted
+	int gate[2];                            //The child of the fork under way reads a byte from it to go on
+	double begin;
+};
+
+static bool warned = false;                 //perf_event_open() was refused: said so once
+
+//Monotonic time in seconds
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+perfStat* startPerf(const CMD** stages, int count) {
+	char* setting = localOrEnv(stages[0], "PERF_STAT");
+	if (setting == NULL || *setting == '\0') {
+		return NULL;
+	}
+	perfStat* p = malloc(sizeof(perfStat));
+	p->stages = stages;
+	p->count = count;
+	p->fds = malloc(sizeof(*p->fds) * count);
+	p->values = malloc(sizeof(*p->values) * count);
+	for (int i = 0; i < count; i++) {
+		for (int e = 0; e < PERF_FDS; e++) {
+			p->fds[i][e] = -1;
+			p->values[i][e] = -1;
+		}
+	}
+	p->gate[0] = p->gate[1] = -1;
+	p->begin = now();
+	return p;
+}
+
+void perfGate(perfStat* p) {
+	if (p != NULL && pipeFds(p->gate) == -1) {
+		p->gate[0] = p->gate[1] = -1;       //The child won't wait: it is counted from when the shell gets to it
+	}
+}
+
+void perfChild(perfStat* p) {
+	if (p != NULL && p->gate[0] >= 0) {
+		char go;
+		while (read(p->gate[0], &go, 1) == -1 && errno == EINTR)
+			;
+		close(p->gate[0]);
+		close(p->gate[1]);
+	}
+}
+
+//Counter EVENT for process PID, or -1
+static int openCounter(int event, int pid) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[event].type;
+	attr.config = events[event].config;
+	attr.inherit = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	int fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	if (fd < 0 && (errno == EACCES || errno == EPERM)) { //perf_event_paranoid: user space only
+		attr.exclude_kernel = attr.exclude_hv = 1;
+		fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	}
+	if (fd < 0 && event == TASK_CLOCK && !warned) { //Not even a software counter
+		perror("PERF_STAT: perf_event_open");
+		warned = true;
+	}
+	return fd;
+}
+
+void perfAttach(perfStat* p, int stage, int pid) {
+	if (p == NULL) {
+		return;
+	}
+	for (int e = 0; pid > 0 && e < PERF_FDS; e++) {
+		p->fds[stage][e] = openCounter(e, pid);
+	}
+	if (p->gate[1] >= 0) {
+		write(p->gate[1], "", 1);
+		close(p->gate[0]);
+		close(p->gate[1]);
+		p->gate[0] = p->gate[1] = -1;
+	}
+}
+
+void perfReaped(perfStat* p, int stage) {
+	if (p == NULL) {
+		return;
+	}
+	for (int e = 0; e < PERF_FDS; e++) {
+		unsigned long long value[3];        //Count, time enabled, time running
+		int fd = p->fds[stage][e];
+		if (fd >= 0 && read(fd, value, sizeof(value)) == sizeof(value)) {
+			p->values[stage][e] = (value[2] > 0 && value[2] < value[1]? (double) value[0] * value[1] / value[2] : value[0]);
+		}
+		if (fd >= 0) {
+			close(fd);
+			p->fds[stage][e] = -1;
+		}
+	}
+}
+
+//Print the counters VALUES on stderr
+static void reportCounters(const double* values) {
+	for (int e = 0; e < PERF_FDS; e++) {
+		if (values[e] < 0) {
+			fprintf(stderr, "  %s=-", events[e].name);
+		}
+		else if (e == TASK_CLOCK) {
+			fprintf(stderr, "  %s=%.3fms", events[e].name, values[e] / 1e6);
+		}
+		else {
+			fprintf(stderr, "  %s=%.0f", events[e].name, values[e]);
+		}
+		if (e == INSTRUCTIONS && values[CYCLES] > 0 && values[INSTRUCTIONS] >= 0) {
+			fprintf(stderr, "  ipc=%.2f", values[INSTRUCTIONS] / values[CYCLES]);
+		}
+	}
+	fprintf(stderr, "\n");
+}
+
+void finishPerf(perfStat* p) {
+	if (p == NULL) {
+		return;
+	}
+	double total[PERF_FDS];
+	for (int e = 0; e < PERF_FDS; e++) {
+		total[e] = -1;
+	}
+	for (int i = 0; i < p->count; i++) {
+		perfReaped(p, i);                   //Any not reaped here: whatever they have counted so far
+		for (int e = 0; e < PERF_FDS; e++) {
+			if (p->values[i][e] >= 0) {
+				total[e] = (total[e] < 0? 0 : total[e]) + p->values[i][e];
+			}
+		}
+	}
+	fprintf(stderr, "PERF:  stages=%d  wall=%.3fs\n", p->count, now() - p->begin);
+	for (int i = 0; i < p->count; i++) {
+		fprintf(stderr, "  %d %-12s", i, (p->stages[i]->type == SIMPLE? p->stages[i]->argv[0] : "(...)"));
+		reportCounters(p->values[i]);
+	}
+	if (p->count > 1) {
+		fprintf(stderr, "  %-14s", "total");
+		reportCounters(total);
+	}
+	free(p->fds);
+	free(p->values);
+	free(p);
+}
@@ -4,10 +4,13 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <sys/stat.h>
 
 #define errorExit(status)  perror("pipe"), exit(status)
 #define errorSingleExit(name, status)  perror(name), exit(status)
 #define STACK_INIT_SIZE 4
+#define PIPE_SAMPLE_NSEC 10000000 //Adaptive pipe sizing samples every 10ms
+#define FD_HEADROOM 64 //Fds the shell may need besides the read ends it samples
 
 int zombies = 0; //track the number of "zombie" background processes, shouldn't wait for those in the wait loops
 
@@ -16,9 +19,15 @@ typedef struct _charStack {
 	int size;
 	int capacity;
 	char** elements;
+	int* fds; //Open dirfd of each element
 } charStack;
 
 charStack* directoryStack = NULL; //Keep track of directory stack
+static char* logicalPwd = NULL; //Logical path of the current directory (PWD), once cd has been used
+static int cwdFd = -1; //O_PATH dirfd of the current directory, -1 until then
+static pid_t shellPid = 0; //The shell itself, as opposed to its subshells and & jobs
+static volatile sig_atomic_t foregroundGroup = 0; //Process group of the foreground job, which SIGINT is passed on to
+static bool terminalGiven = false; //The foreground job has the terminal
 
 //Report Error
 void errorStatus(char* message, bool extract) {
@@ -29,122 +38,446 @@ void errorStatus(char* message, bool extract) {
 	setenv("?", buffer, 1); //Set exit status
 }
 
-void redirectFile(const CMD *cmdList) {
-	int redirect = -1;
-	if (cmdList->fromType == RED_IN) {
-		redirect = open(cmdList->fromFile, O_RDONLY);
-		if (redirect < 0) { //Error
-			int error = errno; //If redirect failed, store the error number
-			errorSingleExit (cmdList->argv[0], error); //Report the error with perror, do not execute command - exit the child process with the error number exit code (will be reaped by parent)
-		}
-
-		dup2(redirect, 0);
-		close(redirect);
+//Open the stdin redirection of cmdList: returns the fd to read from (0 if not redirected) or -1 with errno set
+int openInput(const CMD *cmdList) {
+	int redirect = 0;
+	if (cmdList->fromType == RED_IN && (redirect = coprocFd(cmdList->fromFile, true)) != -2) {
+		; //< %NAME: the stdout of coprocess NAME
+	}
+	else if (cmdList->fromType == RED_IN) {
+		redirect = openFd(cmdList->fromFile, O_RDONLY, 0);
 	}
 	else if (cmdList->fromType == RED_IN_HERE) {
 		char template[] = "XXXXXX";
-		redirect = mkstemp(template);
-		if (redirect < 0) { //Error
-			int error = errno; //If mkstemp failed, store the error number
-			errorSingleExit (cmdList->argv[0], error); //Report the error with perror, do not execute command - exit the child process with the error number exit code (will be reaped by parent)
-		}
-		unlink(template);
-		write(redirect, (void*) cmdList->fromFile, strlen(cmdList->fromFile));
-		lseek(redirect,0,SEEK_SET);
-		dup2(redirect, 0);
-		close(redirect);
-	}
-	if (cmdList->toType == RED_OUT) {
-		redirect = open(cmdList->toFile, O_WRONLY | O_CREAT | O_TRUNC, 00666);
-		if (redirect < 0) { //Error
-			int error = errno; //If redirect failed, store the error number
-			errorSingleExit (cmdList->argv[0], error); //Report the error with perror, do not execute command - exit the child process with the error number exit code (will be reaped by parent)
-		}
-		dup2(redirect, 1);
-		close(redirect);
+		redirect = mkostemp(template, O_CLOEXEC);
+		if (redirect >= 0) {
+			unlink(template);
+			write(redirect, (void*) cmdList->fromFile, strlen(cmdList->fromFile));
+			lseek(redirect,0,SEEK_SET);
+		}
+	}
+	return redirect;
+}
+
+//Open the stdout redirection of cmdList: returns the fd to write to (1 if not redirected) or -1 with errno set
+int openOutput(const CMD *cmdList) {
+	int redirect = 1;
+	if ((cmdList->toType == RED_OUT || cmdList->toType == RED_OUT_APP) && (redirect = coprocFd(cmdList->toFile, false)) != -2) {
+		; //> %NAME: the stdin of coprocess NAME
+	}
+	else if (cmdList->toType == RED_OUT) {
+		redirect = openFd(cmdList->toFile, O_WRONLY | O_CREAT | O_TRUNC, 00666);
 	}
 	else if (cmdList->toType == RED_OUT_APP) {
-		redirect = open(cmdList->toFile, O_WRONLY | O_CREAT | O_APPEND, 00666);
-		if (redirect < 0) { //Error
-			int error = errno; //If redirect failed, store the error number
-			errorSingleExit (cmdList->argv[0], error); //Report the error with perror, do not execute command - exit the child process with the error number exit code (will be reaped by parent)
+		redirect = openAppend(cmdList->toFile); //Cached by the shell if APPEND_CACHE is set
+	}
+	return redirect;
+}
+
+void redirectFile(const CMD *cmdList) {
+	int redirect = openInput(cmdList);
+	if (redirect < 0) { //Error
+		int error = errno; //If redirect failed, store the error number
+		errorSingleExit (cmdList->argv[0], error); //Report the error with perror, do not execute command - exit the child process with the error number exit code (will be reaped by parent)
+	}
+	else if (cmdList->fromType != NONE) {
+		moveFd(redirect, 0);
+	}
+
+	redirect = openOutput(cmdList);
+	if (redirect < 0) { //Error
+		int error = errno; //If redirect failed, store the error number
+		errorSingleExit (cmdList->argv[0], error); //Report the error with perror, do not execute command - exit the child process with the error number exit code (will be reaped by parent)
+	}
+	else if (cmdList->toType != NONE) {
+		moveFd(redirect, 1);
+	}
+}
+
+//Run an in-process builtin in the shell itself, with cmdList's redirections applied to the fds it is given
+void executeBuiltin(const CMD *cmdList, builtinFn builtin) {
+	int in = openInput(cmdList);
+	int out = (in < 0? -1 : openOutput(cmdList));
+	if (out < 0) { //Error - same status a forked child would have exited with
+		int error = errno;
+		if (in > 0) {
+			close(in);
 		}
-		dup2(redirect, 1);
-		close(redirect);
+		errno = error;
+		errorStatus(cmdList->argv[0], false);
+		return;
+	}
+
+	fflush(stdout); //Builtin writes straight to the fd
+	struct sigaction ignore, previous;
+	memset(&ignore, 0, sizeof(ignore));
+	ignore.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &ignore, &previous); //A closed reader must not kill the shell, builtin reports EPIPE instead
+	int status = builtin(cmdList->argv, in, out);
+	sigaction(SIGPIPE, &previous, NULL);
+
+	if (in != 0) {
+		close(in);
+	}
+	if (out != 1) {
+		close(out);
 	}
+	char buffer[4];
+	sprintf(buffer, "%d", status);
+	setenv("?", buffer, 1);
 }
 
-void executeSingle(const CMD *cmdList) {
+//Spawn simple command cmdList with stdio IN and OUT through the zygote, in process group PGID (see zygoteSpawn()),
+//after applying its own redirections
+//Returns the pid, or 0 if the caller has to fork (no zygote, a builtin, or a redirection the child should report)
+int zygoteCommand(const CMD *cmdList, int in, int out, bool locals, int pgid) {
+	if (cmdList->type != SIMPLE || findBuiltin(cmdList->argv) != NULL || commandLimited(cmdList)) {
+		return 0;
+	}
+	int from = openInput(cmdList);
+	int to = (from < 0? -1 : openOutput(cmdList));
+	int pid = -1;
+	if (to >= 0) {
+		int owned;
+		char** envp = commandEnvironment((locals? cmdList->nLocal : 0), cmdList->locVar, cmdList->locVal, &owned);
+		pid = zygoteSpawn(cmdList->argv, envp, (from != 0? from : in), (to != 1? to : out), 2, pgid);
+		freeEnvironment(envp, owned);
+	}
+	if (from > 0) {
+		close(from);
+	}
+	if (to > 1) {
+		close(to);
+	}
+	return (pid > 0? pid : 0);
+}
 
-	//Execute command with redirection
-	int pid = fork();
+//Start simple command cmdList with its redirections, without waiting for it, in a process group of its own if GROUP
+//Returns the pid, or -1 if it could not be started (status set)
+int spawnCommand(const CMD *cmdList, bool group) {
+	if (cmdList->toType == RED_OUT_APP) {
+		cacheAppendFile(cmdList->toFile); //Child dup2s the shell's cached fd instead of reopening
+	}
+	int pid = zygoteCommand(cmdList, 0, 1, true, (group? 0 : -1)); //Spawned from the small zygote image, if there is one
+	if (pid == 0) {
+		pid = fork();
+	}
+	if (pid > 0 && group) {
+		setpgid(pid, pid); //Also done by the child: whichever runs first
+	}
 
 	if (pid < 0) { //Error - fork failed from parent
 		errorStatus("fork", false);
-		return;
+		return -1;
 	}
 
 	//Child code
 	else if (pid == 0) {
+		if (group) {
+			setpgid(0, 0);
+		}
+		applyLimits(cmdList); //LIMIT_CPU, LIMIT_MEM, LIMIT_FDS
 		//Add local variables to environment for function
 		for (int i = 0; i < cmdList->nLocal; i++) {
 			// printf("%s: %s\n", cmdList->locVar[i], cmdList->locVal[i]);
 			setenv(cmdList->locVar[i], cmdList->locVal[i], 1);
 		}
 		redirectFile(cmdList);
+		closeExtraFds();
 		execvp(cmdList->argv[0], cmdList->argv);
 		int error = errno; //If execvp failed, store the error number
 		errorSingleExit (cmdList->argv[0], error); //Report the error with perror, exit the process with the error number as the exit code
 	}
+	return pid;
+}
 
-	//Parent code
-	else {
+int spawnSingle(const CMD *cmdList) {
+	return spawnCommand(cmdList, false);
+}
+
+void executeSingle(const CMD *cmdList) {
+	struct timespec started;
+	bool incremental = getenv("INCREMENTAL") != NULL;
+	if (incremental && skipUpToDate(cmdList, &started)) { //OUTPUT is newer than INPUT and made by this command line
+		return;
+	}
+
+	if (getenv("ARG_BATCH") && executeBatches(cmdList)) { //argv too long for one execvp
+		return;
+	}
+
+	deadline* timer = commandDeadline(cmdList); //TIMEOUT=DURATION
+	if (timer != NULL) {
+		executeDeadline(cmdList, timer);
+		if (incremental) {
+			recordUpToDate(cmdList, &started);
+		}
+		return;
+	}
+
+	if (localOrEnv(cmdList, "PERF_STAT") != NULL) { //Counted like a pipeline of one stage
+		executePipe(cmdList);
+		if (incremental) {
+			recordUpToDate(cmdList, &started);
+		}
+		return;
+	}
+
+	//Execute command with redirection; run by the shell itself, it leads a process group that Ctrl-C is passed on to
+	int pid = spawnCommand(cmdList, getpid() == shellPid);
+	if (pid > 0) {
 		int result = -1;
-		waitpid(pid, &result, 0); //Collect the exit status of the child process in result
-		if (result != -1) { //If we actually collected the status from here (rather than it being reaped elsewhere - eg, SIGINT interrupt handler), then set status
+		foregroundJob(pid);
+		waitChild(pid, &result); //Collect the exit status of the child process in result
+		foregroundJob(0);
+		if (result != -1) { //If we actually collected the status from here (rather than it being reaped elsewhere), then set status
 			char buffer[4];
 			sprintf(buffer, "%d", STATUS(result)); //Convert the exit status to status, and set the environment variable
 			setenv("?", buffer, 1);
 		}		
+		if (incremental) {
+			recordUpToDate(cmdList, &started);
+		}
 	}
 }
 
-//In order traversal to flatten tree of pipes
-void countPipes(const CMD* cmdList, int* size) {
-	if (cmdList->type != PIPE) {
-		(*size)++;
-		return;
+//In order traversal to flatten tree of pipes, with a stack of the right subtrees still to visit rather than
+//recursion (a generated pipeline may be thousands of stages deep). Returns the stages and sets *SIZE to their number
+const CMD** flattenPipes(const CMD* cmdList, int* size) {
+	int capacity = 16, depth = 0, room = 16;
+	const CMD** pipeList = malloc(sizeof(CMD*) * capacity);
+	const CMD** pending = malloc(sizeof(CMD*) * room);
+	*size = 0;
+	for (const CMD* c = cmdList; c != NULL; c = (depth > 0? pending[--depth] : NULL)) {
+		while (c->type == PIPE) {
+			if (depth == room) {
+				REALLOC(pending, room *= 2);
+			}
+			pending[depth++] = c->right;
+			c = c->left;
+		}
+		if (*size == capacity) {
+			REALLOC(pipeList, capacity *= 2);
+		}
+		pipeList[(*size)++] = c;
 	}
-	else {
-		countPipes(cmdList->left, size);
-		countPipes(cmdList->right, size);
+	free(pending);
+	return pipeList;
+}
+
+//Look up variable NAME in the local variables of cmdList, falling back to the environment
+char* localOrEnv(const CMD* cmdList, const char* name) {
+	for (int i = cmdList->nLocal - 1; i >= 0; i--) { //Last assignment wins
+		if (strcmp(cmdList->locVar[i], name) == 0) {
+			return cmdList->locVal[i];
+		}
+	}
+	return getenv(name);
+}
+
+//Largest pipe capacity an unprivileged process may request (read once from /proc)
+int pipeMaxSize(void) {
+	static int maxSize = 0;
+	if (maxSize == 0) {
+		maxSize = PIPE_SIZE_DEFAULT;
+		FILE* file = fopen("/proc/sys/fs/pipe-max-size", "re");
+		if (file != NULL) {
+			if (fscanf(file, "%d", &maxSize) != 1 || maxSize < PIPE_SIZE_DEFAULT) {
+				maxSize = PIPE_SIZE_DEFAULT;
+			}
+			fclose(file);
+		}
+	}
+	return maxSize;
+}
+
+//Requested pipe capacity for a pipeline whose first stage is cmdList: PIPE_SIZE=<bytes>[k|m] or PIPE_SIZE=adaptive
+//Returns 0 to leave the kernel default, sets *adaptive if buffers should grow when observed full
+int pipeSizeSetting(const CMD* cmdList, bool* adaptive) {
+	*adaptive = false;
+	char* value = localOrEnv(cmdList, "PIPE_SIZE"); //A local on the first stage overrides the shell-wide setting
+	if (value == NULL || *value == '\0') {
+		return 0;
+	}
+	if (strcmp(value, "adaptive") == 0) {
+		*adaptive = true;
+		return 0;
+	}
+	char* end;
+	long size = strtol(value, &end, 10);
+	if (*end == 'k' || *end == 'K') {
+		size *= 1024;
+	}
+	else if (*end == 'm' || *end == 'M') {
+		size *= 1024 * 1024;
+	}
+	if (size <= 0) {
+		return 0;
+	}
+	return (size > pipeMaxSize()? pipeMaxSize() : (int) size); //Kernel rejects anything above pipe-max-size
+}
+
+//Adaptive pipe sizing: double the capacity of any pipe that is currently full, up to pipe-max-size
+void growFullPipes(int* readEnds, int count) {
+	for (int k = 0; k < count; k++) {
+		if (readEnds[k] < 0) {
+			continue;
+		}
+		int queued = 0;
+		int capacity = fcntl(readEnds[k], F_GETPIPE_SZ);
+		if (capacity <= 0 || capacity >= pipeMaxSize() || ioctl(readEnds[k], FIONREAD, &queued) == -1) {
+			continue;
+		}
+		if (queued >= capacity) { //Writer is blocked on a full pipe
+			fcntl(readEnds[k], F_SETPIPE_SZ, (capacity * 2 > pipeMaxSize()? pipeMaxSize() : capacity * 2));
+		}
+	}
+}
+
+//Reap one child of a pipeline. In adaptive mode, poll instead of blocking so full pipes can be grown meanwhile
+//With a deadline TIMER, sleep on it instead so that the pipeline can be killed when it passes
+//With a monitor WATCH, sample the pipes and stages meanwhile and give it the resource usage of the child reaped
+int waitPipeStage(int* result, int* readEnds, int count, bool adaptive, monitor* watch, deadline* timer) {
+	if (!adaptive && watch == NULL && timer == NULL) {
+		return waitChild(-1, result);
+	}
+	int msec = (watch != NULL? monitorInterval(watch) : -1); //Sleep between samples, -1 until a child exits
+	if (adaptive && (msec < 0 || msec > PIPE_SAMPLE_NSEC / 1000000)) {
+		msec = PIPE_SAMPLE_NSEC / 1000000;
+	}
+	struct timespec interval = {msec / 1000, msec % 1000 * 1000000};
+	for ( ; ; ) {
+		struct rusage usage;
+		int pid = wait4(-1, result, WNOHANG, &usage);
+		if (pid > 0 && watch != NULL) {
+			monitorReaped(watch, pid, &usage);
+		}
+		if (pid != 0 && !(pid < 0 && errno == EINTR)) {
+			return pid;
+		}
+		if (adaptive) {
+			growFullPipes(readEnds, count);
+		}
+		if (watch != NULL) {
+			monitorSample(watch);
+		}
+		if (timer != NULL) {
+			sleepDeadline(timer, msec);
+		}
+		else {
+			nanosleep(&interval, NULL);
+		}
+	}
+}
+
+//Give the terminal to process group PGID, or back to the shell's if 0
+static void giveTerminal(int pgid) {
+	sigset_t block, previous;
+	sigemptyset(&block);
+	sigaddset(&block, SIGTTOU); //Taking it back from the background would stop the shell
+	sigprocmask(SIG_BLOCK, &block, &previous);
+	tcsetpgrp(0, (pgid > 0? pgid : getpgrp()));
+	sigprocmask(SIG_SETMASK, &previous, NULL);
+	if (pgid > 0) {
+		kill(-pgid, SIGCONT); //A member that read the terminal before it had it was stopped
 	}
 }
 
-//In order traversal to flatten tree of pipes
-void flattenPipes(const CMD* cmdList, const CMD*** pipeList, int* i) {
-	if (cmdList->type != PIPE) {
-		(*pipeList)[*i] = cmdList;
-		(*i)++;
+void foregroundJob(int pgid) {
+	if (getpid() != shellPid) { //A subshell or & job: the shell deals with the whole of it
 		return;
 	}
-	else {
-		flattenPipes(cmdList->left, pipeList, i);
-		flattenPipes(cmdList->right, pipeList, i);
+	foregroundGroup = pgid;
+	if (pgid > 0 && isatty(0) && tcgetpgrp(0) == getpgrp()) {
+		giveTerminal(pgid);
+		terminalGiven = true;
 	}
+	else if (pgid == 0 && terminalGiven) {
+		giveTerminal(0);
+		terminalGiven = false;
+	}
+}
+
+int waitChild(int pid, int* result) {
+	int reaped;
+	while ((reaped = waitpid(pid, result, 0)) == -1 && errno == EINTR) //SIGINT was passed on: reap what it killed
+		;
+	return reaped;
+}
+
+//Pid of a pipeline stage and its index, sorted by pid to look up the stages reaped
+typedef struct stagePid {
+	int pid;
+	int stage;
+} stagePid;
+
+static int comparePids(const void* a, const void* b) {
+	return ((const stagePid*) a)->pid - ((const stagePid*) b)->pid;
+}
+
+//Can the shell keep COUNT more fds open (the read ends sampled by PIPE_SIZE=adaptive and PIPE_MONITOR)?
+static bool fdBudget(int count) {
+	struct rlimit limit;
+	return getrlimit(RLIMIT_NOFILE, &limit) == -1 || limit.rlim_cur == RLIM_INFINITY
+		|| count + FD_HEADROOM <= limit.rlim_cur;
 }
 
 void executePipe(const CMD *cmdList) {
 
 	//First, flatten out a tree of multiple pipes into a list of commands
-	//Instead of creating dynamic array, just traversing tree one more time to figure out how big the array needs to be
 	int size = 0;
-	countPipes(cmdList, &size);
-
-	const CMD** pipeList = malloc(sizeof(CMD*) * size); //NEED TO FREE!
-	int x = 0;
-	flattenPipes(cmdList, &pipeList, &x);
+	const CMD** pipeList = flattenPipes(cmdList, &size); //Freed (as stageList) once the pipeline is done
 	//pipeList now contains an ordered list of commands in the multiple pipes, from left to right
+	for (int k = 0; k < size; k++) {
+		expandGlobs(pipeList[k]); //GLOB: the stages start together, so they are expanded together
+	}
+
+	//THREAD_STAGES: each run of adjacent filter stages becomes one entry of pipeList, run as threads by a single process
+	const CMD** stageList = pipeList;
+	int* runStart = NULL; //First stage and number of stages of each entry
+	int* runLength = NULL;
+	if (getenv("THREAD_STAGES")) {
+		runStart = malloc(sizeof(int) * size);
+		runLength = malloc(sizeof(int) * size);
+		int units = 0;
+		for (int k = 0; k < size; k += runLength[units++]) {
+			runStart[units] = k;
+			runLength[units] = 1;
+			while (k + runLength[units] < size && threadableStage(stageList[k]) && threadableStage(stageList[k + runLength[units]])) {
+				runLength[units]++;
+			}
+		}
+		pipeList = malloc(sizeof(CMD*) * units);
+		for (int u = 0; u < units; u++) {
+			pipeList[u] = stageList[runStart[u]];
+		}
+		size = units;
+	}
+
+	bool adaptive;
+	int pipeSize = pipeSizeSetting(pipeList[0], &adaptive);
+	deadline* timer = commandDeadline(pipeList[0]); //TIMEOUT=DURATION on the first stage: one process group to kill
+	placement* placed = pipelinePlacement(pipeList[0], size); //PIPE_AFFINITY: CPUs of each stage
+	bool monitored = localOrEnv(pipeList[0], "PIPE_MONITOR") != NULL; //PIPE_MONITOR: report the bottleneck
+	if ((adaptive || monitored) && !fdBudget(size - 1)) { //Otherwise the parent holds one pipe end per stage at most
+		fprintf(stderr, "pipe: %d stages are too many to sample, PIPE_SIZE=adaptive and PIPE_MONITOR ignored\n", size);
+		adaptive = monitored = false;
+	}
+	bool counted = localOrEnv(pipeList[0], "PERF_STAT") != NULL; //PERF_STAT: counters of each stage
+	if (counted && !fdBudget(size * PERF_FDS)) {
+		fprintf(stderr, "pipe: %d stages are too many to count, PERF_STAT ignored\n", size);
+		counted = false;
+	}
+	//The shell's own pipelines (not those of a subshell or & job, which stay in the group they are part of)
+	//get a process group, so they can be signalled as a whole (see foregroundJob())
+	bool group = (timer != NULL || getpid() == shellPid);
+	int* readEnds = NULL; //Adaptive or monitor mode only: read end of each pipe, kept by the parent for sampling until its reader is reaped
+	if (adaptive || monitored) {
+		readEnds = malloc(sizeof(int) * size);
+		for (int k = 0; k < size; k++) {
+			readEnds[k] = -1;
+		}
+	}
 
 	/* printf("Processing pipes:\n");
 	for (int i = 0; i < size; i++) {
@@ -156,31 +489,56 @@ void executePipe(const CMD *cmdList) {
 	pid, result,            // Process ID and status of child
 	fdin,                   // Read end of last pipe (or original stdin)
 	i;
-	int processes[size];
+	int* processes = calloc(size, sizeof(int)); //Pids, processes[0] leads the group
+	monitor* watch = (monitored? startMonitor(pipeList, size, processes, readEnds) : NULL);
+	perfStat* counters = (counted? startPerf(pipeList, size) : NULL);
 
     fdin = 0;                                   // Remember original stdin
     for (i = 0; i < size-1; i++) {              // Create chain of processes
-		if (pipe(fd) == -1) {
+		if (pipeFds(fd) == -1) {
 			errorStatus("pipe: pipe faild", false);
-			return;
+			break;                              //  Reap the stages already started
+		}
+		else if (pipeSize > 0 && fcntl(fd[1], F_SETPIPE_SZ, pipeSize) == -1) {
+			perror("pipe: F_SETPIPE_SZ"); //Not fatal, pipe keeps its default capacity
 		}
-		else if ((pid = fork()) < 0) {
+		if (pipeList[i]->toType == RED_OUT_APP) {
+			cacheAppendFile(pipeList[i]->toFile);
+		}
+
+		if (counters != NULL || (runLength != NULL && runLength[i] > 1) || (pid = zygoteCommand(pipeList[i], fdin, fd[1], i == 0, (group? processes[0] : -1))) == 0) {
+			perfGate(counters);
+			pid = fork();
+			if (pid != 0) {
+				perfAttach(counters, i, pid);   //  Lets the child go on
+			}
+		}
+		if (pid < 0) {
 			errorStatus("fork", false);
-			return;
+			close (fd[0]);
+			close (fd[1]);
+			break;                              //  Reap the stages already started
 		}
 
 		else if (pid == 0) {                    // Child process
+			perfChild(counters);                //  Counted from here on
+			signal(SIGINT, SIG_DFL);            //  Cancelled with the rest of the group
+			if (group) {                        //  Join the pipeline's group
+				setpgid(0, processes[0]);
+			}
+			applyLimits(pipeList[i]);
+			if (placed != NULL) {
+				placeProcess(placed, i, 0);
+			}
 			close (fd[0]);                      //  No reading from new pipe
-
-			if (fdin != 0)  {                   //  stdin = read[last pipe]
-				dup2 (fdin, 0);
-				close (fdin);
+			for (int k = 0; readEnds != NULL && k < i-1; k++) { //  Nor from earlier ones
+				close (readEnds[k]);
 			}
 
-			if (fd[1] != 1) {                   //  stdout = write[new pipe]
-				dup2 (fd[1], 1);
-				close (fd[1]);
+			if (fdin != 0)  {                   //  stdin = read[last pipe]
+				moveFd (fdin, 0);
 			}
+			moveFd (fd[1], 1);                  //  stdout = write[new pipe]
 			if (i == 0) {
 				//Add local variables to environment only for first pipe function
 				for (int j = 0; j < pipeList[i]->nLocal; j++) {
@@ -188,9 +546,17 @@ void executePipe(const CMD *cmdList) {
 					setenv(pipeList[i]->locVar[j], pipeList[i]->locVal[j], 1);
 				}
 			}
+			if (runLength != NULL && runLength[i] > 1) { //  Run of filters as threads
+				exit(runStageThreads(stageList + runStart[i], runLength[i]));
+			}
 			redirectFile(pipeList[i]);
 
 			if (pipeList[i]->type == SIMPLE) {
+				builtinFn builtin = findBuiltin(pipeList[i]->argv);
+				if (builtin != NULL) {          //  Run in-process, no exec
+					exit(builtin(pipeList[i]->argv, 0, 1));
+				}
+				closeExtraFds();
 				execvp (pipeList[i]->argv[0], pipeList[i]->argv);
 				int error = errno; //If execvp failed, store the error number
 				errorExit (error); //Print error message, exit the child program with the error number (wait loop at end will catch this while reaping)
@@ -209,7 +575,22 @@ void executePipe(const CMD *cmdList) {
 		
 		else {                                // Parent process
 			processes[i] = pid;	//track pid of child process			
-			if (i > 1) {                         //   Close read[last pipe]
+			if (group) {
+				setpgid(pid, processes[0]);     //   Also done by the child: whichever runs first
+			}
+			if (group && i == 0) {
+				foregroundJob(pid);
+			}
+			if (timer != NULL) {
+				watchDeadline(timer, pid);
+			}
+			if (placed != NULL) {               //   Again, for stages spawned by the zygote
+				placeProcess(placed, i, pid);
+			}
+			if (readEnds != NULL) {              //   Keep read[new pipe] for sampling
+				readEnds[i] = fd[0];
+			}
+			else if (fdin != 0) {                //   Close read[last pipe]
 				close (fdin);                   //    if not original stdin
 			}
 
@@ -218,19 +599,62 @@ void executePipe(const CMD *cmdList) {
 		}
     }
 
-    if ((pid = fork()) < 0)  {                   // Create last process
-		errorStatus("fork", false);
-		return;
+    if (i < size-1) {                           // A stage could not be started:
+		pid = -1;                               //  don't start the last one
+	}
+    else {                                      // Create last process
+		if (pipeList[size-1]->toType == RED_OUT_APP) {
+			cacheAppendFile(pipeList[size-1]->toFile);
+		}
+		if (counters != NULL || (runLength != NULL && runLength[size-1] > 1) || (pid = zygoteCommand(pipeList[size-1], fdin, 1, size == 1, (group? processes[0] : -1))) == 0) {
+			perfGate(counters);
+			pid = fork();
+			if (pid != 0) {
+				perfAttach(counters, size-1, pid);
+			}
+		}
+		if (pid < 0) {
+			errorStatus("fork", false);
+		}
+	}
+    int started = (pid < 0? i : size);          // Stages to reap
+
+    if (pid < 0)  {                             // Pipeline cut short
+		if (fdin != 0) {                        //  Its last reader goes: earlier stages get SIGPIPE
+			close (fdin);
+			if (readEnds != NULL) {
+				readEnds[i-1] = -1;
+			}
+		}
 	}
 
     else if (pid == 0) {                        // Child process
+		perfChild(counters);                    //  Counted from here on
+		signal(SIGINT, SIG_DFL);                //  Cancelled with the rest of the group
+		if (group) {                            //  Join the pipeline's group
+			setpgid(0, processes[0]);
+		}
+		applyLimits(pipeList[size-1]);
+		if (placed != NULL) {
+			placeProcess(placed, size-1, 0);
+		}
+		for (int k = 0; readEnds != NULL && k < size-2; k++) { //  No reading from earlier pipes
+			close (readEnds[k]);
+		}
 		if (fdin != 0) {                        //  stdin = read[last pipe]
-			dup2 (fdin, 0);
-			close (fdin);
+			moveFd (fdin, 0);
+		}
+		if (runLength != NULL && runLength[size-1] > 1) { //  Run of filters as threads
+			exit(runStageThreads(stageList + runStart[size-1], runLength[size-1]));
 		}
 		redirectFile(pipeList[size-1]);
 
 		if (pipeList[size-1]->type == SIMPLE) {
+			builtinFn builtin = findBuiltin(pipeList[size-1]->argv);
+			if (builtin != NULL) {              //  Run in-process, no exec
+				exit(builtin(pipeList[size-1]->argv, 0, 1));
+			}
+			closeExtraFds();
 			execvp (pipeList[size-1]->argv[0], pipeList[size-1]->argv);
 			int error = errno; //If execvp failed, store the error number
 			errorExit (error); //Print error message, exit the program with the error number (wait loop at end will catch this while reaping)
@@ -249,62 +673,148 @@ void executePipe(const CMD *cmdList) {
 	
 	else {                                    // Parent process
 		processes[size-1] = pid;	//track pid of last child process
-		if (i > 1) {                             //  Close read[last pipe]
+		if (group) {
+			setpgid(pid, processes[0]);
+		}
+		if (group && size == 1) {
+			foregroundJob(pid);
+		}
+		if (timer != NULL) {
+			watchDeadline(timer, pid);
+		}
+		if (placed != NULL) {
+			placeProcess(placed, size-1, pid);
+		}
+		if (readEnds == NULL && fdin != 0) {                  //  Close read[last pipe]
 			close (fdin);                       //   if not original stdin
 		}
 	}
 	
+	stagePid* byPid = malloc(sizeof(stagePid) * (started + 1)); //Reaped pids are looked up in O(log n)
+	for (int j = 0; j < started; j++) {
+		byPid[j].pid = processes[j];
+		byPid[j].stage = j;
+	}
+	qsort(byPid, started, sizeof(stagePid), comparePids);
+
 	int status = 0;
-    for (i = 0; i < size; i++) {                   // Wait for children to die
-		pid = wait (&result); //here, we are waiting for any pid to reap, not just the ones in the pipe. Might catch a zombie here
-		//Check if the reaped pid is background zombie or pipe - note this is currently inefficient (O (n^2))
+    for (i = 0; i < started; i++) {                // Wait for children to die
+		pid = waitPipeStage (&result, readEnds, size - 1, adaptive, watch, timer); //here, we are waiting for any pid to reap, not just the ones in the pipe. Might catch a zombie here
+		//Check if the reaped pid is background zombie or pipe
 		if (pid != -1) { //No error in collecting PID
-			for (int j = 0; j < size + 1; j++) {
-				if (j >= size) { //Zombie process, since the reaped pid does not exist in the proccesses array
-					fprintf(stderr, "Completed: %d (%d)\n", pid, status); //Reaped a zombie
-					zombies--;
-					i--; //Since this is not a pipe command, need to still reap all pipe commands (so iterate one more time to ignore zombie)
+			stagePid key = {pid, 0};
+			stagePid* reaped = bsearch(&key, byPid, started, sizeof(stagePid), comparePids);
+			if (reaped == NULL) { //Zombie process, since the reaped pid does not exist in the proccesses array
+				reapedBackground(pid, result);
+				i--; //Since this is not a pipe command, need to still reap all pipe commands (so iterate one more time to ignore zombie)
+			}
+			else { //Reaping one of the pipe childs, not a zombie
+				int j = reaped->stage;
+				perfReaped(counters, j);
+				if (readEnds != NULL && j > 0 && readEnds[j-1] >= 0) { //Its input pipe no longer needs sampling
+					close(readEnds[j-1]);
+					readEnds[j-1] = -1;
 				}
-				else if (processes[j] == pid) { //Reaping one of the pipe childs, not a zombie
-					//printf("Result: %d\n", result);
-					if (STATUS(result) != 0) {
-						status = STATUS(result);
-					}
-					char buffer[4];
-					sprintf(buffer, "%d", status);
-					setenv("?", buffer, 1);
-					break;
+				//printf("Result: %d\n", result);
+				if (STATUS(result) != 0) {
+					status = STATUS(result);
 				}
+				char buffer[4];
+				sprintf(buffer, "%d", status);
+				setenv("?", buffer, 1);
 			}
 		}
 		
     }
+	if (group && started > 0) {                 // Every member is reaped: no longer in the foreground
+		foregroundJob(0);
+	}
+	free(byPid);
+
+	if (timer != NULL) {                        //124 or 137 if the deadline passed
+		char buffer[4];
+		sprintf(buffer, "%d", finishDeadline(timer, status));
+		setenv("?", buffer, 1);
+	}
+	freePlacement(placed);
+	finishMonitor(watch);
+	finishPerf(counters);
+	free(processes);
+
+	if (runLength != NULL) {
+		free(pipeList);
+		free(runStart);
+		free(runLength);
+	}
+	free(stageList);
+
+	if (readEnds != NULL) {
+		for (int k = 0; k < size - 1; k++) {
+			if (readEnds[k] >= 0) {
+				close(readEnds[k]);
+			}
+		}
+		free(readEnds);
+	}
 	
 }
 
-void executeConditional(const CMD* cmdList) {
-	//Process left subchild first
-	CMD* left = cmdList->left;
-	process(left);
-	char* result = getenv("?");
-	
-	//Switch based on && or ||
-	if (cmdList->type == SEP_AND) {
-		if (strcmp(result, "0") == 0) {
-			process(cmdList->right);
+//Nodes of type TYPE (or TYPE2) down the left spine of cmdList, top first: a chain A ; B ; C (or A && B || C) is
+//left-associative, as deep as it is long. Sets *DEPTH to their number and *LEAF to the command below them
+static const CMD** leftSpine(const CMD* cmdList, int type, int type2, int* depth, const CMD** leaf) {
+	int room = 16;
+	const CMD** spine = malloc(sizeof(CMD*) * room);
+	*depth = 0;
+	for ( ; cmdList->type == type || cmdList->type == type2; cmdList = cmdList->left) {
+		if (*depth == room) {
+			REALLOC(spine, room *= 2);
 		}
+		spine[(*depth)++] = cmdList;
 	}
+	*leaf = cmdList;
+	return spine;
+}
 
-	else if (cmdList->type == SEP_OR) {
-		if (strcmp(result, "0") != 0) {
-			process(cmdList->right);
+void executeConditional(const CMD* cmdList) {
+	//Process the first command of the chain, then each right child on the way back up depending on the status so far
+	//(a loop rather than recursion, so a chain of thousands of && and || can't overflow the stack)
+	int depth;
+	const CMD* first;
+	const CMD** spine = leftSpine(cmdList, SEP_AND, SEP_OR, &depth, &first);
+	process(first);
+	while (depth > 0) {
+		const CMD* c = spine[--depth];
+		bool succeeded = strcmp(getenv("?"), "0") == 0;
+
+		//Switch based on && or ||
+		if ((c->type == SEP_AND && succeeded) || (c->type == SEP_OR && !succeeded)) {
+			process(c->right);
 		}
 	}
+	free(spine);
+}
 
+//Process a chain of ; in order, as executeConditional() does
+void executeSequential(const CMD* cmdList) {
+	int depth;
+	const CMD* first;
+	const CMD** spine = leftSpine(cmdList, SEP_END, SEP_END, &depth, &first);
+	process(first);
+	while (depth > 0) {
+		const CMD* c = spine[--depth];
+		if (c->right != NULL) { //A ; at the end of the line has no right child
+			process(c->right);
+		}
+	}
+	free(spine);
 }
 
 void executeSubcommand(const CMD* cmdList) {
 	//Fork off a "subshell"
+	if (cmdList->toType == RED_OUT_APP) {
+		cacheAppendFile(cmdList->toFile);
+	}
+	bool group = (getpid() == shellPid); //A process group of its own, cancelled as a whole
 	int pid = fork();
 
 	if (pid < 0) { //Error
@@ -314,6 +824,9 @@ void executeSubcommand(const CMD* cmdList) {
 
 	//Child code - the subshell
 	else if (pid == 0) {
+		if (group) {
+			setpgid(0, 0);
+		}
 		//Add local variables to environment for the subshell
 		for (int i = 0; i < cmdList->nLocal; i++) {
 			// printf("%s: %s\n", cmdList->locVar[i], cmdList->locVal[i]);
@@ -326,9 +839,16 @@ void executeSubcommand(const CMD* cmdList) {
 
 	//Parent code
 	else {
+		if (group) {
+			setpgid(pid, pid); //Also done by the child: whichever runs first
+			foregroundJob(pid);
+		}
 		int result = -1;
-		waitpid(pid, &result, 0);
-		if (result != -1) { //If we actually collected the status from here (rather than it being reaped elsewhere - eg, SIGINT interrupt handler), then set status
+		waitChild(pid, &result);
+		if (group) {
+			foregroundJob(0);
+		}
+		if (result != -1) { //If we actually collected the status from here (rather than it being reaped elsewhere), then set status
 			char buffer[4];
 			sprintf(buffer, "%d", STATUS(result));
 			setenv("?", buffer, 1);
@@ -336,52 +856,40 @@ void executeSubcommand(const CMD* cmdList) {
 	}
 }
 
-//In order traversal to flatten tree of pipes
-void flattenBG(const CMD* cmdList, const CMD*** backgroundList, CMD** foreground, int* i) {
-	if (cmdList->type != SEP_BG && cmdList->type != SEP_END) { //If the node is NOT a ; or &, add it to the background list
-		(*backgroundList)[*i] = cmdList;
-		(*i)++;
-		return;
-	}
-	
-	//If this is a ; node, the left child goes in the foreground, right child goes in the background
-	else if (cmdList->type == SEP_END) {
-		*foreground = cmdList->left;
-		(*backgroundList)[*i] = cmdList->right;
-		(*i)++;
-	}
-	
-	//If this is a & node, recurse down the left child, then recurse down the right child
-	else if (cmdList->type == SEP_BG) {
-		flattenBG(cmdList->left, backgroundList, foreground, i);
-		if (cmdList->right != NULL) {
-			flattenBG(cmdList->right, backgroundList, foreground, i);
-			//SHOULD NOT VISIT THE RIGHT TREE OF THE TOP SEP_BG NODE!
+//In order traversal to flatten a tree of & and ; into the commands to run in the background, with a stack of the
+//right subtrees still to visit rather than recursion (a chain of thousands of & is as deep as it is long).
+//Sets *FOREGROUND to the left child of the last ; met and *SIZE to the number of background commands
+static const CMD** flattenBG(const CMD* cmdList, CMD** foreground, int* size) {
+	int capacity = 16, depth = 0, room = 16;
+	const CMD** backgroundList = malloc(sizeof(CMD*) * capacity);
+	const CMD** pending = malloc(sizeof(CMD*) * room);
+	*size = 0;
+	for (const CMD* c = cmdList; c != NULL; c = (depth > 0? pending[--depth] : NULL)) {
+		//If this is a & node, visit the left child, then the right child
+		while (c->type == SEP_BG) {
+			if (c->right != NULL) {
+				if (depth == room) {
+					REALLOC(pending, room *= 2);
+				}
+				pending[depth++] = c->right;
+			}
+			c = c->left;
+		}
+		if (*size == capacity) {
+			REALLOC(backgroundList, capacity *= 2);
 		}
-		
-	}
-}
 
-//In order traversal to flatten tree of pipes
-void countBG(const CMD* cmdList, int* i) {
-	if (cmdList->type != SEP_BG && cmdList->type != SEP_END) { //If the node is NOT a ; or &, add it to the background list
-		(*i)++;
-		return;
-	}
-	
-	//If this is a ; node, the left child goes in the foreground, right child goes in the background
-	else if (cmdList->type == SEP_END) {
-		(*i)++;
-	}
-	
-	//If this is a & node, recurse down the left child, then recurse down the right child
-	else if (cmdList->type == SEP_BG) {
-		countBG(cmdList->left, i);
-		if (cmdList->right != NULL) {
-			countBG(cmdList->right, i);
+		//If this is a ; node, the left child goes in the foreground, right child goes in the background
+		if (c->type == SEP_END) {
+			*foreground = c->left;
+			backgroundList[(*size)++] = c->right;
+		}
+		else { //If the node is NOT a ; or &, add it to the background list
+			backgroundList[(*size)++] = c;
 		}
-		
 	}
+	free(pending);
+	return backgroundList;
 }
 
 void executeBackground(const CMD* cmdList) {
@@ -393,10 +901,7 @@ void executeBackground(const CMD* cmdList) {
 
 	//Only make this list if there is more than one bg / sep node (not if there is only one)
 	if (cmdList->left->type == SEP_END || cmdList->left->type == SEP_BG) {
-		countBG(cmdList->left, &size); //count how many background commands there are
-		backgroundList = malloc(sizeof(CMD*) * size); //malloc enough space in the list
-		int j = 0;
-		flattenBG(cmdList->left, &backgroundList, &foreground, &j); //populate the list. Start with left subchild since we don't want the algorithm to visit the right child of the root & (since that goes in FG)
+		backgroundList = flattenBG(cmdList->left, &foreground, &size); //Start with left subchild since we don't want the algorithm to visit the right child of the root & (since that goes in FG)
 		//NOTE, it is safe to start from the left child of the root &. Because, we know that this subchild must either be an & or a ;. 
 		//If it is &, the algorithm will visit both left and right. If it is ;, the algorithm will but left in foreground and right in background
 	}
@@ -415,26 +920,37 @@ void executeBackground(const CMD* cmdList) {
 
 	//Iterate through list of background commands and fork a subchild for each
 	for (int i = 0; i < size; i++) {
+		placement* placed = backgroundPlacement(); //BG_AFFINITY: next node (or cache domain) in turn
 		int pid = fork();
 
 		if (pid < 0) { //Error
 			errorStatus("background, fork failed", false);
+			freePlacement(placed);
+			free(backgroundList);
 			return;
 		}
 
 		//Child code - the subshell (background)
 		else if (pid == 0) {
+			setpgid(0, 0); //A job of its own, which the terminal's Ctrl-C doesn't reach
+			if (placed != NULL) {
+				placeProcess(placed, 0, 0); //Inherited by everything the job runs
+			}
 			process(backgroundList[i]); //The actual commands in the background (the left node)
 			exit(atoi(getenv("?"))); //Exit with the status of the last executed command
 		}
 
 		else { //Parent code
 			//Don't wait but track the pid
+			setpgid(pid, pid);
 			fprintf(stderr, "Backgrounded: %d\n", pid);
 			zombies++;
+			freePlacement(placed);
 		}
 	}	
 
+	free(backgroundList);
+
 	//Parent
 	//Process the right hand side of the SEP BG (if it has one)
 	if (cmdList->right != NULL) {
@@ -443,203 +959,173 @@ void executeBackground(const CMD* cmdList) {
 	setenv("?", "0", 1); //Set status in parent foreground shell to 0
 }
 
-void executeCD (const CMD* cmdList) { //Not tested with pipelines, conditionals, redirection, subcommand. Not tested for edge cases
-	int status = 1;
-	if (cmdList->argv[1] != NULL) { //Directory specified
-		if (cmdList->argv[2] != NULL) { //2 arguments specified
-			fprintf(stderr, "usage: cd OR cd <dirName>\n");
-			setenv("?", "1", 1); //set exit status to 1
-			return;
+//Logical path of TARGET relative to the logical directory BASE, with "." and ".." resolved textually (as cd -L)
+static char* logicalPath(const char* base, const char* target) {
+	char* path = malloc(strlen(base) + strlen(target) + 3);
+	size_t len = 0;
+	if (target[0] != '/') {
+		len = strlen(strcpy(path, base));
+	}
+	const char* component = target;
+	while (*component) {
+		size_t n = strcspn(component, "/");
+		if (n == 2 && strncmp(component, "..", 2) == 0) {
+			while (len > 0 && path[--len] != '/') //Drop the last component
+				;
 		}
-		if (cmdList->argv[1][0] == '/') {
-			status = chdir(cmdList->argv[1]);
-			if (status == -1) { //System call failed
-				errorStatus("cd: chdir fail", false);
-				return;
-			}
-			else {
-				setenv("?", "0", 1); //set exit status to 0
-				return;
+		else if (n > 0 && !(n == 1 && component[0] == '.')) {
+			if (len == 0 || path[len - 1] != '/') {
+				path[len++] = '/';
 			}
+			memcpy(path + len, component, n);
+			len += n;
 		}
-		else if (cmdList->argv[1][0] == '.' && strlen(cmdList->argv[1]) == 1) { //cd .
-			setenv("?", "0", 1); //set exit status to 0
-			return;
-		}
-		else if (cmdList->argv[1][0] == '.' && cmdList->argv[1][1] == '/') {
-			char pwd[PATH_MAX];
-			char* temp = getcwd(pwd, sizeof(pwd));
-			if (temp == NULL) { //System call failed
-				errorStatus("cd: getcwd fail", false);
-				return;
-			}
-			//char* pwd = get_current_dir_name(); //NEED TO FREE
-			int len = strlen(pwd);
-			if (pwd[len - 1] != '/') {
-				len++;
-			}
-			len += strlen(cmdList->argv[1]) - 2; //remove 2 for the ./
-			len++; //For null character
-			char directory[len];
-			memset(directory, 0, len);
-			strcat(directory, pwd);
-			if (pwd[strlen(pwd) - 1] != '/') {
-				strcat(directory, "/");
-			}
-			strcat(directory, cmdList->argv[1] + 2);
-			
-			status = chdir(directory);
-			if (status == -1) { //System call failed
-				errorStatus("cd: chdir fail", false);
-				return;
-			}
-			else {
-				setenv("?", "0", 1); //set exit status to 0
-				return;
-			}
-		}
-		else if (cmdList->argv[1][0] == '.' && cmdList->argv[1][1] == '.') {
-			char pwd[PATH_MAX];
-			char* temp = getcwd(pwd, sizeof(pwd));
-			if (temp == NULL) { //System call failed
-				errorStatus("cd: getcwd fail", false);
-				return;
-			}
-			int pwdLen = strlen(pwd);
+		component += n + (component[n] == '/');
+	}
+	if (len == 0) {
+		path[len++] = '/';
+	}
+	path[len] = '\0';
+	return path;
+}
 
-			//printf("Getcwd: %s\n", temp);
-			
-			int parentLen = 0; //How many characters at end of pwd to cut off for the parent directory
-			if (pwd[pwdLen - 1] == '/') {
-				parentLen++;
-			}
+//Start tracking the current directory: its logical path (PWD if it names it, else getcwd) and a dirfd for it
+//Returns false with errno set if the current directory can't be determined
+static bool trackDirectory(void) {
+	if (cwdFd >= 0) {
+		return true;
+	}
+	struct stat here, there;
+	char* pwd = getenv("PWD");
+	if (pwd != NULL && pwd[0] == '/' && stat(".", &here) == 0 && stat(pwd, &there) == 0
+			&& here.st_dev == there.st_dev && here.st_ino == there.st_ino) {
+		logicalPwd = strdup(pwd);
+	}
+	else if ((logicalPwd = getcwd(NULL, 0)) == NULL) {
+		return false;
+	}
+	cwdFd = holdFd(openFd(".", O_PATH | O_DIRECTORY, 0));
+	if (cwdFd < 0) {
+		free(logicalPwd);
+		logicalPwd = NULL;
+		return false;
+	}
+	setenv("PWD", logicalPwd, 1);
+	return true;
+}
 
-			while (pwd[pwdLen - 1 - parentLen] != '/') {
-				parentLen++;
-			}
-			parentLen++; //to account for the last /
-
-			char cutPwd[pwdLen - parentLen + 1];
-			strncpy(cutPwd, pwd, pwdLen-parentLen);
-			cutPwd[pwdLen-parentLen] = 0;
-
-			//printf("Parent directory: %s\n", cutPwd);
-
-			int len = strlen(cutPwd);
-			len += strlen(cmdList->argv[1]) - 2; //remove 2 for the ..
-			len += 1; //For null character
-			char directory[len];
-			memset(directory, 0, len);
-			strcat(directory, cutPwd); //Parent directory
-			if (strlen(cmdList->argv[1]) > 2) {
-				strcat(directory, cmdList->argv[1] + 2); //Whatever was after the ..
-			}
-			status = chdir(directory);
-			if (status == -1) {
-				errorStatus("cd: chdir fail", false);
-				return;
-			}
-			else {
-				setenv("?", "0", 1); //set exit status to 0
-				return;
-			}
-		}
-		else {
-			char pwd[PATH_MAX];
-			char* temp = getcwd(pwd, sizeof(pwd));
-			if (temp == NULL) { //System call failed
-				errorStatus("cd: getcwd fail", false);
-				return;
-			}
-			int len = strlen(pwd);
-			if (pwd[len - 1] != '/') {
-				len++;
-			}
-			len += strlen(cmdList->argv[1]);
-			len++; //For null character
-			char directory[len];
-			memset(directory, 0, len);
-			strcat(directory, pwd);
-			if (pwd[strlen(pwd) - 1] != '/') {
-				strcat(directory, "/");
-			}
-			strcat(directory, cmdList->argv[1]);
+//Open directory TARGET and set *PATH to its logical path. Paths without ".." are opened relative to the
+//current dirfd; ones with ".." are resolved logically. Returns the dirfd or -1 with errno set
+static int openDirectory(const char* target, char** path) {
+	*path = logicalPath(logicalPwd, target);
+	int fd;
+	if (strstr(target, "..") == NULL) {
+		fd = openFdAt(cwdFd, target, O_PATH | O_DIRECTORY, 0);
+	}
+	else {
+		fd = openFd(*path, O_PATH | O_DIRECTORY, 0);
+	}
+	if (fd < 0) {
+		int error = errno;
+		free(*path);
+		errno = error;
+	}
+	return holdFd(fd); //Becomes the current directory, then maybe part of the pushd stack
+}
 
-			status = chdir(directory);
-			if (status == -1) { //System call failed
-				errorStatus("cd: chdir fail", false);
-				return;
-			}
-			else {
-				setenv("?", "0", 1); //set exit status to 0
-				return;
-			}
-		}
+//Make the directory open as FD with logical path PATH current, taking ownership of both. The previous
+//dirfd and path are released unless KEEP is set (pushd stacks them). Returns -1 with errno set on failure
+static int enterDirectory(int fd, char* path, bool keep) {
+	if (fchdir(fd) == -1) {
+		int error = errno;
+		closeFd(fd);
+		free(path);
+		errno = error;
+		return -1;
 	}
-	else { //Cd to HOME directory
-		status = chdir(getenv("HOME"));
-		if (status == -1) { //System call failed
-			errorStatus("cd: chdir fail", false);
-			return;
-		}
-		else {
-			setenv("?", "0", 1); //set exit status to 0
-			return;
-		}
+	appendDirectoryChanged(); //>> FILE relative to the new directory
+	setenv("OLDPWD", logicalPwd, 1);
+	setenv("PWD", path, 1);
+	if (!keep) {
+		closeFd(cwdFd);
+		free(logicalPwd);
 	}
-	
+	cwdFd = fd;
+	logicalPwd = path;
+	return 0;
+}
+
+//cd to TARGET (HOME if NULL), keeping the previous directory when KEEP is set; sets the exit status
+static bool changeDirectory(const char* target, bool keep) {
+	if (target == NULL && (target = getenv("HOME")) == NULL) {
+		fprintf(stderr, "cd: HOME not set\n");
+		setenv("?", "1", 1); //set exit status to 1
+		return false;
+	}
+	if (!trackDirectory()) {
+		errorStatus("cd: getcwd fail", false);
+		return false;
+	}
+	char* path;
+	int fd = openDirectory(target, &path);
+	if (fd < 0 || enterDirectory(fd, path, keep) == -1) { //System call failed
+		errorStatus("cd: chdir fail", false);
+		return false;
+	}
+	setenv("?", "0", 1); //set exit status to 0
+	return true;
+}
+
+void executeCD (const CMD* cmdList) {
+	if (cmdList->argv[1] != NULL && cmdList->argv[2] != NULL) { //2 arguments specified
+		fprintf(stderr, "usage: cd OR cd <dirName>\n");
+		setenv("?", "1", 1); //set exit status to 1
+		return;
+	}
+	changeDirectory(cmdList->argv[1], false);
+}
+
+//Print the current directory followed by the directory stack, top first
+static void printDirectoryStack(void) {
+	printf("%s", logicalPwd);
+	for (int i = directoryStack->size - 1; i >= 0; i--) {
+		printf(" %s", directoryStack->elements[i]);
+	}
+	printf("\n");
 }
 
 void executePushd(const CMD* cmdList) {
-	if (cmdList->argv[2] != NULL) {
+	if (cmdList->argv[1] != NULL && cmdList->argv[2] != NULL) {
 		fprintf(stderr, "usage: pushd <dirName>\n");
 		setenv("?", "1", 1); //set exit status to 1
 		return;
 	}
 	if (directoryStack == NULL) { //first time we are pushing to stack
-		directoryStack = malloc(sizeof(charStack)); //NEED TO FREE!
+		directoryStack = malloc(sizeof(charStack)); //Freed by popd when it empties
 		directoryStack->size = 0;
 		directoryStack->capacity = STACK_INIT_SIZE;
 		directoryStack->elements = malloc(sizeof(char*) * STACK_INIT_SIZE);
+		directoryStack->fds = malloc(sizeof(int) * STACK_INIT_SIZE);
 	}
 
 	if (directoryStack->size >= directoryStack->capacity) {
 		directoryStack->capacity *= 2;
 		directoryStack->elements = realloc(directoryStack->elements, sizeof(char*) * directoryStack->capacity);
+		directoryStack->fds = realloc(directoryStack->fds, sizeof(int) * directoryStack->capacity);
 	}
 
-	char pwd[PATH_MAX];
-	char* temp = getcwd(pwd, sizeof(pwd));
-	if (temp == NULL) {
-		errorSingleExit("getcwd", EXIT_FAILURE);
-	}
-	directoryStack->elements[directoryStack->size] = malloc(sizeof(char) * (strlen(pwd) + 1)); //NEED TO FREE
-	strcpy(directoryStack->elements[directoryStack->size], pwd);
-	(directoryStack->size)++;
-
-	executeCD(cmdList);
-
-	if (strcmp("0", getenv("?")) == 0) {
-		temp = getcwd(pwd, sizeof(pwd));
-		if (temp == NULL) {
-			errorStatus("cd: getcwd fail", false);
-			return;
-		}
-		else {
-				setenv("?", "0", 1); //Set exit status
-			}
-		printf("%s", pwd);
-		for (int i = directoryStack->size - 1; i >= 0; i--) {
-			printf(" %s", directoryStack->elements[i]);
-		}
-		printf("\n");
+	if (!trackDirectory()) {
+		errorStatus("cd: getcwd fail", false);
+		return;
 	}
-
-	else {
-		(directoryStack->size)--;
-		free(directoryStack->elements[directoryStack->size]);
+	char* previous = logicalPwd;
+	int previousFd = cwdFd;
+	if (changeDirectory(cmdList->argv[1], true)) { //Stack keeps the old dirfd, popd never re-resolves it
+		directoryStack->elements[directoryStack->size] = previous;
+		directoryStack->fds[directoryStack->size] = previousFd;
+		(directoryStack->size)++;
+		printDirectoryStack();
 	}
-
 }
 
 void executePopd(const CMD* cmdList) {
@@ -648,60 +1134,99 @@ void executePopd(const CMD* cmdList) {
 		setenv("?", "1", 1); //set exit status to 1
 		return;
 	}
-	if (directoryStack == NULL) {
-		fprintf(stderr, "popd: dir stack empty\n");
-		setenv("?", "1", 1); //Set exit status
-	}
-	else if (directoryStack->size == 0) {
+	if (directoryStack == NULL || directoryStack->size == 0) {
 		fprintf(stderr, "popd: dir stack empty\n");
 		setenv("?", "1", 1); //Set exit status
 	}
 	else {
 		(directoryStack->size)--;
-		char* temp = cmdList->argv[1];
-		free(temp);
-		cmdList->argv[1] = directoryStack->elements[directoryStack->size];
-
-		//printf("Calling CD with 2nd argument: %s\n", cmdList->argv[1]);
-		executeCD(cmdList);
-		
-		char pwd[PATH_MAX];
-		temp = getcwd(pwd, sizeof(pwd));
-		if (temp == NULL) {
-			errorStatus("cd: getcwd fail", false);
+		if (enterDirectory(directoryStack->fds[directoryStack->size], directoryStack->elements[directoryStack->size], false) == -1) {
+			errorStatus("cd: chdir fail", false);
 			return;
 		}
-		else {
-			setenv("?", "0", 1); //Set exit status
+		setenv("?", "0", 1); //Set exit status
+		printDirectoryStack();
+		if (directoryStack->size == 0) { //Nothing left to remember
+			free(directoryStack->elements);
+			free(directoryStack->fds);
+			free(directoryStack);
+			directoryStack = NULL;
 		}
-		printf("%s", pwd);
-		for (int i = directoryStack->size - 1; i >= 0; i--) {
-			printf(" %s", directoryStack->elements[i]);
+	}
+}
+
+void directoryMemory(memoryUsage* u) {
+	countBlock(u, logicalPwd);
+	if (directoryStack != NULL) {
+		countBlock(u, directoryStack);
+		countBlock(u, directoryStack->elements);
+		countBlock(u, directoryStack->fds);
+		for (int i = 0; i < directoryStack->size; i++) {
+			countBlock(u, directoryStack->elements[i]);
 		}
-		printf("\n");
 	}
 }
 
 //Handler for sig int (CTRL-C)
+void startShell(void) {
+	shellPid = getpid();
+}
+
+//Ctrl-C (SIGINT) in the shell: pass it on to the process group of the foreground job, whose wait (waitChild()
+//or waitPipeStage()) then reaps every member; the shell itself carries on
 void terminationHandler(int signum) {
-	int status = -1;
-	wait(&status); //Reap the child process that was terminated
+	if (foregroundGroup > 0) {
+		kill(-foregroundGroup, signum);
+	}
+	else {
+		write(1, "\n", 1);
+	}
+}
 
-	char buffer[4];
-	sprintf(buffer, "%d", STATUS(status)); //Convert interrupted kill of child to exit status
-	setenv("?", buffer, 1); //Set exit status to interrupted
+//Builtins that must run in the shell itself: they change its state (cwd, directory stack, caches, coprocesses)
+//or wait for commands of their own
+typedef void (*shellBuiltinFn)(const CMD* cmdList);
+static const struct {
+	const char* name;
+	shellBuiltinFn execute;
+} shellBuiltins[] = {
+	{"cd", executeCD},
+	{"pushd", executePushd},
+	{"popd", executePopd},
+	{"cache", executeCache},
+	{"timeout", executeTimeout},
+	{"memory", executeMemory},
+	{"coproc", executeCoproc},
+};
+
+//The shell builtin ARGV[0], or NULL
+static shellBuiltinFn shellBuiltin(char** argv) {
+	for (int i = 0; argv[0] != NULL && i < sizeof(shellBuiltins) / sizeof(shellBuiltins[0]); i++) {
+		if (strcmp(argv[0], shellBuiltins[i].name) == 0) {
+			return shellBuiltins[i].execute;
+		}
+	}
+	return NULL;
+}
 
-	if (status == -1) {
-		printf("\n");
+bool isShellBuiltin(char** argv) {
+	return shellBuiltin(argv) != NULL;
+}
+
+void reapedBackground(int pid, int result) {
+	if (!zygoteExited(pid, result) && !coprocExited(pid, result)) { //A coprocess is restarted when next used
+		fprintf(stderr, "Completed: %d (%d)\n", pid, result); //Reaped a zombie
+		zombies--;
 	}
 }
 
 int process (const CMD *cmdList) {
 	//printf("Process called by %d on %s %s\n", getpid(), cmdList->argv[0], cmdList->argv[1]);
 	
-	//Handling for CTRL-C (SIGINT)
+	//Handling for CTRL-C (SIGINT): the shell passes it on, its subshells and & jobs just die of it
 	struct sigaction catchInterrupt;
-	catchInterrupt.sa_handler = terminationHandler;
+	memset(&catchInterrupt, 0, sizeof(catchInterrupt));
+	catchInterrupt.sa_handler = (getpid() == shellPid? terminationHandler : SIG_DFL);
 	sigaction(SIGINT, &catchInterrupt, NULL);
 	
 	//Reap Zombies once per execution
@@ -709,21 +1234,19 @@ int process (const CMD *cmdList) {
 	int pid = 0;
 	pid = waitpid(-1, &status, WNOHANG);
 	while (pid != (pid_t) 0 && pid != -1 && status != -1) {
-		fprintf(stderr, "Completed: %d (%d)\n", pid, status); //Reaped a zombie
-		zombies--;
+		reapedBackground(pid, status);
 		pid = waitpid(-1, &status, WNOHANG);
 	}
 
 	//Simple command
 	if (cmdList->type == SIMPLE) {
-		if (strcmp(cmdList->argv[0], "cd") == 0) {
-			executeCD(cmdList);
-		}
-		else if (strcmp(cmdList->argv[0], "pushd") == 0) {
-			executePushd(cmdList);
+		expandGlobs(cmdList); //GLOB: now, so that it sees what the commands before it did
+		shellBuiltinFn shell = shellBuiltin(cmdList->argv);
+		if (shell != NULL) {
+			shell(cmdList);
 		}
-		else if (strcmp(cmdList->argv[0], "popd") == 0) {
-			executePopd(cmdList);
+		else if (findBuiltin(cmdList->argv) != NULL && (cmdList->fromType != NONE || !isatty(0))) { //Not on a terminal: Ctrl-C must be able to stop it
+			executeBuiltin(cmdList, findBuiltin(cmdList->argv));
 		}
 		else {
 			executeSingle(cmdList);
@@ -747,8 +1270,12 @@ int process (const CMD *cmdList) {
 
 	//Sep end: doesn't fork off children, calls process sequentially on left and right (regardless of exit status)
 	else if (cmdList->type == SEP_END) {
-		process(cmdList->left);
-		process(cmdList->right);
+		if (getenv("PARALLEL")) { //Independent commands run concurrently
+			executeSequence(cmdList);
+		}
+		else {
+			executeSequential(cmdList);
+		}
 	}
 
 	//Background
@@ -11,7 +11,11 @@
 #include <signal.h>
 #include <stdbool.h>
 #include <sys/file.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <time.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <limits.h>
 #include <linux/limits.h>
 #include "/c/cs323/proj4/starter-code/parse.h"
@@ -29,5 +33,266 @@
 // that is killed has nonzero status; ignores the possibility of stop/continue.
 #define STATUS(x) (WIFEXITED(x) ? WEXITSTATUS(x) : 128+WTERMSIG(x))
 
+// Kernel default pipe capacity
+#define PIPE_SIZE_DEFAULT 65536
+
 // Execute command list CMDLIST and return status of last command executed
 int process (const CMD *cmdList);
+
+// Note that this process is the shell itself, not a subshell or & job: its
+// pipelines get process groups (and the terminal) of their own
+void startShell (void);
+
+// Make process group PGID the foreground job (0: there is none now): Ctrl-C
+// is passed on to it, and it has the terminal if the shell had it
+void foregroundJob (int pgid);
+
+// Wait for child PID (any if -1), store its status in *RESULT and return its
+// pid (-1 if there is no such child), carrying on after a Ctrl-C
+int waitChild (int pid, int *result);
+
+// In-process builtin: run ARGV reading fd IN and writing fd OUT, return exit status
+typedef int (*builtinFn) (char **argv, int in, int out);
+
+// Return the builtin implementing ARGV, or NULL if it must be exec'd
+builtinFn findBuiltin (char **argv);
+
+// Return the builtin for the head, tail, wc or grep -F command ARGV, or NULL
+builtinFn filterBuiltin (char **argv);
+
+// Copy fd IN to fd OUT using zero-copy system calls where possible
+int copyData (int in, int out);
+
+// Rewrite wasteful shapes in the command tree CMD (see optimize.c) and return the new root
+CMD *optimize (CMD *cmd);
+
+// Print counts of the rewrites applied by optimize()
+void dumpOptimizeStats (void);
+
+// Input or output of a filter: a file descriptor or a ring buffer (see filter.c)
+typedef struct stream stream;
+
+// Can pipeline stage STAGE run as a filter thread?
+bool threadableStage (const CMD *stage);
+
+// Run the COUNT filter STAGES as threads reading fd 0 and writing fd 1; return status
+int runStageThreads (const CMD **stages, int count);
+
+// Fork the spawn helper (see zygote.c)
+void startZygote (void);
+
+// Spawn ARGV with environment ENVP and stdio IN/OUT/ERR through the zygote, in
+// process group PGID (0 a new one, -1 the shell's); return the pid (a child of
+// the shell) or -1 if the caller must fork
+int zygoteSpawn (char **argv, char **envp, int in, int out, int err, int pgid);
+
+// Note that PID exited with wait status RESULT if it is the zygote (which is
+// not used again): false if it is not
+bool zygoteExited (int pid, int result);
+
+// Build the environment of a command with NLOCAL local assignments; strings
+// from index *OWNED on belong to the array (release with freeEnvironment())
+char **commandEnvironment (int nLocal, char **locVar, char **locVal, int *owned);
+void freeEnvironment (char **envp, int owned);
+
+// Run command lines sent to the Unix domain socket PATH (see server.c); returns
+// only if the socket can't be set up
+int serveRequests (const char *path);
+
+// Open PATH for appending, through the cache of >> fds if APPEND_CACHE is set
+// (see appendcache.c); returns an fd the caller closes, or -1
+int openAppend (const char *path);
+
+// Validate or fill the cache entry for PATH before forking a command that appends to it
+void cacheAppendFile (const char *path);
+
+// The working directory changed: cached relative paths no longer apply
+void appendDirectoryChanged (void);
+
+// Helpers of process.c shared with the other modules
+void errorStatus (char *message, bool extract);
+void executeBuiltin (const CMD *cmdList, builtinFn builtin);
+int openOutput (const CMD *cmdList);
+void executeSingle (const CMD *cmdList);
+void executePipe (const CMD *cmdList);
+int spawnSingle (const CMD *cmdList);
+int spawnCommand (const CMD *cmdList, bool group);
+char *localOrEnv (const CMD *cmdList, const char *name);
+
+// Is ARGV a builtin that process() runs in the shell itself (cd, pushd, popd,
+// cache, timeout, memory, coproc)?
+bool isShellBuiltin (char **argv);
+
+// 128-bit FNV-1a hash: start from FNV_OFFSET and add data (see memo.c)
+__extension__ typedef unsigned __int128 hash128;
+#define FNV_OFFSET ((((hash128) 0x6c62272e07bb0142ULL) << 64) | 0x62b821756295c58dULL)
+void hashBytes (hash128 *h, const void *buf, size_t len);
+void hashString (hash128 *h, const char *s);
+bool hashFile (hash128 *h, const char *file);
+
+// cache [-i FILE]... [-e NAME]... COMMAND: replay or record COMMAND (see memo.c)
+void executeCache (const CMD *cmdList);
+
+// INCREMENTAL: skip cmdList if its > file is up to date with its < file,
+// else note when it started; record a successful run (see uptodate.c)
+bool skipUpToDate (const CMD *cmdList, struct timespec *started);
+void recordUpToDate (const CMD *cmdList, const struct timespec *started);
+void dumpUpToDateStats (void);
+
+// PARALLEL: run the ; sequence cmdList as a dependency DAG (see schedule.c)
+void executeSequence (const CMD *cmdList);
+
+// ARG_BATCH: run cmdList xargs-style if its argv exceeds ARG_MAX; false if it
+// fits (see batch.c)
+bool executeBatches (const CMD *cmdList);
+bool argumentsTooLong (const CMD *cmdList);
+
+// GLOB: replace *, ? and [...] patterns in the arguments of the simple
+// command CMD by the paths they match, just before it runs (see glob.c)
+void expandGlobs (const CMD *cmd);
+bool hasGlobs (const CMD *cmd);
+
+// Replace each $(COMMAND) in the token list *LIST by the words of COMMAND's
+// output (see subst.c); false, with *LIST freed, if a COMMAND doesn't parse
+bool substituteCommands (token **list);
+
+// Deadline of a foreground command: a timerfd and the process group it kills
+// (see timeout.c)
+typedef struct deadline deadline;
+
+// TIMEOUT=DURATION (and TIMEOUT_KILL) of cmdList as a running deadline, or NULL
+deadline *commandDeadline (const CMD *cmdList);
+
+// Signal the group led by the first PID watched when deadline D passes
+void watchDeadline (deadline *d, int pid);
+
+// Sleep until D passes (signalling its group), a watched process exits or
+// MSEC milliseconds (-1 for no limit) have passed
+void sleepDeadline (deadline *d, int msec);
+
+// Free D and return STATUS, or 124 / 137 if D passed
+int finishDeadline (deadline *d, int status);
+
+// Run simple command cmdList in its own process group subject to D (freed)
+void executeDeadline (const CMD *cmdList, deadline *d);
+
+// timeout [-k DURATION] DURATION COMMAND [ARG]...
+void executeTimeout (const CMD *cmdList);
+
+// LIMIT_CPU / LIMIT_MEM / LIMIT_FDS: does cmdList set any?  Apply them (in
+// the child, before exec)
+bool commandLimited (const CMD *cmdList);
+void applyLimits (const CMD *cmdList);
+
+// CPUs for the processes of a pipeline or background job (see affinity.c)
+typedef struct placement placement;
+
+// PIPE_AFFINITY of the pipeline of STAGES stages whose first is cmdList, or NULL
+placement *pipelinePlacement (const CMD *cmdList, int stages);
+
+// BG_AFFINITY: the next NUMA node (or cache domain) for a & job, or NULL
+placement *backgroundPlacement (void);
+
+// Pin process PID (0 for this one), stage STAGE of placement P
+void placeProcess (const placement *p, int stage, int pid);
+void freePlacement (placement *p);
+
+// PIPE_MONITOR: fill levels and CPU use of a running pipeline (see monitor.c)
+typedef struct monitor monitor;
+
+// Monitor the COUNT STAGES with the given PIDS and pipe READENDS (filled in
+// as the pipeline starts), or NULL if PIPE_MONITOR is not set
+monitor *startMonitor (const CMD **stages, int count, const int *pids, const int *readEnds);
+
+// Milliseconds between samples
+int monitorInterval (const monitor *m);
+
+// Sample, if the interval has passed; note the usage of stage PID, just reaped
+void monitorSample (monitor *m);
+void monitorReaped (monitor *m, int pid, const struct rusage *usage);
+
+// Report the saturated and starved stages and free M
+void finishMonitor (monitor *m);
+
+// Heap memory a subsystem holds between command lines (see memory.c)
+typedef struct memoryUsage {
+    size_t bytes;
+    long blocks;
+} memoryUsage;
+
+// Add heap block P (if not NULL) to U
+void countBlock (memoryUsage *u, const void *p);
+
+// Add what each subsystem holds to U
+void directoryMemory (memoryUsage *u);
+void globMemory (memoryUsage *u);
+void appendCacheMemory (memoryUsage *u);
+void upToDateMemory (memoryUsage *u);
+void affinityMemory (memoryUsage *u);
+
+// memory: print the heap, RSS, fds and the usage of each subsystem
+void executeMemory (const CMD *cmdList);
+
+// File descriptors (see fd.c).  Open close-on-exec: PATH (relative to DIR),
+// a pipe, a copy of FD above stderr
+int openFd (const char *path, int flags, mode_t mode);
+int openFdAt (int dir, const char *path, int flags, mode_t mode);
+int pipeFds (int fd[2]);
+int dupFd (int fd);
+
+// Make FD the child's fd TARGET, inherited across exec
+void moveFd (int fd, int target);
+
+// Keep FD across command lines (returns it); close FD, held or not
+int holdFd (int fd);
+void closeFd (int fd);
+
+// In a child about to exec: close every fd above stderr
+void closeExtraFds (void);
+
+// FD_CHECK: remember the fds the shell started with; report any other fd
+// left open that is not held
+void noteInheritedFds (void);
+void checkFds (void);
+void fdMemory (memoryUsage *u);
+
+// Coprocesses (see coproc.c).  coproc NAME COMMAND / -q NAME [ARG]... /
+// -k NAME / (list)
+void executeCoproc (const CMD *cmdList);
+
+// Is FILE %NAME for a coprocess NAME?  If so, a new fd for reading its
+// stdout (INPUT) or writing its stdin, restarting it if it has exited (-1
+// if it can't be); -2 if FILE is no coprocess
+bool isCoproc (const char *file);
+int coprocFd (const char *file, bool input);
+
+// Note that PID exited with wait status RESULT if it is a coprocess: false
+// if it is not
+bool coprocExited (int pid, int result);
+
+// Close all coprocesses (when the shell exits)
+void closeCoprocs (void);
+void coprocMemory (memoryUsage *u);
+
+// Report PID, a & job (or coprocess, or the zygote) reaped with wait status
+// RESULT by whichever wait loop found it
+void reapedBackground (int pid, int result);
+
+// PERF_STAT: perf_event_open() counters of each stage (see perf.c)
+typedef struct perfStat perfStat;
+#define PERF_FDS 6                          // Counters (fds) per stage
+
+// Count the COUNT STAGES of a pipeline, or NULL if PERF_STAT is not set
+perfStat *startPerf (const CMD **stages, int count);
+
+// Around each fork: before it; in the child, first thing (waits until the
+// parent has attached); in the parent, attach counters to stage STAGE, PID
+void perfGate (perfStat *p);
+void perfChild (perfStat *p);
+void perfAttach (perfStat *p, int stage, int pid);
+
+// Read the counters of stage STAGE, just reaped
+void perfReaped (perfStat *p, int stage);
+
+// Report the counters of each stage and free P
+void finishPerf (perfStat *p);
@@ -0,0 +1,376 @@
+// schedule.c
+//
+// Dependency-aware execution of ; sequences (enabled by PARALLEL=N).  The
+// commands of "A ; B ; C ..." become the nodes of a DAG, and up to N of them
+// (the number of CPUs if N is not a positive number) run at once.  Command j
+// depends on an earlier command i when both use the same resource and at
+// least one of them writes it.  The resources of a simple command are
+//
+//   its < file (read), its > / >> file (written),
+//   every argument that is not an option (read and written, to be safe),
+//   the shell's stdin when it has no < (consumed, so written), and
+//   the shell's stdout when it has no > (written, keeping output in order).
+//
+// Files are compared by their resolved paths.  Anything else -- pipelines,
+// && / ||, subcommands, &, the shell's own builtins (cd, pushd, popd, cache,
+// timeout, memory, coproc), the in-process builtins, commands run with a
+// TIMEOUT, PERF_STAT or ARG_BATCH split and commands with a GLOB pattern
+// (whose files are only known once it is expanded) -- is a barrier: it runs
+// in the shell once everything before it has finished, and everything after
+// it waits for it.  PARALLEL assumes that commands touch
+// no files other than those named on their command lines; error messages of
+// concurrent commands may interleave.  $? is the status of the last command,
+// as before.  DUMP_SCHEDULE prints the parallelism achieved and the length
+// of the critical path of each sequence.
+
+#include "process.h"
+#include <sys/stat.h>
+
+
+//A file (or the shell's stdin/stdout) used by a command
+typedef struct resource {
+	char* key;                              //Resolved path, "<stdin>" or "<stdout>"
+	bool writes;
+} resource;
+
+//One command of the sequence
+typedef struct node {
+	const CMD* cmd;
+	bool barrier;                           //Runs in the shell, alone
+	resource* uses;
+	int nUses;
+	int* next;                              //Later commands that wait for it
+	int nNext;
+	int pending;                            //Unfinished commands it waits for
+	int pid;                                //While running
+	int status;
+	struct timespec began;
+	double start, end;                      //Seconds
+} node;
+
+//Monotonic time in seconds
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+//The commands of the sequence cmdList in order, as nodes; sets *COUNT to their number.  A stack of the right
+//subtrees still to visit rather than recursion, as flattenPipes() (a generated sequence may be thousands long)
+static node* flattenSequence(const CMD* cmdList, int* count) {
+	int capacity = 16, depth = 0, room = 16;
+	node* nodes = malloc(sizeof(node) * capacity);
+	const CMD** pending = malloc(sizeof(CMD*) * room);
+	*count = 0;
+	for (const CMD* c = cmdList; c != NULL; c = (depth > 0? pending[--depth] : NULL)) {
+		while (c != NULL && c->type == SEP_END) {
+			if (c->right != NULL) {         //A ; at the end of the line has no right child
+				if (depth == room) {
+					REALLOC(pending, room *= 2);
+				}
+				pending[depth++] = c->right;
+			}
+			c = c->left;
+		}
+		if (c == NULL) {
+			continue;
+		}
+		if (*count == capacity) {
+			REALLOC(nodes, capacity *= 2);
+		}
+		memset(&nodes[*count], 0, sizeof(node));
+		nodes[(*count)++].cmd = c;
+	}
+	free(pending);
+	return nodes;
+}
+
+//Resolved path of file NAME, which need not exist yet (its directory is resolved instead)
+static char* resourceKey(const char* name) {
+	char* path = realpath(name, NULL);
+	if (path != NULL) {
+		return path;
+	}
+	char* copy = strdup(name);
+	char* slash = strrchr(copy, '/');
+	const char* base = (slash == NULL? copy : slash + 1);
+	if (slash != NULL) {
+		*slash = '\0';
+	}
+	char* directory = realpath((slash == NULL? "." : slash == copy? "/" : copy), NULL);
+	if (directory == NULL) {
+		if (slash != NULL) {
+			*slash = '/';
+		}
+		return copy;                        //Unresolvable: compare the name as written
+	}
+	path = malloc(strlen(directory) + strlen(base) + 2);
+	sprintf(path, "%s/%s", directory, base);
+	free(directory);
+	free(copy);
+	return path;
+}
+
+//Add resource KEY (taken over) to node N
+static void addUse(node* n, char* key, bool writes) {
+	REALLOC(n->uses, n->nUses + 1);
+	n->uses[n->nUses].key = key;
+	n->uses[n->nUses++].writes = writes;
+}
+
+//Classify node N and collect its resources
+static void describeNode(node* n) {
+	const CMD* c = n->cmd;
+	char* timeout = (c->type == SIMPLE? localOrEnv(c, "TIMEOUT") : NULL);
+	n->barrier = c->type != SIMPLE || isShellBuiltin(c->argv) || findBuiltin(c->argv) != NULL
+		|| (timeout != NULL && *timeout != '\0') || localOrEnv(c, "PERF_STAT") != NULL //Run by executeSingle(), not spawnSingle()
+		|| (getenv("ARG_BATCH") && argumentsTooLong(c)) || hasGlobs(c);
+	if (n->barrier) {
+		return;
+	}
+	if (c->fromType == RED_IN) {
+		addUse(n, resourceKey(c->fromFile), false);
+	}
+	else if (c->fromType == NONE) {
+		addUse(n, strdup("<stdin>"), true);
+	}
+	addUse(n, (c->toType == NONE? strdup("<stdout>") : resourceKey(c->toFile)), true);
+	for (char** arg = c->argv + 1; *arg; arg++) {
+		if ((*arg)[0] != '-') {
+			addUse(n, resourceKey(*arg), true);
+		}
+	}
+}
+
+//Resource KEY's last writer and the readers since, as of barrier EPOCH (whatever came before it, everything after waits for)
+typedef struct history {
+	const char* key;                        //NULL if the slot is free
+	int epoch;
+	int writer;                             //-1 if none
+	int* readers;
+	int nReaders;
+} history;
+
+//Slot of KEY in the open-addressing TABLE of MASK + 1 slots: the one holding it, or the free one ending its probe
+static history* findHistory(history* table, unsigned mask, const char* key) {
+	hash128 h = FNV_OFFSET;
+	hashString(&h, key);
+	unsigned i = (unsigned) h & mask;
+	while (table[i].key != NULL && strcmp(table[i].key, key) != 0) {
+		i = (i + 1) & mask;
+	}
+	return &table[i];
+}
+
+//Make node J wait for the earlier node I (if I is not -1)
+static void addEdge(node* nodes, int i, int j) {
+	if (i < 0 || i == j) {
+		return;
+	}
+	node* a = &nodes[i];
+	if (a->nNext > 0 && a->next[a->nNext - 1] == j) { //Already: the edges into J are all added together
+		return;
+	}
+	REALLOC(a->next, a->nNext + 1);
+	a->next[a->nNext++] = j;
+	nodes[j].pending++;
+}
+
+//Link the nodes into the DAG.  A barrier waits for the commands since the last barrier, and everything after it
+//waits for it; in between, a command waits for the last writer of each of its resources and, if it writes the
+//resource, for the readers since.  Linear in the number of resources used, where comparing every pair of
+//commands would be quadratic (a generated sequence may be thousands long)
+static void linkNodes(node* nodes, int count) {
+	unsigned uses = 0, mask = 1;
+	for (int j = 0; j < count; j++) {
+		uses += nodes[j].nUses;
+	}
+	while (mask < 2 * uses) {
+		mask *= 2;
+	}
+	history* table = calloc(mask--, sizeof(history));
+	int barrier = -1;
+	for (int j = 0; j < count; j++) {
+		node* n = &nodes[j];
+		addEdge(nodes, barrier, j);
+		if (n->barrier) {
+			for (int i = barrier + 1; i < j; i++) {
+				if (nodes[i].nNext == 0) {  //The others reach J through the commands that wait for them
+					addEdge(nodes, i, j);
+				}
+			}
+			barrier = j;
+			continue;
+		}
+		for (int u = 0; u < n->nUses; u++) {
+			history* h = findHistory(table, mask, n->uses[u].key);
+			if (h->key == NULL || h->epoch != barrier) {
+				h->key = n->uses[u].key;
+				h->epoch = barrier;
+				h->writer = -1;
+				h->nReaders = 0;
+			}
+			addEdge(nodes, h->writer, j);
+			if (n->uses[u].writes) {
+				for (int r = 0; r < h->nReaders; r++) {
+					addEdge(nodes, h->readers[r], j);
+				}
+				h->writer = j;
+				h->nReaders = 0;
+			}
+			else {
+				REALLOC(h->readers, h->nReaders + 1);
+				h->readers[h->nReaders++] = j;
+			}
+		}
+	}
+	for (unsigned i = 0; i <= mask; i++) {
+		free(table[i].readers);
+	}
+	free(table);
+}
+
+//Node K has finished with STATUS: queue the nodes that were waiting only for it on READY
+static void finishNode(node* nodes, int k, int status, int* ready, int* nReady) {
+	node* n = &nodes[k];
+	n->status = status;
+	n->end = now();
+	for (int i = 0; i < n->nNext; i++) {
+		if (--nodes[n->next[i]].pending == 0) {
+			ready[(*nReady)++] = n->next[i];
+		}
+	}
+}
+
+//Print the parallelism achieved and the critical path of the DAG
+static void dumpSchedule(node* nodes, int count, double wall, int maxRunning) {
+	double busy = 0, longest = 0;
+	double* path = calloc(count, sizeof(double)); //Longest chain of durations ending at each node
+	int* length = calloc(count, sizeof(int));
+	int barriers = 0, longestLength = 0;
+	for (int j = 0; j < count; j++) {   //Nodes only wait for earlier ones, so path[j] is final here
+		double duration = nodes[j].end - nodes[j].start;
+		busy += duration;
+		barriers += nodes[j].barrier;
+		path[j] += duration;
+		length[j]++;
+		if (path[j] > longest) {
+			longest = path[j];
+			longestLength = length[j];
+		}
+		for (int i = 0; i < nodes[j].nNext; i++) {
+			int k = nodes[j].next[i];
+			if (path[j] > path[k]) {
+				path[k] = path[j];
+				length[k] = length[j];
+			}
+		}
+	}
+	fprintf(stderr, "SCHEDULE:  commands=%d  barriers=%d  max-running=%d  wall=%.3fs  parallelism=%.2f  critical-path=%.3fs (%d commands)\n",
+		count, barriers, maxRunning, wall, (wall > 0? busy / wall : 1), longest, longestLength);
+	free(path);
+	free(length);
+}
+
+void executeSequence(const CMD* cmdList) {
+	int count;
+	node* nodes = flattenSequence(cmdList, &count);
+	for (int j = 0; j < count; j++) {
+		describeNode(&nodes[j]);
+	}
+	linkNodes(nodes, count);
+
+	int workers = atoi(getenv("PARALLEL"));
+	if (workers <= 0) {
+		workers = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	int* ready = malloc(sizeof(int) * count); //Nodes whose commands all finished, in the order they did
+	int first = 0, nReady = 0;
+	for (int j = 0; j < count; j++) {
+		if (nodes[j].pending == 0) {
+			ready[nReady++] = j;
+		}
+	}
+	int* active = malloc(sizeof(int) * (workers < count? workers : count)); //Nodes running, in no order
+	int running = 0, maxRunning = 0, finished = 0;
+	double begin = now();
+	while (finished < count) {
+		while (first < nReady && running < workers) {
+			int j = ready[first++];
+			node* n = &nodes[j];
+			n->start = now();
+			clock_gettime(CLOCK_MONOTONIC, &n->began);
+			if (n->barrier) {               //Everything before it is done, nothing after it runs
+				process(n->cmd);
+				finishNode(nodes, j, atoi(getenv("?")), ready, &nReady);
+				finished++;
+			}
+			else if (getenv("INCREMENTAL") && skipUpToDate(n->cmd, &n->began)) {
+				finishNode(nodes, j, 0, ready, &nReady);
+				finished++;
+			}
+			else if ((n->pid = spawnSingle(n->cmd)) < 0) {
+				finishNode(nodes, j, atoi(getenv("?")), ready, &nReady);
+				finished++;
+			}
+			else {
+				active[running++] = j;
+				if (running > maxRunning) {
+					maxRunning = running;
+				}
+			}
+		}
+		if (running == 0) {
+			continue;
+		}
+
+		int result = -1;
+		int pid = waitpid(-1, &result, 0);
+		if (pid < 0 && errno == EINTR) {
+			continue;
+		}
+		if (pid < 0) {                      //Children were reaped elsewhere
+			while (running > 0) {
+				finishNode(nodes, active[--running], 128 + SIGINT, ready, &nReady);
+				finished++;
+			}
+			continue;
+		}
+		int a = 0;
+		while (a < running && nodes[active[a]].pid != pid) {
+			a++;
+		}
+		if (a == running) {                 //Background zombie
+			reapedBackground(pid, result);
+			continue;
+		}
+		int k = active[a];
+		active[a] = active[--running];
+		finished++;
+		finishNode(nodes, k, STATUS(result), ready, &nReady);
+		if (getenv("INCREMENTAL")) {        //Records only successful runs, going by $?
+			char buffer[4];
+			sprintf(buffer, "%d", nodes[k].status);
+			setenv("?", buffer, 1);
+			recordUpToDate(nodes[k].cmd, &nodes[k].began);
+		}
+	}
+
+	char buffer[4];
+	sprintf(buffer, "%d", nodes[count - 1].status); //$? of a sequence is that of its last command
+	setenv("?", buffer, 1);
+	if (getenv("DUMP_SCHEDULE")) {
+		dumpSchedule(nodes, count, now() - begin, maxRunning);
+	}
+
+	for (int j = 0; j < count; j++) {
+		for (int i = 0; i < nodes[j].nUses; i++) {
+			free(nodes[j].uses[i].key);
+		}
+		free(nodes[j].uses);
+		free(nodes[j].next);
+	}
+	free(ready);
+	free(active);
+	free(nodes);
+}
@@ -0,0 +1,156 @@
+// server.c
+//
+// Shell server mode (enabled by SHELL_SERVER=PATH).  Instead of prompting, the
+// shell listens on the Unix domain socket PATH and runs one command line per
+// connection (see fdpass.h for the request format and client.c for a client).
+// Each request is handled by a forked child of the server, which takes over the
+// client's stdin/stdout/stderr, working directory and environment, runs the
+// line through tokenize(), parse() and process(), and replies with $?.  The
+// server itself never executes anything, so a request can not change the state
+// seen by the next one, but no request pays for exec-ing a fresh shell.
+
+#include "process.h"
+#include "fdpass.h"
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define STATUS_SYNTAX 2             //Status of a line that doesn't parse (as in bash)
+
+//Run the request on CONNECTION in this (forked) process, reply with its status and return it
+static int serveRequest(int connection) {
+	serverRequest request;
+	int fds[3];
+	if (!receiveFds(connection, &request, sizeof(request), fds, 3)) {
+		return EXIT_FAILURE;
+	}
+	char* strings = malloc(request.length + 1); //Environment entries point into it for good
+	if (!readFully(connection, strings, request.length)) {
+		return EXIT_FAILURE;
+	}
+	strings[request.length] = '\0';
+	char* line = strings;
+	char* cwd = line + strlen(line) + 1;
+	char* entry = cwd + strlen(cwd) + 1;
+
+	clearenv();
+	for (int i = 0; i < request.envc; i++, entry += strlen(entry) + 1) {
+		putenv(entry);
+	}
+	setenv("?", "0", 1);
+	startShell();                           //This handler is the client's shell
+	for (int i = 0; i < 3; i++) {
+		dup2(fds[i], i);
+		close(fds[i]);
+	}
+
+	int status = 0;
+	if (chdir(cwd) == -1) {
+		perror(cwd);
+		status = EXIT_FAILURE;
+	}
+	else {
+		token* list = tokenize(line);
+		bool syntax = list != NULL && !substituteCommands(&list);
+		CMD* cmd = (list == NULL? NULL : parse(list));
+		freeList(list);
+		if (cmd != NULL) {
+			process(cmd);
+			freeCMD(cmd);
+			status = atoi(getenv("?"));
+		}
+		else if (syntax || list != NULL) {
+			status = STATUS_SYNTAX;
+		}
+		else {                              //Nothing left after $(...)
+			status = atoi(getenv("?"));
+		}
+	}
+	fflush(stdout);                         //Output must reach the client before the status
+	fflush(stderr);
+	writeFully(connection, &status, sizeof(status));
+	return status;
+}
+
+//Make way for a socket at ADDRESS by removing one left over from an earlier server, which no one accepts
+//connections on any more.  False (reported) if anything else is there: a file, or a server still running
+static bool clearSocketPath(const struct sockaddr_un* address) {
+	const char* path = address->sun_path;
+	struct stat info;
+	if (lstat(path, &info) == -1) {
+		if (errno == ENOENT) {
+			return true;
+		}
+		perror(path);
+		return false;
+	}
+	if (!S_ISSOCK(info.st_mode)) {
+		fprintf(stderr, "%s: exists and is not a socket\n", path);
+		return false;
+	}
+	int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (probe < 0) {
+		perror("socket");
+		return false;
+	}
+	int connected = connect(probe, (const struct sockaddr*) address, sizeof(*address));
+	int error = errno;
+	close(probe);
+	if (connected == 0) {
+		fprintf(stderr, "%s: another server is listening on it\n", path);
+		return false;
+	}
+	if (error != ECONNREFUSED) {
+		errno = error;
+		perror(path);
+		return false;
+	}
+	if (unlink(path) == -1) {           //Nothing listens on it: left over
+		perror(path);
+		return false;
+	}
+	return true;
+}
+
+//Accept requests on the Unix domain socket PATH forever; return only if it can't be set up
+int serveRequests(const char* path) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return EXIT_FAILURE;
+	}
+	strcpy(address.sun_path, path);
+
+	if (!clearSocketPath(&address)) {
+		return EXIT_FAILURE;
+	}
+	int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listener < 0 || bind(listener, (struct sockaddr*) &address, sizeof(address)) == -1
+			|| listen(listener, SOMAXCONN) == -1) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	for (;;) {
+		int connection = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+		while (waitpid(-1, NULL, WNOHANG) > 0) //Reap finished request handlers
+			;
+		if (connection < 0) {
+			if (errno != EINTR) {
+				perror("accept");
+			}
+			continue;
+		}
+		int pid = fork();
+		if (pid == 0) {
+			close(listener);
+			exit(serveRequest(connection));
+		}
+		else if (pid < 0) {
+			perror("fork");
+		}
+		close(connection);
+	}
+}
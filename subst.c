@@ -0,0 +1,186 @@
+// subst.c
+//
+// Command substitution: $(COMMAND).  tokenize() splits it into a SIMPLE token
+// ending in $, a (, the tokens of COMMAND and a ) -- a sequence that parse()
+// rejects -- so substituteCommands() replaces it before parsing by the output
+// of COMMAND, as for an unquoted $(...) in bash: the output is split into words
+// at blanks and newlines (so trailing newlines vanish), the first word is
+// joined to the text before the $, and the words become SIMPLE tokens, so
+// metacharacters in the output are never interpreted.  tokenize() doesn't
+// record spacing, so text right after the ) starts a new word.  Substitutions
+// nest and run left to right before the line itself runs (so "cd DIR ; echo
+// $(pwd)" still sees the old directory); $? is that of the last one until the
+// line sets it.
+//
+// COMMAND writes into a memfd rather than a pipe: the shell doesn't shuttle
+// the output through 64 KiB pipe buffers into a buffer that keeps growing, it
+// maps the whole file once COMMAND is done.  A simple command that is an
+// in-process builtin (see builtin.c) writes to the memfd from the shell
+// itself, without forking, unless it would read a terminal; anything else
+// runs in a forked "subshell".
+
+#include "process.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//Run cmdList with stdout on fd OUT, in a subshell unless it is a builtin; set $?
+static void runCaptured(const CMD* cmdList, int out) {
+	builtinFn builtin = (cmdList->type == SIMPLE && cmdList->toType == NONE? findBuiltin(cmdList->argv) : NULL);
+	fflush(stdout);
+	if (builtin != NULL && (cmdList->fromType != NONE || !isatty(0))) { //Fast path: no fork, the builtin writes straight to OUT (not on a terminal: Ctrl-C must be able to stop it)
+		int saved = dupFd(1);
+		dup2(out, 1);
+		expandGlobs(cmdList);               //Doesn't change argv[0]: a builtin's name is no pattern
+		executeBuiltin(cmdList, builtin);
+		dup2(saved, 1);
+		close(saved);
+		return;
+	}
+
+	int pid = fork();
+	if (pid < 0) {
+		errorStatus("subshell: fork failed", false);
+		return;
+	}
+	if (pid == 0) {
+		dup2(out, 1);
+		close(out);
+		process(cmdList);
+		exit(atoi(getenv("?")));
+	}
+	int result = -1;
+	waitChild(pid, &result);
+	if (result != -1) {                     //Unless reaped elsewhere
+		char buffer[4];
+		sprintf(buffer, "%d", STATUS(result));
+		setenv("?", buffer, 1);
+	}
+}
+
+//Allocate a token of type TYPE with text TEXT (taken over)
+static token* newToken(char* text, int type) {
+	token* t = malloc(sizeof(token));
+	t->text = text;
+	t->type = type;
+	t->next = NULL;
+	return t;
+}
+
+//Is C a word separator?
+static bool isBlank(char c) {
+	return c == ' ' || c == '\t' || c == '\n';
+}
+
+//Append to *TAIL the words of the LENGTH bytes at OUTPUT, the first one prefixed by PREFIX
+static void appendWords(token*** tail, const char* prefix, const char* output, size_t length) {
+	size_t i = 0;
+	for (bool first = true; ; first = false) {
+		while (i < length && isBlank(output[i])) {
+			i++;
+		}
+		size_t start = i;
+		while (i < length && !isBlank(output[i])) {
+			i++;
+		}
+		size_t prefixLength = (first? strlen(prefix) : 0);
+		if (start == i && prefixLength == 0) { //No more words
+			return;
+		}
+		char* text = malloc(prefixLength + (i - start) + 1);
+		memcpy(text, prefix, prefixLength);
+		memcpy(text + prefixLength, output + start, i - start);
+		text[prefixLength + (i - start)] = '\0';
+		**tail = newToken(text, SIMPLE);
+		*tail = &(**tail)->next;
+	}
+}
+
+//Run the tokens COMMAND (taken over) and append the words of their output, prefixed by PREFIX, to *TAIL
+//Returns false if COMMAND doesn't parse
+static bool substitute(token*** tail, const char* prefix, token* command) {
+	if (!substituteCommands(&command)) {    //Inner $(...) first
+		return false;
+	}
+	if (command == NULL) {                  //$()
+		setenv("?", "0", 1);
+		appendWords(tail, prefix, "", 0);
+		return true;
+	}
+	CMD* cmd = parse(command);
+	freeList(command);
+	if (cmd == NULL) {
+		return false;
+	}
+	int out = memfd_create("substitution", MFD_CLOEXEC);
+	if (out < 0) {
+		errorStatus("memfd_create", false);
+		freeCMD(cmd);
+		return true;
+	}
+	runCaptured(cmd, out);
+	freeCMD(cmd);
+
+	struct stat info;
+	char* output = MAP_FAILED;
+	if (fstat(out, &info) == 0 && info.st_size > 0) {
+		output = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, out, 0);
+	}
+	close(out);
+	if (output == MAP_FAILED) {
+		appendWords(tail, prefix, "", 0);
+	}
+	else {
+		appendWords(tail, prefix, output, info.st_size);
+		munmap(output, info.st_size);
+	}
+	return true;
+}
+
+bool substituteCommands(token** list) {
+	token* result = NULL;
+	token** tail = &result;
+	token* t;
+	while ((t = *list) != NULL) {
+		*list = t->next;
+		t->next = NULL;
+		size_t length = (t->type == SIMPLE? strlen(t->text) : 0);
+		token* open = *list;
+		token* right = NULL;                    //Matching )
+		token* inner = NULL;                    //The token before it
+		if (length > 0 && t->text[length - 1] == '$' && open != NULL && open->type == PAR_LEFT) {
+			int depth = 1;
+			for (token* p = open; p->next != NULL; p = p->next) {
+				depth += (p->next->type == PAR_LEFT) - (p->next->type == PAR_RIGHT);
+				if (depth == 0) {
+					inner = p;
+					right = p->next;
+					break;
+				}
+			}
+		}
+		if (right == NULL) {                    //Not a substitution (or unbalanced: parse() complains)
+			*tail = t;
+			tail = &t->next;
+			continue;
+		}
+
+		token* command = (inner == open? NULL : open->next); //Detach $ ( COMMAND ) from the list
+		*list = right->next;
+		inner->next = NULL;
+		open->next = NULL;
+		right->next = NULL;
+		freeList(open);
+		freeList(right);
+		t->text[length - 1] = '\0';             //The text before the $
+		bool parsed = substitute(&tail, t->text, command);
+		freeList(t);
+		if (!parsed) {
+			freeList(*list);
+			freeList(result);
+			*list = NULL;
+			return false;
+		}
+	}
+	*list = result;
+	return true;
+}
@@ -0,0 +1,57 @@
+#!/bin/sh
+# tests/affinitybench.sh
+#
+# Pipeline throughput with and without a placement policy: pushes MIB MiB
+# (default 512) through "cat < DATA | cat | cat | wc -c", with NO_BUILTINS
+# set so that every stage is an external process connected by kernel pipes,
+# with PIPE_AFFINITY unset and set to core, cache and node, REPEAT runs
+# each, minus the time of a shell that runs nothing, and prints the best
+# run in MB/s and the CPUs the first stage may run on.  Fails if the byte
+# counts differ.  The policy only pays off on a machine with more than one
+# cache domain or NUMA node; elsewhere the numbers should match.
+#
+#   sh tests/affinitybench.sh [MIB]     (BASH_UNDER_TEST=./Bash, REPEAT=3)
+
+BIN=${BASH_UNDER_TEST:-./Bash}
+MIB=${1:-512}
+REPEAT=${REPEAT:-3}
+
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+head -c "$(( MIB * 1048576 ))" /dev/zero | tr '\0' 'x' > "$DIR/data"
+
+# Nanoseconds of the best of REPEAT runs of the shell on file $1 with PIPE_AFFINITY $2
+best() {
+	B=
+	for r in $(seq "$REPEAT"); do
+		T0=$(date +%s%N)
+		if [ "$2" = off ]; then
+			NO_BUILTINS=1 "$BIN" < "$1" > "$DIR/out" 2>&1
+		else
+			NO_BUILTINS=1 PIPE_AFFINITY=$2 "$BIN" < "$1" > "$DIR/out" 2>&1
+		fi
+		T1=$(date +%s%N)
+		[ -z "$B" ] || [ $(( T1 - T0 )) -lt "$B" ] && B=$(( T1 - T0 ))
+	done
+	echo "$B"
+}
+
+echo "true" > "$DIR/empty"
+echo "cat < $DIR/data | cat | cat | wc -c" > "$DIR/pipe"
+echo "grep Cpus_allowed_list < /proc/self/status | cat" > "$DIR/where"
+BASE=$(best "$DIR/empty" off)
+FAILED=0
+for POLICY in off core cache node; do
+	NS=$(( $(best "$DIR/pipe" "$POLICY") - BASE ))
+	[ "$NS" -gt 0 ] || NS=1
+	BYTES=$(sed 's/([0-9]*)\$ //g' "$DIR/out" | tr -d ' \n')
+	best "$DIR/where" "$POLICY" > /dev/null
+	CPUS=$(sed -n 's/.*Cpus_allowed_list:[[:space:]]*//p' "$DIR/out")
+	echo "affinitybench: PIPE_AFFINITY=$POLICY  $(( MIB * 1048576 * 1000 / NS ))MB/s  first stage on CPUs $CPUS"
+	if [ "$BYTES" != $(( MIB * 1048576 )) ]; then
+		echo "affinitybench: FAIL: PIPE_AFFINITY=$POLICY counted $BYTES bytes" >&2
+		FAILED=1
+	fi
+done
+[ $FAILED -eq 0 ] && echo "affinitybench: ok"
+exit $FAILED
@@ -0,0 +1,68 @@
+#!/bin/sh
+# tests/appendbench.sh
+#
+# Appends per second with and without APPEND_CACHE: runs APPENDS command
+# lines (default 10000) that each append one line to one of FILES logs
+# (default 4) DEPTH directories deep (default 16), REPEAT runs each, minus
+# the time of a shell that runs nothing, and prints the best run.  The
+# appends are made by "cat < FILE >> LOG", once with the in-process cat
+# builtin, which opens LOG in the shell, and once with NO_BUILTINS set, so
+# that the external cat's child opens it.  Fails if the logs do not end up
+# with one line per append.
+#
+#   sh tests/appendbench.sh [APPENDS]   (BASH_UNDER_TEST=./Bash, FILES=4,
+#                                        DEPTH=16, REPEAT=3)
+
+BIN=${BASH_UNDER_TEST:-./Bash}
+APPENDS=${1:-10000}
+FILES=${FILES:-4}
+DEPTH=${DEPTH:-16}
+REPEAT=${REPEAT:-3}
+
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+LOGS=$DIR
+for i in $(seq "$DEPTH"); do
+	LOGS=$LOGS/directory$i
+done
+mkdir -p "$LOGS"
+echo "appended" > "$DIR/line"
+
+# Nanoseconds of the best of REPEAT runs of the shell on file $1 with variables $2 set
+best() {
+	B=
+	for r in $(seq "$REPEAT"); do
+		rm -f "$LOGS"/log*
+		T0=$(date +%s%N)
+		env $2 "$BIN" < "$1" > /dev/null 2>&1
+		T1=$(date +%s%N)
+		[ -z "$B" ] || [ $(( T1 - T0 )) -lt "$B" ] && B=$(( T1 - T0 ))
+	done
+	echo "$B"
+}
+
+echo "true" > "$DIR/empty"
+awk -v n="$APPENDS" -v files="$FILES" -v d="$DIR" -v logs="$LOGS" 'BEGIN {
+	for (i = 0; i < n; i++) {
+		print "cat < " d "/line >> " logs "/log" i % files
+	}
+}' > "$DIR/appends"
+FAILED=0
+for BUILTINS in builtin NO_BUILTINS; do
+	REPORT=
+	for CACHE in uncached APPEND_CACHE; do
+		SETTINGS="$([ $BUILTINS = NO_BUILTINS ] && echo NO_BUILTINS=1) $([ $CACHE = APPEND_CACHE ] && echo APPEND_CACHE=1)"
+		BASE=$(best "$DIR/empty" "$SETTINGS")
+		NS=$(( $(best "$DIR/appends" "$SETTINGS") - BASE ))
+		[ "$NS" -gt 0 ] || NS=1
+		REPORT="$REPORT  $CACHE=$(( APPENDS * 1000000000 / NS ))/s"
+		GOT=$(cat "$LOGS"/log* | wc -l)
+		if [ "$GOT" -ne "$APPENDS" ]; then
+			echo "appendbench: FAIL: $BUILTINS $CACHE: $GOT lines appended, not $APPENDS" >&2
+			FAILED=1
+		fi
+	done
+	echo "appendbench: $BUILTINS cat >> ($FILES logs $DEPTH directories deep)$REPORT"
+done
+[ $FAILED -eq 0 ] && echo "appendbench: ok"
+exit $FAILED
@@ -0,0 +1,37 @@
+#!/bin/sh
+# tests/cache.sh
+#
+# The cache builtin reports the same $? on a miss as on the hit that follows
+# (or, for a failure, which is never stored, on the rerun): for each COMMAND
+# below, "cache COMMAND" runs twice in a fresh $CACHE_DIR and the statuses
+# and outputs of the two runs must agree and match those of COMMAND itself.
+#
+#   sh tests/cache.sh               (BASH_UNDER_TEST=./Bash)
+
+BIN=${BASH_UNDER_TEST:-./Bash}
+
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+seq 1 10 > "$DIR/data"
+
+FAILED=0
+while read -r COMMAND; do
+	printf '%s\nprintenv ?\n' "$COMMAND" > "$DIR/plain"
+	printf 'cache %s\nprintenv ?\ncache %s\nprintenv ?\ncache -s\n' "$COMMAND" "$COMMAND" > "$DIR/cached"
+	rm -rf "$DIR/store"
+	PLAIN=$("$BIN" < "$DIR/plain" 2>&1 | sed 's/([0-9]*)\$ //g' | tr '\n' ' ')
+	CACHED=$(CACHE_DIR="$DIR/store" "$BIN" < "$DIR/cached" 2>&1 | sed 's/([0-9]*)\$ //g' | grep -v '^CACHE:' | tr '\n' ' ')
+	echo "cache: $COMMAND: [$PLAIN] [$CACHED]"
+	if [ "$CACHED" != "$PLAIN$PLAIN" ]; then
+		echo "cache: FAIL: a miss and the run after it differ from the command itself" >&2
+		FAILED=1
+	fi
+done <<EOF
+true
+false
+wc -l $DIR/data
+ls $DIR/nosuchfile
+nosuchcommand_cache
+EOF
+[ $FAILED -eq 0 ] && echo "cache: ok"
+exit $FAILED
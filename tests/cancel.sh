@@ -0,0 +1,139 @@
+#!/bin/sh
+# tests/cancel.sh
+#
+# Cancellation latency: starts a STAGES-stage pipeline (default 50) in ./Bash
+#
+#   sleep 1000 | ( sleep 1000 ) | cat | ... | cat
+#
+# waits until all of its processes (the subshell's sleep included) are up,
+# sends the shell SIGINT -- which it passes on to the pipeline's process
+# group -- and measures how long it takes until no process of the group is
+# running and the shell has reaped every stage (zombies of the shell count
+# as left; the subshell's sleep, orphaned when the subshell dies, is init's
+# to reap).  Then does the same for the simple command "sleep 1000", which
+# must be gone and reaped, with $? 130, within LIMIT_MS as well.  Fails if
+# either takes longer, or if the shell does not go on to run the next
+# command line.
+#
+#   sh tests/cancel.sh [STAGES]     (BASH_UNDER_TEST=./Bash, LIMIT_MS=250)
+
+BIN=${BASH_UNDER_TEST:-./Bash}
+STAGES=${1:-50}
+LIMIT_MS=${LIMIT_MS:-250}
+
+DIR=$(mktemp -d) || exit 1
+trap 'exec 3>&-; kill $PID 2>/dev/null; [ -n "$GROUP" ] && kill -KILL -"$GROUP" 2>/dev/null; rm -rf "$DIR"' EXIT
+mkfifo "$DIR/input"
+
+"$BIN" < "$DIR/input" > /dev/null 2> "$DIR/stderr" &
+PID=$!
+exec 3> "$DIR/input"
+
+awk -v n="$STAGES" 'BEGIN {
+	line = "sleep 1000 < /dev/null | ( sleep 1000 < /dev/null )"
+	for (s = 2; s < n; s++) {
+		line = line " | cat"
+	}
+	print line " > /dev/null"
+}' >&3
+
+# Number of processes of group $GROUP running, or dead and not yet reaped by the shell
+members() {
+	for f in /proc/[0-9]*/stat; do
+		{ read -r l < "$f"; } 2>/dev/null || continue
+		set -- ${l##*) }                    # State, ppid, pgrp, ...
+		[ "$3" = "$GROUP" ] && { [ "$1" != Z ] || [ "$2" = "$PID" ]; } && echo
+	done | wc -l
+}
+
+# Wait until the group of the first stage has STAGES + 1 processes
+GROUP=
+for i in $(seq 1000); do
+	FIRST=$(pgrep -o -P $PID sleep)    # Not the zygote, if ZYGOTE is set
+	[ -n "$FIRST" ] && GROUP=$(ps -o pgid= -p "$FIRST" | tr -d ' ')
+	[ -n "$GROUP" ] && [ "$(members)" -ge $(( STAGES + 1 )) ] && break
+	sleep 0.01
+done
+if [ -z "$GROUP" ] || [ "$(members)" -lt $(( STAGES + 1 )) ]; then
+	echo "cancel: FAIL: the pipeline did not start" >&2
+	exit 1
+fi
+
+T0=$(date +%s%N)
+kill -INT $PID
+while [ "$(members)" -gt 0 ]; do
+	if [ $(( ($(date +%s%N) - T0) / 1000000 )) -gt 5000 ]; then
+		break
+	fi
+	sleep 0.002
+done
+T1=$(date +%s%N)
+LEFT=$(members)
+MS=$(( (T1 - T0) / 1000000 ))
+echo "cancel: $STAGES stages gone ${MS}ms after SIGINT ($LEFT left)"
+
+FAILED=0
+if [ "$LEFT" -ne 0 ] || [ $MS -gt "$LIMIT_MS" ]; then
+	echo "cancel: FAIL: not reaped within ${LIMIT_MS}ms" >&2
+	FAILED=1
+fi
+GROUP=
+
+echo "echo alive > $DIR/alive" >&3
+for i in $(seq 500); do
+	[ -s "$DIR/alive" ] && break
+	sleep 0.01
+done
+if [ ! -s "$DIR/alive" ]; then
+	echo "cancel: FAIL: the shell did not go on after the SIGINT" >&2
+	FAILED=1
+fi
+
+# A simple command: its own group too, so the SIGINT reaches it
+echo "sleep 1000 < /dev/null" >&3
+for i in $(seq 1000); do
+	FIRST=$(pgrep -o -P $PID sleep)
+	[ -n "$FIRST" ] && GROUP=$(ps -o pgid= -p "$FIRST" | tr -d ' ')
+	[ -n "$GROUP" ] && break
+	sleep 0.01
+done
+if [ -z "$GROUP" ]; then
+	echo "cancel: FAIL: the simple command did not start" >&2
+	exit 1
+fi
+if [ "$GROUP" = "$(ps -o pgid= -p $PID | tr -d ' ')" ]; then
+	GROUP=                                  # Not ours to kill on exit
+	echo "cancel: FAIL: the simple command has no process group of its own" >&2
+	exit 1
+fi
+T0=$(date +%s%N)
+kill -INT $PID
+while [ "$(members)" -gt 0 ]; do
+	if [ $(( ($(date +%s%N) - T0) / 1000000 )) -gt 5000 ]; then
+		break
+	fi
+	sleep 0.002
+done
+T1=$(date +%s%N)
+LEFT=$(members)
+MS=$(( (T1 - T0) / 1000000 ))
+echo "cancel: simple command gone ${MS}ms after SIGINT ($LEFT left)"
+if [ "$LEFT" -ne 0 ] || [ $MS -gt "$LIMIT_MS" ]; then
+	echo "cancel: FAIL: simple command not reaped within ${LIMIT_MS}ms" >&2
+	FAILED=1
+fi
+GROUP=
+
+echo "printenv ? > $DIR/status" >&3
+for i in $(seq 500); do
+	[ -s "$DIR/status" ] && break
+	sleep 0.01
+done
+if [ "$(cat "$DIR/status" 2>/dev/null)" != 130 ]; then
+	echo "cancel: FAIL: \$? after the interrupted simple command is not 130" >&2
+	FAILED=1
+fi
+exec 3>&-
+wait $PID
+[ $FAILED -eq 0 ] && echo "cancel: ok"
+exit $FAILED
@@ -0,0 +1,59 @@
+#!/bin/sh
+# tests/coprocbench.sh
+#
+# Per-request latency of a coprocess against respawning the tool: sends
+# REQUESTS (default 2000) one-line requests to a small sh tool that
+# doubles a number, once as "coproc -q tool N" to a coprocess started at
+# the beginning and once as "sh TOOL < REQUEST" per request, REPEAT
+# runs each, minus a run with no requests, and prints the best run per
+# request.  Fails if the two ways answer differently.
+#
+#   sh tests/coprocbench.sh [REQUESTS]  (BASH_UNDER_TEST=./Bash, REPEAT=3)
+
+BIN=${BASH_UNDER_TEST:-./Bash}
+REQUESTS=${1:-2000}
+REPEAT=${REPEAT:-3}
+
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+echo 'while read n; do echo $(( n * 2 )); done' > "$DIR/tool.sh"  # read and echo don't buffer
+echo 21 > "$DIR/request"
+
+# Nanoseconds of the best of REPEAT runs of the shell on file $1
+best() {
+	B=
+	for r in $(seq "$REPEAT"); do
+		T0=$(date +%s%N)
+		"$BIN" < "$1" > "$DIR/out" 2>&1
+		T1=$(date +%s%N)
+		[ -z "$B" ] || [ $(( T1 - T0 )) -lt "$B" ] && B=$(( T1 - T0 ))
+	done
+	echo "$B"
+}
+
+# Command lines of $1 requests: through a coprocess if $2 is coproc, else by respawning
+requests() {
+	awk -v n="$1" -v way="$2" -v d="$DIR" 'BEGIN {
+		if (way == "coproc") print "coproc tool sh " d "/tool.sh"
+		for (i = 0; i < n; i++) {
+			print (way == "coproc"? "coproc -q tool 21" : "sh " d "/tool.sh < " d "/request")
+		}
+	}'
+}
+
+FAILED=0
+for WAY in coproc respawn; do
+	requests 3 $WAY > "$DIR/check"
+	best "$DIR/check" > /dev/null
+	GOT=$(sed 's/([0-9]*)\$ //g' "$DIR/out" | grep -v '^Coprocess' | tr '\n' ' ')
+	if [ "$GOT" != "42 42 42 " ]; then
+		echo "coprocbench: FAIL: $WAY answered [$GOT], not [42 42 42 ]" >&2
+		FAILED=1
+	fi
+	requests 0 $WAY > "$DIR/none"
+	requests "$REQUESTS" $WAY > "$DIR/many"
+	NS=$(( ($(best "$DIR/many") - $(best "$DIR/none")) / REQUESTS ))
+	echo "coprocbench: $WAY  $(( NS / 1000 ))us per request"
+done
+[ $FAILED -eq 0 ] && echo "coprocbench: ok"
+exit $FAILED
@@ -0,0 +1,55 @@
+#!/bin/sh
+# tests/deepchain.sh
+#
+# Deep command chains under a small stack: runs ./Bash with "ulimit -s
+# STACK" (KiB, default 256) on a line of DEPTH commands (default 30000)
+# joined by ; and one joined by &&, and on a pipeline of PIPES stages
+# (default 2000), each plainly and with DUMP_TREE, OPTIMIZE and PARALLEL
+# set.  The tree of such a line is as deep as it is long, so any walk of it
+# that recurses per operator overflows the stack.  Fails if the shell dies
+# or the line does not exit with status 0.
+#
+#   sh tests/deepchain.sh [DEPTH]   (BASH_UNDER_TEST=./Bash, STACK=256,
+#                                    PIPES=2000)
+
+BIN=${BASH_UNDER_TEST:-./Bash}
+DEPTH=${1:-30000}
+STACK=${STACK:-256}
+PIPES=${PIPES:-2000}
+
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+# Line of $2 copies of command $3 joined by $1, then its status into $DIR/status
+chain() {
+	awk -v op="$1" -v n="$2" -v c="$3" -v d="$DIR" 'BEGIN {
+		line = c
+		for (i = 1; i < n; i++) {
+			line = line " " op " " c
+		}
+		print line
+		print "printenv ? > " d "/status"
+	}'
+}
+
+chain ";" "$DEPTH" "cd ." > "$DIR/sequence"
+chain "&&" "$DEPTH" "cd ." > "$DIR/and"
+chain "|" "$PIPES" "cat < /dev/null" | sed 's/ | cat < \/dev\/null/ | cat/g' > "$DIR/pipe"
+
+FAILED=0
+for SETTING in NONE DUMP_TREE OPTIMIZE PARALLEL; do
+	for LINE in sequence and pipe; do
+		rm -f "$DIR/status"
+		( ulimit -s "$STACK" && env "$SETTING=1" "$BIN" < "$DIR/$LINE" > /dev/null 2> "$DIR/stderr" )
+		CODE=$?
+		STATUS=$(cat "$DIR/status" 2>/dev/null)
+		echo "deepchain: $LINE with $SETTING: exit=$CODE status=$STATUS"
+		if [ "$CODE" -ne 0 ] || [ "$STATUS" != 0 ]; then
+			echo "deepchain: FAIL: $LINE with $SETTING under a ${STACK}k stack" >&2
+			head -n 5 "$DIR/stderr" >&2
+			FAILED=1
+		fi
+	done
+done
+[ $FAILED -eq 0 ] && echo "deepchain: ok"
+exit $FAILED
@@ -0,0 +1,98 @@
+#!/bin/sh
+# tests/fdleak.sh
+#
+# Fd leak check under sustained pipeline load: runs ./Bash with FD_CHECK set
+# through ROUNDS rounds of pipelines (2 to 12 stages, with < > and >>
+# redirections, subshell stages, & jobs and failing stages), then checks
+#
+#   - FD_CHECK reported no fd left open after any command line,
+#   - the shell's /proc/PID/fd holds the same fds as after the first round,
+#   - a command run as a simple command, as the first, a middle or the last
+#     stage of a pipeline, in a subshell or as a & job inherits only 0, 1 and
+#     2 (ls /proc/self/fd shows those and its own directory fd).
+#
+#   sh tests/fdleak.sh [ROUNDS]     (BASH_UNDER_TEST=./Bash, default 500)
+
+BIN=${BASH_UNDER_TEST:-./Bash}
+ROUNDS=${1:-500}
+
+DIR=$(mktemp -d) || exit 1
+trap 'exec 3>&-; kill $PID 2>/dev/null; rm -rf "$DIR"' EXIT
+seq 1 1000 > "$DIR/data"
+mkfifo "$DIR/input"
+
+FD_CHECK=1 APPEND_CACHE=1 "$BIN" < "$DIR/input" > /dev/null 2> "$DIR/stderr" &
+PID=$!
+exec 3> "$DIR/input"
+
+# Fds open in PID, on one line
+fdList() {
+	ls "/proc/$PID/fd" | sort -n | tr '\n' ' '
+}
+
+# Write rounds FIRST..LAST of the load to the shell, then wait until it has run them
+load() {
+	awk -v first="$1" -v last="$2" -v d="$DIR" 'BEGIN {
+		for (n = first; n <= last; n++) {
+			line = "cat < " d "/data"
+			for (s = 0; s < 1 + n % 11; s++) {
+				line = line (s % 3 == 2? " | ( cat )" : " | cat")
+			}
+			print line " | wc -l > " d "/out"
+			print "grep 7 < " d "/data | sort -r | head -n 3 >> " d "/log"
+			print "cat < " d "/nosuchfile | wc -c > /dev/null"
+			print "nosuchcommand_fd < /dev/null | cat > /dev/null"
+			if (n % 50 == 0) print "cat < " d "/data | wc -l > /dev/null &"
+		}
+		print "echo " last " > " d "/progress"
+	}' >&3
+	until [ "$(cat "$DIR/progress" 2>/dev/null)" = "$2" ]; do
+		kill -0 $PID 2>/dev/null || { echo "fdleak: the shell died in round $1" >&2; exit 1; }
+		sleep 0.05
+	done
+}
+
+FAILED=0
+load 1 1
+BEFORE=$(fdList)
+load 2 "$ROUNDS"
+AFTER=$(fdList)
+echo "fdleak: shell fds after round 1: $BEFORE"
+echo "fdleak: shell fds after round $ROUNDS: $AFTER"
+if [ "$BEFORE" != "$AFTER" ]; then
+	echo "fdleak: FAIL: the shell's fds changed" >&2
+	FAILED=1
+fi
+
+# What each kind of command inherits
+D=$DIR
+cat >&3 <<EOF
+ls /proc/self/fd > $D/simple
+ls /proc/self/fd | cat > $D/first
+cat < $D/data | ls /proc/self/fd | cat > $D/middle
+cat < $D/data | cat | ls /proc/self/fd > $D/last
+( ls /proc/self/fd > $D/subshell )
+ls /proc/self/fd > $D/job &
+echo done > $D/progress
+EOF
+until [ "$(cat "$DIR/progress" 2>/dev/null)" = done ]; do
+	sleep 0.05
+done
+sleep 0.2                                   # The & job
+for f in simple first middle last subshell job; do
+	GOT=$(sort -n "$DIR/$f" | tr '\n' ' ')
+	echo "fdleak: $f inherits $GOT"
+	if [ "$GOT" != "0 1 2 3 " ]; then
+		echo "fdleak: FAIL: $f inherits more than 0 1 2" >&2
+		FAILED=1
+	fi
+done
+
+exec 3>&-
+wait $PID
+if grep FD_CHECK "$DIR/stderr" >&2; then
+	echo "fdleak: FAIL: FD_CHECK reported leaks" >&2
+	FAILED=1
+fi
+[ $FAILED -eq 0 ] && echo "fdleak: ok"
+exit $FAILED
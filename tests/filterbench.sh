@@ -0,0 +1,71 @@
+#!/bin/sh
+# tests/filterbench.sh
+#
+# Throughput of the filter builtins against coreutils: times wc -l, wc,
+# grep -F, head -n and tail -n on a file of LINES generated lines (default
+# 1500000, about 90 MB) with the builtins (SIMD), with NO_SIMD set (their
+# scalar loops) and with NO_BUILTINS set (the external tools), REPEAT runs
+# each, minus the time of a shell that runs nothing, and prints the best run
+# in MB of the file per second.  Fails if the three do not print the same
+# counts.
+#
+#   sh tests/filterbench.sh [LINES]     (BASH_UNDER_TEST=./Bash, REPEAT=3)
+
+BIN=${BASH_UNDER_TEST:-./Bash}
+LINES=${1:-1500000}
+REPEAT=${REPEAT:-3}
+
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+awk -v n="$LINES" 'BEGIN {
+	srand(1)
+	for (i = 0; i < n; i++) {
+		printf "%d the quick brown fox %d jumps over the lazy dog id=%x\n", i, int(rand() * 100000), i * 7
+	}
+}' > "$DIR/data"
+BYTES=$(wc -c < "$DIR/data")
+
+# Nanoseconds of the best of REPEAT runs of the shell on file $2 with variable $1 set
+best() {
+	B=
+	for r in $(seq "$REPEAT"); do
+		T0=$(date +%s%N)
+		env "$1=1" "$BIN" < "$2" > "$DIR/out" 2>&1
+		T1=$(date +%s%N)
+		[ -z "$B" ] || [ $(( T1 - T0 )) -lt "$B" ] && B=$(( T1 - T0 ))
+	done
+	echo "$B"
+}
+
+echo "true" > "$DIR/empty"
+BASE=$(best SIMD "$DIR/empty")
+FAILED=0
+N=0
+while read -r LINE; do
+	N=$(( N + 1 ))
+	echo "$LINE" > "$DIR/line$N"
+	REPORT=
+	EXPECTED=
+	for SETTING in SIMD NO_SIMD NO_BUILTINS; do  # SIMD is not a setting: the default
+		NS=$(( $(best $SETTING "$DIR/line$N") - BASE ))
+		[ "$NS" -gt 0 ] || NS=1
+		REPORT="$REPORT  $SETTING=$(( BYTES * 1000 / NS ))MB/s"
+		GOT=$(sed 's/([0-9]*)\$ //g' "$DIR/out" | tr -s ' \n' '  ' | sed 's/^ //; s/ $//')
+		[ -z "$EXPECTED" ] && EXPECTED=$GOT
+		if [ "$GOT" != "$EXPECTED" ]; then
+			echo "filterbench: FAIL: $LINE: $SETTING printed [$GOT], not [$EXPECTED]" >&2
+			FAILED=1
+		fi
+	done
+	echo "filterbench: $LINE  ->  $EXPECTED"
+	echo "filterbench:   $REPORT"
+done <<EOF
+wc -l < $DIR/data
+wc < $DIR/data
+grep -F id=1234 < $DIR/data | wc -l
+head -n $(( LINES / 2 )) < $DIR/data | wc -c
+tail -n 5 < $DIR/data | wc -c
+EOF
+[ $FAILED -eq 0 ] && echo "filterbench: ok"
+exit $FAILED
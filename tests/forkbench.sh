@@ -0,0 +1,98 @@
+#!/bin/sh
+# tests/forkbench.sh
+#
+# Spawn latency against the size of the shell's heap, with and without
+# ZYGOTE: grows the heap of ./Bash by 0, 64, 256 and 1024 MiB, then times
+# SPAWNS (default 200) "true < /dev/null" command lines, REPEAT runs each,
+# minus a run of one such line, and prints the best run per command.  The
+# heap is grown by a small LD_PRELOAD library that mallocs and touches
+# HEAP_MB MiB when the shell first reads a command line, so after the
+# zygote has been forked, as if the shell had grown while it ran; it also
+# unsets LD_PRELOAD, so that the commands run without it.  Fails if, with
+# ZYGOTE, a spawn at the largest heap takes more than SCALE times as long as
+# at the smallest (the zygote's cost should stay flat).
+#
+#   sh tests/forkbench.sh [MIB]...  (BASH_UNDER_TEST=./Bash, SPAWNS=200,
+#                                    REPEAT=3, SCALE=2, CC=cc)
+
+BIN=${BASH_UNDER_TEST:-./Bash}
+SPAWNS=${SPAWNS:-200}
+REPEAT=${REPEAT:-3}
+SCALE=${SCALE:-2}
+[ $# -eq 0 ] && set -- 0 64 256 1024
+
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+cat > "$DIR/heap.c" <<'EOF'
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//The first getline() of the shell: grow its heap by HEAP_MB MiB in 64 KiB blocks (below the mmap threshold)
+ssize_t getline(char** line, size_t* n, FILE* stream) {
+	static ssize_t (*next)(char**, size_t*, FILE*);
+	if (next == NULL) {
+		next = (ssize_t (*)(char**, size_t*, FILE*)) dlsym(RTLD_NEXT, "getline");
+		long blocks = (getenv("HEAP_MB") ? atol(getenv("HEAP_MB")) * 16 : 0);
+		for (long i = 0; i < blocks; i++) {
+			memset(malloc(64 * 1024), 1, 64 * 1024);
+		}
+		unsetenv("LD_PRELOAD");
+	}
+	return next(line, n, stream);
+}
+EOF
+if ! ${CC:-cc} -shared -fPIC -o "$DIR/heap.so" "$DIR/heap.c" -ldl; then
+	echo "forkbench: FAIL: could not build the heap library" >&2
+	exit 1
+fi
+
+echo "true < /dev/null" > "$DIR/one"
+awk -v n="$SPAWNS" 'BEGIN {
+	for (i = 0; i < n; i++) {
+		print "true < /dev/null"
+	}
+	print "printenv ?"
+}' > "$DIR/many"
+
+# Nanoseconds of the best of REPEAT runs of the shell on file $1, its heap grown by $2 MiB, ZYGOTE set if $3
+best() {
+	B=
+	for r in $(seq "$REPEAT"); do
+		T0=$(date +%s%N)
+		if [ -n "$3" ]; then
+			ZYGOTE=1 HEAP_MB=$2 LD_PRELOAD="$DIR/heap.so" "$BIN" < "$1" > "$DIR/out" 2>&1
+		else
+			HEAP_MB=$2 LD_PRELOAD="$DIR/heap.so" "$BIN" < "$1" > "$DIR/out" 2>&1
+		fi
+		T1=$(date +%s%N)
+		[ -z "$B" ] || [ $(( T1 - T0 )) -lt "$B" ] && B=$(( T1 - T0 ))
+	done
+	echo "$B"
+}
+
+FAILED=0
+for MIB in "$@"; do
+	for Z in "" 1; do
+		MANY=$(best "$DIR/many" "$MIB" "$Z")
+		if ! grep -q '\$ 0$' "$DIR/out"; then
+			echo "forkbench: FAIL: the commands did not exit with status 0" >&2
+			cat "$DIR/out" >&2
+			FAILED=1
+		fi
+		PER=$(( (MANY - $(best "$DIR/one" "$MIB" "$Z")) / (SPAWNS - 1) ))
+		[ -z "$Z" ] && FORK=$PER || ZYGOTE=$PER
+	done
+	echo "forkbench: heap +${MIB}MiB  fork=$(( FORK / 1000 ))us  zygote=$(( ZYGOTE / 1000 ))us per command"
+	[ -z "$SMALLEST" ] && SMALLEST=$ZYGOTE
+	LARGEST=$ZYGOTE
+done
+if [ "$LARGEST" -gt $(( SMALLEST * SCALE )) ]; then
+	echo "forkbench: FAIL: with ZYGOTE a spawn took more than ${SCALE}x as long at the largest heap" >&2
+	FAILED=1
+fi
+[ $FAILED -eq 0 ] && echo "forkbench: ok"
+exit $FAILED
@@ -0,0 +1,62 @@
+#!/bin/sh
+# tests/globbench.sh
+#
+# Globbing a large directory: creates ENTRIES files (default 1000000; that
+# takes a while) and, with GLOB set, times for each pattern below the first
+# expansion in a shell (listing the directory), the later ones (from the
+# listing cache) and, for comparison, find -name, REPEAT runs each, and
+# prints the best run.  Fails if ls -d PATTERN does not list exactly the
+# files that find does.
+#
+#   sh tests/globbench.sh [ENTRIES]     (BASH_UNDER_TEST=./Bash, GLOBS=10,
+#                                        REPEAT=3)
+
+BIN=${BASH_UNDER_TEST:-./Bash}
+ENTRIES=${1:-1000000}
+GLOBS=${GLOBS:-10}
+REPEAT=${REPEAT:-3}
+
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+mkdir "$DIR/big"
+seq 1 "$ENTRIES" | sed 's/^/entry/' | (cd "$DIR/big" && xargs touch)
+
+# Nanoseconds of the best of REPEAT runs of the shell on file $1 (of command $1 $2 if $1 is find)
+best() {
+	B=
+	for r in $(seq "$REPEAT"); do
+		T0=$(date +%s%N)
+		if [ "$1" = find ]; then
+			find "$DIR/big" -name "$2" > /dev/null
+		else
+			GLOB=1 "$BIN" < "$1" > /dev/null 2>&1
+		fi
+		T1=$(date +%s%N)
+		[ -z "$B" ] || [ $(( T1 - T0 )) -lt "$B" ] && B=$(( T1 - T0 ))
+	done
+	echo "$B"
+}
+
+echo "true" > "$DIR/empty"
+BASE=$(best "$DIR/empty")
+FAILED=0
+for PATTERN in 'entry*12345' 'entry?2345?' 'entry[13579]*0000'; do
+	echo "ls -d $DIR/big/$PATTERN > $DIR/globbed" > "$DIR/list"
+	GLOB=1 "$BIN" < "$DIR/list" > /dev/null 2>&1
+	find "$DIR/big" -name "$PATTERN" | LC_ALL=C sort > "$DIR/found"
+	if ! cmp -s "$DIR/globbed" "$DIR/found"; then
+		echo "globbench: FAIL: $PATTERN matched $(wc -l < "$DIR/globbed") files, find $(wc -l < "$DIR/found")" >&2
+		FAILED=1
+	fi
+
+	echo "true $DIR/big/$PATTERN" > "$DIR/one"
+	for i in $(seq "$GLOBS"); do
+		echo "true $DIR/big/$PATTERN"
+	done > "$DIR/many"
+	ONE=$(best "$DIR/one")
+	CACHED=$(( ($(best "$DIR/many") - ONE) / (GLOBS - 1) ))
+	FIND=$(best find "$PATTERN")
+	echo "globbench: $PATTERN ($(wc -l < "$DIR/found") of $ENTRIES)  first=$(( (ONE - BASE) / 1000000 ))ms  cached=$(( CACHED / 1000000 ))ms  find=$(( FIND / 1000000 ))ms"
+done
+[ $FAILED -eq 0 ] && echo "globbench: ok"
+exit $FAILED
@@ -0,0 +1,62 @@
+#!/bin/sh
+# tests/pipebench.sh
+#
+# Setup latency of long pipelines: times "cat < /dev/null | cat | ... | cat"
+# with 10, 100, 1000 and 10000 stages (cat is an in-process builtin, so each
+# stage costs the shell a fork and two pipe ends, not an exec), REPEAT runs
+# each, minus the time of a shell that runs nothing, and prints the best run
+# and the cost per stage.  Fails if a pipeline doesn't exit with status 0 or
+# if the cost per stage at 10000 stages is more than SCALE times that at 100
+# (setup that grows faster than linearly).
+#
+#   sh tests/pipebench.sh [STAGES]...   (BASH_UNDER_TEST=./Bash, REPEAT=3,
+#                                        SCALE=4)
+
+BIN=${BASH_UNDER_TEST:-./Bash}
+REPEAT=${REPEAT:-3}
+SCALE=${SCALE:-4}
+[ $# -eq 0 ] && set -- 10 100 1000 10000
+
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+
+# Nanoseconds of the best of REPEAT runs of the shell on file $1
+best() {
+	B=
+	for r in $(seq "$REPEAT"); do
+		T0=$(date +%s%N)
+		"$BIN" < "$1" > "$DIR/out" 2>&1
+		T1=$(date +%s%N)
+		[ -z "$B" ] || [ $(( T1 - T0 )) -lt "$B" ] && B=$(( T1 - T0 ))
+	done
+	echo "$B"
+}
+
+echo "true" > "$DIR/empty"
+BASE=$(best "$DIR/empty")
+FAILED=0
+for n in "$@"; do
+	awk -v n="$n" 'BEGIN {
+		line = "cat < /dev/null"
+		for (s = 1; s < n; s++) {
+			line = line " | cat"
+		}
+		print line
+		print "printenv ?"
+	}' > "$DIR/pipe$n"
+	NS=$(( $(best "$DIR/pipe$n") - BASE ))
+	PER=$(( NS / n ))
+	echo "pipebench: $n stages  setup+teardown=$(( NS / 1000000 ))ms  per-stage=$(( PER / 1000 ))us"
+	if ! grep -q '\$ 0$' "$DIR/out"; then
+		echo "pipebench: FAIL: the $n-stage pipeline did not exit with status 0" >&2
+		cat "$DIR/out" >&2
+		FAILED=1
+	fi
+	[ "$n" -eq 100 ] && PER100=$PER
+	if [ "$n" -eq 10000 ] && [ -n "$PER100" ] && [ "$PER" -gt $(( PER100 * SCALE )) ]; then
+		echo "pipebench: FAIL: per-stage cost grew more than ${SCALE}x from 100 to 10000 stages" >&2
+		FAILED=1
+	fi
+done
+[ $FAILED -eq 0 ] && echo "pipebench: ok"
+exit $FAILED
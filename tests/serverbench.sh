@@ -0,0 +1,88 @@
+#!/bin/sh
+# tests/serverbench.sh
+#
+# Latency of a shell server request against a cold shell: runs each command
+# line below REQUESTS times (default 500), once through BashClient and a
+# SHELL_SERVER, and once by starting a fresh ./Bash with the line on its
+# stdin (the shell has no -c), REPEAT runs each, and prints the best run per
+# request.  Fails if the two ways give a different output or status.  A
+# request through the server still execs BashClient and forks, so it only
+# saves the exec and startup of the shell itself.
+#
+#   sh tests/serverbench.sh [REQUESTS]  (BASH_UNDER_TEST=./Bash,
+#                                        CLIENT_UNDER_TEST=./BashClient,
+#                                        REPEAT=3)
+
+BIN=${BASH_UNDER_TEST:-./Bash}
+CLIENT=${CLIENT_UNDER_TEST:-./BashClient}
+REQUESTS=${1:-500}
+REPEAT=${REPEAT:-3}
+
+DIR=$(mktemp -d) || exit 1
+trap 'kill $PID 2>/dev/null; rm -rf "$DIR"' EXIT
+seq 1 1000 > "$DIR/data"
+
+SHELL_SERVER="$DIR/sock" "$BIN" > /dev/null 2> "$DIR/stderr" &
+PID=$!
+READY=
+for i in $(seq 500); do                        # The socket exists from bind(), before listen()
+	"$CLIENT" "$DIR/sock" "true < /dev/null" 2>/dev/null && READY=1 && break
+	sleep 0.01
+done
+if [ -z "$READY" ]; then
+	echo "serverbench: FAIL: the server did not start" >&2
+	exit 1
+fi
+
+# Run LINE $1 through the server, or by a cold shell
+served() {
+	"$CLIENT" "$DIR/sock" "$1"
+}
+cold() {
+	echo "$1" | "$BIN"
+}
+
+# Output and status of LINE $1 run by way $2
+result() {
+	if [ "$2" = served ]; then
+		served "$1"
+		echo "status $?"
+	else
+		cold "$1
+printenv ?" | sed 's/([0-9]*)\$ //g; $d' | sed '$s/^/status /'  # The last line is the last prompt
+	fi
+}
+
+# Nanoseconds of the best of REPEAT runs of REQUESTS requests of LINE $2 by way $1
+best() {
+	B=
+	for r in $(seq "$REPEAT"); do
+		T0=$(date +%s%N)
+		for i in $(seq "$REQUESTS"); do
+			$1 "$2" > /dev/null 2>&1
+		done
+		T1=$(date +%s%N)
+		[ -z "$B" ] || [ $(( T1 - T0 )) -lt "$B" ] && B=$(( T1 - T0 ))
+	done
+	echo "$B"
+}
+
+FAILED=0
+while read -r LINE; do
+	S=$(result "$LINE" served 2>&1)
+	C=$(result "$LINE" cold 2>&1)
+	if [ "$S" != "$C" ]; then
+		echo "serverbench: FAIL: $LINE: the server gave [$S], a cold shell [$C]" >&2
+		FAILED=1
+	fi
+	SERVER=$(( $(best served "$LINE") / REQUESTS ))
+	COLD=$(( $(best cold "$LINE") / REQUESTS ))
+	echo "serverbench: $LINE  server=$(( SERVER / 1000 ))us  cold=$(( COLD / 1000 ))us per request"
+done <<EOF
+true < /dev/null
+wc -l < $DIR/data
+grep 7 < $DIR/data | tail -n 2
+ls $DIR/nosuchfile
+EOF
+[ $FAILED -eq 0 ] && echo "serverbench: ok"
+exit $FAILED
@@ -0,0 +1,100 @@
+#!/bin/sh
+# tests/soak.sh
+#
+# Soak test of a long-running shell: feeds ./Bash LINES mixed command lines
+# (default one million) -- in-process builtins, pipelines, redirections,
+# ; && || chains, subshells, $(...), & jobs, cd/pushd/popd, the append cache
+# and failing commands -- in CHUNKS chunks.  After each chunk it reads the
+# shell's VmRSS from /proc/PID/status and counts /proc/PID/fd, and fails if,
+# after the first chunk (the warm-up), the RSS grows by more than RSS_SLACK
+# KiB or the number of fds changes at all.
+#
+#   sh tests/soak.sh [LINES]        (BASH_UNDER_TEST=./Bash, CHUNKS=20,
+#                                    RSS_SLACK=256)
+#
+# Most lines run without forking so that a million of them take minutes, not
+# hours; every command reads a file or /dev/null, never the shell's stdin.
+
+BIN=${BASH_UNDER_TEST:-./Bash}
+LINES=${1:-1000000}
+CHUNKS=${CHUNKS:-20}
+RSS_SLACK=${RSS_SLACK:-256}
+
+DIR=$(mktemp -d) || exit 1
+trap 'exec 3>&-; kill $PID 2>/dev/null; rm -rf "$DIR"' EXIT
+mkdir "$DIR/a" "$DIR/b"
+seq 1 100 > "$DIR/data"
+cp "$DIR/data" "$DIR/copy"
+mkfifo "$DIR/input"
+
+APPEND_CACHE=1 "$BIN" < "$DIR/input" > /dev/null 2> "$DIR/stderr" &
+PID=$!
+exec 3> "$DIR/input"
+
+# Resident set size of PID, in KiB
+rss() {
+	awk '/^VmRSS:/ { print $2 }' "/proc/$PID/status"
+}
+
+# Number of open fds of PID
+fds() {
+	ls "/proc/$PID/fd" | wc -l
+}
+
+# Write lines FIRST..LAST of the mix to the shell, then wait until it has run them
+chunk() {
+	awk -v first="$1" -v last="$2" -v d="$DIR" 'BEGIN {
+		for (n = first; n <= last; n++) {
+			k = n % 32
+			if (k == 0)       print "cat < " d "/data > " d "/copy"
+			else if (k == 1)  print "head -n 5 < " d "/data | wc -l > /dev/null"
+			else if (k == 2)  print "grep 7 < " d "/data | tail -n 2 | wc -c > " d "/count"
+			else if (k == 3)  print "cat " d "/data " d "/copy | wc -l >> " d "/a/log"
+			else if (k == 4)  print "cd " d "/a ; head -n 1 < ../data >> log ; cd " d
+			else if (k == 5)  print "pushd " d "/b ; head -n 2 < ../data >> log ; popd"
+			else if (k == 6)  print "wc -l < " d "/nosuchfile || head -n 1 < " d "/data > /dev/null"
+			else if (k == 7)  print "grep -c 1 < " d "/data && tail -n 1 < " d "/data > /dev/null"
+			else if (k == 8)  print "cat < " d "/data | cat | cat | wc -w > /dev/null"
+			else if (k == 9)  print "tee " d "/copy < " d "/data > /dev/null"
+			else if (k == 16) print "true < /dev/null > " d "/out"
+			else if (k == 17) print "( cd " d "/b ; cat < ../data > /dev/null )"
+			else if (k == 18) print "head -n 1 < /dev/null $( cat < /dev/null ) > /dev/null"
+			else if (k == 24 && n % 1024 == 24) print "true < /dev/null &"
+			else if (k == 25 && n % 1024 == 25) print "nosuchcommand_soak < /dev/null"
+			else              print "tail -n 3 < " d "/data > " d "/last"
+		}
+		print "echo " last " > " d "/progress"
+	}' >&3
+	until [ "$(cat "$DIR/progress" 2>/dev/null)" = "$2" ]; do
+		kill -0 $PID 2>/dev/null || { echo "soak: the shell died after line $1" >&2; exit 1; }
+		sleep 0.05
+	done
+}
+
+PER=$(( (LINES + CHUNKS - 1) / CHUNKS ))
+FAILED=0
+FIRST=1
+while [ $FIRST -le "$LINES" ]; do
+	LAST=$(( FIRST + PER - 1 ))
+	[ $LAST -gt "$LINES" ] && LAST=$LINES
+	chunk $FIRST $LAST
+	R=$(rss)
+	F=$(fds)
+	if [ $FIRST -eq 1 ]; then
+		BASE_RSS=$R
+		BASE_FDS=$F
+	fi
+	echo "soak: $LAST lines  rss=${R}k  fds=$F"
+	if [ $(( R - BASE_RSS )) -gt "$RSS_SLACK" ] || [ "$F" -ne "$BASE_FDS" ]; then
+		FAILED=1
+	fi
+	FIRST=$(( LAST + 1 ))
+done
+
+exec 3>&-
+wait $PID
+if [ $FAILED -ne 0 ]; then
+	echo "soak: FAIL: rss or fds grew after the warm-up (rss=${BASE_RSS}k fds=$BASE_FDS then)" >&2
+	exit 1
+fi
+echo "soak: ok"
@@ -0,0 +1,72 @@
+#!/bin/sh
+# tests/substbench.sh
+#
+# Command substitutions per second against passing values through temporary
+# files: runs COUNT (default 10000) lines of
+#
+#   head -n $( head -n 1 < VALUE ) < DATA > /dev/null
+#
+# and as many of
+#
+#   head -n 1 < VALUE > TMP ; head -n 1 < TMP > /dev/null
+#
+# (two heads each, the value reaching the second one from memory, as an
+# argument, or through TMP, on its stdin), once with the head builtin (run
+# in-process, also inside $(...)) and once with NO_BUILTINS set (one fork
+# and exec per command), REPEAT runs each, minus the time of a shell that
+# runs nothing, and prints the best run.  Fails if the substitution does
+# not pass on the value.
+#
+#   sh tests/substbench.sh [COUNT]  (BASH_UNDER_TEST=./Bash, REPEAT=3)
+
+BIN=${BASH_UNDER_TEST:-./Bash}
+COUNT=${1:-10000}
+REPEAT=${REPEAT:-3}
+
+DIR=$(mktemp -d) || exit 1
+trap 'rm -rf "$DIR"' EXIT
+echo 3 > "$DIR/value"
+seq 1 10 > "$DIR/data"
+
+# Nanoseconds of the best of REPEAT runs of the shell on file $1 with variables $2 set
+best() {
+	B=
+	for r in $(seq "$REPEAT"); do
+		T0=$(date +%s%N)
+		env $2 "$BIN" < "$1" > "$DIR/out" 2>&1
+		T1=$(date +%s%N)
+		[ -z "$B" ] || [ $(( T1 - T0 )) -lt "$B" ] && B=$(( T1 - T0 ))
+	done
+	echo "$B"
+}
+
+echo "true" > "$DIR/empty"
+awk -v n="$COUNT" -v d="$DIR" 'BEGIN {
+	for (i = 0; i < n; i++) {
+		print "head -n $( head -n 1 < " d "/value ) < " d "/data > /dev/null"
+	}
+}' > "$DIR/substitute"
+awk -v n="$COUNT" -v d="$DIR" 'BEGIN {
+	for (i = 0; i < n; i++) {
+		print "head -n 1 < " d "/value > " d "/tmp ; head -n 1 < " d "/tmp > /dev/null"
+	}
+}' > "$DIR/temporary"
+echo "head -n \$( head -n 1 < $DIR/value ) < $DIR/data" > "$DIR/check"
+
+FAILED=0
+for SETTINGS in "" NO_BUILTINS=1; do
+	best "$DIR/check" "$SETTINGS" > /dev/null
+	if [ "$(sed 's/([0-9]*)\$ //g' "$DIR/out" | tr '\n' ' ')" != "1 2 3 " ]; then
+		echo "substbench: FAIL: head -n \$( head -n 1 < VALUE ) did not print 3 lines${SETTINGS:+ with $SETTINGS}" >&2
+		cat "$DIR/out" >&2
+		FAILED=1
+	fi
+	BASE=$(best "$DIR/empty" "$SETTINGS")
+	SUBSTITUTE=$(( $(best "$DIR/substitute" "$SETTINGS") - BASE ))
+	TEMPORARY=$(( $(best "$DIR/temporary" "$SETTINGS") - BASE ))
+	[ "$SUBSTITUTE" -gt 0 ] || SUBSTITUTE=1
+	[ "$TEMPORARY" -gt 0 ] || TEMPORARY=1
+	echo "substbench: ${SETTINGS:-builtin head}  \$(...)=$(( COUNT * 1000000000 / SUBSTITUTE ))/s  temporary file=$(( COUNT * 1000000000 / TEMPORARY ))/s"
+done
+[ $FAILED -eq 0 ] && echo "substbench: ok"
+exit $FAILED
@@ -0,0 +1,285 @@
+// timeout.c
+//
+// Deadlines and resource limits for commands.
+//
+//   timeout [-k DURATION] DURATION COMMAND [ARG]...
+//
+// runs COMMAND (with the redirections and local variables of the timeout
+// command) in a process group of its own and sends the group SIGTERM once
+// DURATION has passed, and SIGKILL DURATION after that if -k (--kill-after) is
+// given.  A DURATION is a number of seconds, optionally fractional, with an
+// optional s, m, h or d suffix; 0 means no deadline.  The status is 124 if the
+// deadline passed, 137 if SIGKILL had to be sent, 125 for a usage error and
+// that of COMMAND otherwise, as for GNU timeout.  The same deadline applies
+// to any foreground simple command or pipeline whose (first stage's) local
+// variables or environment set TIMEOUT=DURATION (and TIMEOUT_KILL=DURATION);
+// all the stages of a pipeline share its process group, so they are killed
+// together.  Like any foreground job, the group has the terminal (and Ctrl-C)
+// while it runs.
+//
+// Each deadline is a timerfd, and the shell sleeps in poll() on it and on a
+// pidfd of each of the processes it waits for, so it wakes only when a
+// deadline passes or a child exits.
+//
+// LIMIT_CPU=SECONDS, LIMIT_MEM=BYTES[k|m|g] and LIMIT_FDS=N (locals or the
+// environment) set RLIMIT_CPU, RLIMIT_AS and RLIMIT_NOFILE in the child of a
+// simple command or pipeline stage before it execs.
+
+#include "process.h"
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+
+#define STATUS_TIMEDOUT 124                 //Statuses of GNU timeout
+#define STATUS_USAGE 125
+#define FALLBACK_MSEC 10                    //Wake-up interval when there is no pidfd
+
+struct deadline {
+	int timer;                              //timerfd
+	int pgid;                               //Process group to signal, 0 until known
+	double killAfter;                       //Seconds from SIGTERM to SIGKILL, 0 for none
+	int signals;                            //Sent so far: 0, 1 (SIGTERM) or 2 (SIGKILL)
+	int* pidfds;                            //Of the processes waited for: -1 if none, -2 once exited
+	int nPidfds;
+};
+
+//Parse DURATION into *SECONDS; false if it is malformed
+static bool parseDuration(const char* duration, double* seconds) {
+	char* end;
+	*seconds = strtod(duration, &end);
+	if (end == duration || *seconds < 0) {
+		return false;
+	}
+	switch (*end) {
+	case 'd':
+		*seconds *= 24;                     //Fall through
+	case 'h':
+		*seconds *= 60;                     //Fall through
+	case 'm':
+		*seconds *= 60;                     //Fall through
+	case 's':
+		end++;
+	}
+	return *end == '\0';
+}
+
+//Arm TIMER to expire once in SECONDS
+static void armTimer(int timer, double seconds) {
+	struct itimerspec when;
+	memset(&when, 0, sizeof(when));
+	when.it_value.tv_sec = (time_t) seconds;
+	when.it_value.tv_nsec = (long) ((seconds - (time_t) seconds) * 1e9);
+	if (when.it_value.tv_sec == 0 && when.it_value.tv_nsec == 0) {
+		when.it_value.tv_nsec = 1;          //Zero would disarm it
+	}
+	timerfd_settime(timer, 0, &when, NULL);
+}
+
+//Start a deadline of SECONDS (SIGKILL KILLAFTER seconds later, if not 0); NULL if SECONDS is 0
+static deadline* startDeadline(double seconds, double killAfter) {
+	if (seconds == 0) {
+		return NULL;
+	}
+	int timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (timer < 0) {
+		perror("timeout: timerfd_create");
+		return NULL;
+	}
+	armTimer(timer, seconds);
+	deadline* d = malloc(sizeof(deadline));
+	d->timer = timer;
+	d->pgid = 0;
+	d->killAfter = killAfter;
+	d->signals = 0;
+	d->pidfds = NULL;
+	d->nPidfds = 0;
+	return d;
+}
+
+deadline* commandDeadline(const CMD* cmdList) {
+	char* duration = localOrEnv(cmdList, "TIMEOUT");
+	char* grace = localOrEnv(cmdList, "TIMEOUT_KILL");
+	double seconds, killAfter = 0;
+	if (duration == NULL || *duration == '\0') {
+		return NULL;
+	}
+	if (!parseDuration(duration, &seconds) || (grace != NULL && *grace != '\0' && !parseDuration(grace, &killAfter))) {
+		fprintf(stderr, "TIMEOUT: invalid duration, ignored\n");
+		return NULL;
+	}
+	return startDeadline(seconds, killAfter);
+}
+
+void watchDeadline(deadline* d, int pid) {
+	if (d->pgid == 0) {
+		d->pgid = pid;                      //The first process leads the group
+	}
+	REALLOC(d->pidfds, d->nPidfds + 1);
+	d->pidfds[d->nPidfds++] = syscall(SYS_pidfd_open, pid, 0);
+}
+
+void sleepDeadline(deadline* d, int msec) {
+	struct pollfd* fds = malloc(sizeof(struct pollfd) * (d->nPidfds + 1));
+	fds[0].fd = d->timer;
+	fds[0].events = POLLIN;
+	int count = 1;
+	for (int i = 0; i < d->nPidfds; i++) {
+		if (d->pidfds[i] >= 0) {
+			fds[count].fd = d->pidfds[i];
+			fds[count++].events = POLLIN;
+		}
+		else if (d->pidfds[i] == -1 && (msec < 0 || msec > FALLBACK_MSEC)) { //No pidfd: its exit is noticed by polling
+			msec = FALLBACK_MSEC;
+		}
+	}
+	if (poll(fds, count, msec) > 0) {
+		for (int i = 0; i < d->nPidfds; i++) { //An exited process wakes us once, its pid is reaped next
+			for (int j = 1; j < count; j++) {
+				if (fds[j].fd == d->pidfds[i] && fds[j].revents != 0) {
+					close(d->pidfds[i]);
+					d->pidfds[i] = -2;      //Not -1: that means there never was a pidfd
+				}
+			}
+		}
+		unsigned long long expirations;
+		if (fds[0].revents != 0 && read(d->timer, &expirations, sizeof(expirations)) > 0 && d->pgid > 0) {
+			if (d->signals == 0) {
+				kill(-d->pgid, SIGTERM);
+				kill(-d->pgid, SIGCONT);    //A stopped process must see it too
+				if (d->killAfter > 0) {
+					armTimer(d->timer, d->killAfter);
+				}
+			}
+			else {
+				kill(-d->pgid, SIGKILL);
+			}
+			d->signals++;
+		}
+	}
+	free(fds);
+}
+
+int finishDeadline(deadline* d, int status) {
+	if (d == NULL) {
+		return status;
+	}
+	if (d->signals > 0) {
+		status = (d->signals > 1? 128 + SIGKILL : STATUS_TIMEDOUT);
+	}
+	for (int i = 0; i < d->nPidfds; i++) {
+		if (d->pidfds[i] >= 0) {
+			close(d->pidfds[i]);
+		}
+	}
+	close(d->timer);
+	free(d->pidfds);
+	free(d);
+	return status;
+}
+
+//Run simple command cmdList subject to deadline D (taken over) and set $?
+void executeDeadline(const CMD* cmdList, deadline* d) {
+	int pid = spawnCommand(cmdList, true);
+	if (pid < 0) {
+		finishDeadline(d, 0);
+		return;
+	}
+	watchDeadline(d, pid);
+	foregroundJob(pid);
+	int result = -1, reaped;
+	while ((reaped = waitpid(pid, &result, WNOHANG)) == 0 || (reaped < 0 && errno == EINTR)) {
+		sleepDeadline(d, -1);
+	}
+	foregroundJob(0);
+	char buffer[4];
+	sprintf(buffer, "%d", finishDeadline(d, (result != -1? STATUS(result) : 128 + SIGINT)));
+	setenv("?", buffer, 1);
+}
+
+void executeTimeout(const CMD* cmdList) {
+	char** argv = cmdList->argv + 1;
+	double seconds, killAfter = 0;
+	if (argv[0] != NULL && (strcmp(argv[0], "-k") == 0 || strcmp(argv[0], "--kill-after") == 0)) {
+		if (argv[1] == NULL || !parseDuration(argv[1], &killAfter)) {
+			argv = NULL;
+		}
+		else {
+			argv += 2;
+		}
+	}
+	else if (argv[0] != NULL && strncmp(argv[0], "--kill-after=", 13) == 0) {
+		argv = (parseDuration(argv[0] + 13, &killAfter)? argv + 1 : NULL);
+	}
+	if (argv == NULL || argv[0] == NULL || argv[1] == NULL || !parseDuration(argv[0], &seconds)) {
+		fprintf(stderr, "usage: timeout [-k DURATION] DURATION COMMAND [ARG]...\n");
+		char buffer[4];
+		sprintf(buffer, "%d", STATUS_USAGE);
+		setenv("?", buffer, 1);
+		return;
+	}
+
+	CMD command = *cmdList;                 //cmdList without the prefix
+	command.argv = argv + 1;
+	command.argc = cmdList->argc - (command.argv - cmdList->argv);
+	deadline* d = startDeadline(seconds, killAfter);
+	if (d == NULL) {
+		executeSingle(&command);
+	}
+	else {
+		executeDeadline(&command, d);
+	}
+}
+
+//Parse the limit NAME of cmdList into *VALUE; false if it is unset or malformed (with a warning)
+static bool limitSetting(const CMD* cmdList, const char* name, rlim_t* value) {
+	char* setting = localOrEnv(cmdList, name);
+	if (setting == NULL || *setting == '\0') {
+		return false;
+	}
+	char* end;
+	unsigned long long n = strtoull(setting, &end, 10);
+	if (*end == 'k' || *end == 'K') {
+		n <<= 10, end++;
+	}
+	else if (*end == 'm' || *end == 'M') {
+		n <<= 20, end++;
+	}
+	else if (*end == 'g' || *end == 'G') {
+		n <<= 30, end++;
+	}
+	if (end == setting || *end != '\0') {
+		fprintf(stderr, "%s: invalid limit, ignored\n", name);
+		return false;
+	}
+	*value = n;
+	return true;
+}
+
+bool commandLimited(const CMD* cmdList) {
+	return localOrEnv(cmdList, "LIMIT_CPU") || localOrEnv(cmdList, "LIMIT_MEM") || localOrEnv(cmdList, "LIMIT_FDS");
+}
+
+void applyLimits(const CMD* cmdList) {
+	static const struct {
+		const char* name;
+		int resource;
+	} limits[] = {
+		{"LIMIT_CPU", RLIMIT_CPU},
+		{"LIMIT_MEM", RLIMIT_AS},
+		{"LIMIT_FDS", RLIMIT_NOFILE},
+	};
+	for (int i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+		rlim_t value;
+		if (!limitSetting(cmdList, limits[i].name, &value)) {
+			continue;
+		}
+		struct rlimit limit = {value, value};
+		if (limits[i].resource == RLIMIT_CPU) {
+			limit.rlim_max = value + 1;     //SIGXCPU first, SIGKILL a second later
+		}
+		if (setrlimit(limits[i].resource, &limit) == -1) {
+			perror(limits[i].name);
+		}
+	}
+}
@@ -0,0 +1,215 @@
+// uptodate.c
+//
+// Make-style skipping of regeneration commands (enabled by INCREMENTAL=FILE).
+// A simple command of the form "COMMAND < INPUT > OUTPUT" is not run when
+// OUTPUT is newer than INPUT and was last produced, successfully, by the same
+// command line; its status is then 0.  With INCREMENTAL_HASH set the contents
+// of INPUT are part of the command line's hash and the mtimes are ignored, so
+// touching INPUT without changing it no longer forces a rerun.
+//
+// FILE holds a line per run (keyed by the current directory and the name of
+// OUTPUT): the hash of the command line that made it and how long that took,
+// which is what a skip reports as time saved.  A successful run appends its
+// line, so the shell (or a subshell) never rewrites FILE per command; a later
+// line for the same OUTPUT overrides an earlier one, and a shell that finds
+// such stale lines when it loads FILE compacts it to one line per OUTPUT.
+
+#include "process.h"
+#include <sys/stat.h>
+
+//What INCREMENTAL remembers about one output file
+typedef struct upToDateEntry {
+	hash128 target;                         //Current directory and OUTPUT
+	hash128 command;                        //Command line that produced it
+	long long nsec;                         //How long that took
+} upToDateEntry;
+
+static upToDateEntry* entries = NULL;
+static int nEntries = -1;                   //-1 until the state file is loaded
+static int skipped = 0;
+static long long savedNsec = 0;
+
+//Is cmdList of the form COMMAND < INPUT > OUTPUT?
+static bool regenerates(const CMD* cmdList) {
+	return cmdList->type == SIMPLE && cmdList->fromType == RED_IN && cmdList->toType == RED_OUT;
+}
+
+//Print the 128-bit hash H as 32 hex digits into BUF
+static void hashHex(char* buf, hash128 h) {
+	sprintf(buf, "%016llx%016llx", (unsigned long long) (h >> 64), (unsigned long long) h);
+}
+
+//Parse 32 hex digits at S into *H
+static bool parseHex(const char* s, hash128* h) {
+	unsigned long long high, low;
+	if (sscanf(s, "%16llx%16llx", &high, &low) != 2) {
+		return false;
+	}
+	*h = ((hash128) high << 64) | low;
+	return true;
+}
+
+//Rewrite the state file with one line per output (atomically, so a killed shell can't leave half of it)
+static void saveState(void) {
+	const char* state = getenv("INCREMENTAL");
+	char* temporary = malloc(strlen(state) + sizeof(".XXXXXX"));
+	sprintf(temporary, "%s.XXXXXX", state);
+	int fd = mkostemp(temporary, O_CLOEXEC);
+	FILE* file = (fd < 0? NULL : fdopen(fd, "w"));
+	if (file == NULL) {
+		perror(state);
+		free(temporary);
+		return;
+	}
+	for (int i = 0; i < nEntries; i++) {
+		char target[33], command[33];
+		hashHex(target, entries[i].target);
+		hashHex(command, entries[i].command);
+		fprintf(file, "%s %s %lld\n", target, command, entries[i].nsec);
+	}
+	if (fclose(file) != 0 || rename(temporary, state) == -1) {
+		perror(state);
+		unlink(temporary);
+	}
+	free(temporary);
+}
+
+//Append the line of ENTRY to the state file (in one write, so lines of other shells can't interleave)
+static void appendState(const upToDateEntry* entry) {
+	const char* state = getenv("INCREMENTAL");
+	char target[33], command[33], line[96];
+	hashHex(target, entry->target);
+	hashHex(command, entry->command);
+	int length = snprintf(line, sizeof(line), "%s %s %lld\n", target, command, entry->nsec);
+	int fd = openFd(state, O_WRONLY | O_CREAT | O_APPEND, 0666);
+	if (fd < 0 || write(fd, line, length) != length) {
+		perror(state);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+}
+
+//Hashes identifying the output of cmdList and the command line producing it
+static bool commandHashes(const CMD* cmdList, hash128* target, hash128* command) {
+	char* cwd = getcwd(NULL, 0);
+	*target = *command = FNV_OFFSET;
+	hashString(target, (cwd? cwd : ""));
+	hashString(target, cmdList->toFile);
+	hashString(command, (cwd? cwd : ""));
+	free(cwd);
+	for (char** arg = cmdList->argv; *arg; arg++) {
+		hashString(command, *arg);
+	}
+	for (int i = 0; i < cmdList->nLocal; i++) {
+		hashString(command, cmdList->locVar[i]);
+		hashString(command, cmdList->locVal[i]);
+	}
+	hashString(command, cmdList->fromFile);
+	return !getenv("INCREMENTAL_HASH") || hashFile(command, cmdList->fromFile);
+}
+
+//State entry for TARGET, or NULL
+static upToDateEntry* findTarget(hash128 target) {
+	for (int i = 0; i < nEntries; i++) {
+		if (entries[i].target == target) {
+			return &entries[i];
+		}
+	}
+	return NULL;
+}
+
+//Load the state file the first time it is needed
+static void loadState(void) {
+	if (nEntries >= 0) {
+		return;
+	}
+	nEntries = 0;
+	FILE* file = fopen(getenv("INCREMENTAL"), "re");
+	if (file == NULL) {
+		return;
+	}
+	char target[33], command[33];
+	long long nsec;
+	int lines = 0;
+	while (fscanf(file, "%32s %32s %lld", target, command, &nsec) == 3) {
+		upToDateEntry line;
+		lines++;
+		if (!parseHex(target, &line.target) || !parseHex(command, &line.command)) {
+			continue;
+		}
+		line.nsec = nsec;
+		upToDateEntry* entry = findTarget(line.target); //The last line for an output wins
+		if (entry == NULL) {
+			REALLOC(entries, nEntries + 1);
+			entry = &entries[nEntries++];
+		}
+		*entry = line;
+	}
+	fclose(file);
+	if (lines > nEntries) {
+		saveState();
+	}
+}
+
+//Is st_mtim of A later than that of B?
+static bool newer(const struct stat* a, const struct stat* b) {
+	return a->st_mtim.tv_sec > b->st_mtim.tv_sec
+		|| (a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec > b->st_mtim.tv_nsec);
+}
+
+//Skip cmdList if its output is up to date (setting $? to 0); otherwise note in *STARTED when it started
+bool skipUpToDate(const CMD* cmdList, struct timespec* started) {
+	clock_gettime(CLOCK_MONOTONIC, started);
+	if (!regenerates(cmdList)) {
+		return false;
+	}
+	loadState();
+	struct stat input, output;
+	hash128 target, command;
+	if (stat(cmdList->toFile, &output) == -1 || stat(cmdList->fromFile, &input) == -1
+			|| (!getenv("INCREMENTAL_HASH") && !newer(&output, &input))
+			|| !commandHashes(cmdList, &target, &command)) {
+		return false;
+	}
+	upToDateEntry* entry = findTarget(target);
+	if (entry == NULL || entry->command != command) {
+		return false;
+	}
+	skipped++;
+	savedNsec += entry->nsec;
+	setenv("?", "0", 1);
+	return true;
+}
+
+//Remember that cmdList, started at STARTED, has just produced its output (if it succeeded)
+void recordUpToDate(const CMD* cmdList, const struct timespec* started) {
+	if (!regenerates(cmdList) || strcmp(getenv("?"), "0") != 0) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	hash128 target, command;
+	if (!commandHashes(cmdList, &target, &command)) {
+		return;
+	}
+	loadState();
+	upToDateEntry* entry = findTarget(target);
+	if (entry == NULL) {
+		REALLOC(entries, nEntries + 1);
+		entry = &entries[nEntries++];
+		entry->target = target;
+	}
+	entry->command = command;
+	entry->nsec = (now.tv_sec - started->tv_sec) * 1000000000LL + (now.tv_nsec - started->tv_nsec);
+	appendState(entry);
+}
+
+//Report the commands skipped and the time their last runs took
+void dumpUpToDateStats(void) {
+	fprintf(stderr, "INCREMENTAL:  skipped=%d  saved=%.3fs\n", skipped, savedNsec / 1e9);
+}
+
+void upToDateMemory(memoryUsage* u) {
+	countBlock(u, entries);
+}
@@ -0,0 +1,219 @@
+// zygote.c
+//
+// Optional spawn helper (enabled by ZYGOTE).  The zygote is forked by main()
+// before the shell has grown, and afterwards creates external commands on the
+// shell's behalf: the shell sends argv, envp and the stdin/stdout/stderr and
+// working-directory fds (SCM_RIGHTS) over a Unix socketpair, and the zygote
+// clones itself with CLONE_PARENT.  The new process is therefore a child of the
+// shell, which waits for it exactly as if it had forked it, but copying the
+// zygote's small image costs the same no matter how large the shell gets.
+// The new process joins the process group of a pipeline itself, before it
+// execs: once it has, the shell could no longer move it.
+
+#include "process.h"
+#include "fdpass.h"
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define ZYGOTE_FDS 4                //stdin, stdout, stderr and the working directory
+
+extern char** environ;
+
+//Header of a spawn request, followed by LENGTH bytes of NUL-terminated strings (argv, then envp)
+typedef struct spawnRequest {
+	int argc;
+	int envc;
+	int pgid;                       //Process group to join: 0 a new one, -1 the zygote's
+	size_t length;
+} spawnRequest;
+
+static int zygoteSocket = -1;       //Shell's end of the socketpair, -1 if there is no zygote
+static int zygotePid = 0;           //0 if there is no zygote
+static int zygoteShell = 0;         //The shell it spawns for, as opposed to that shell's subshells and & jobs
+
+//Receive the next request header and its fds, return false when the shell has gone away
+static bool receiveRequest(int sock, spawnRequest* request, int* fds) {
+	return receiveFds(sock, request, sizeof(*request), fds, ZYGOTE_FDS);
+}
+
+//Child side of a spawn: join process group PGID (unless -1), install the fds and environment, then exec
+static void execRequest(char** argv, char** envp, int* fds, int pgid) {
+	if (pgid >= 0) {
+		setpgid(0, pgid);
+	}
+	fchdir(fds[3]);
+	for (int i = 0; i < 3; i++) {
+		dup2(fds[i], i);                    //Received fds are close-on-exec, the dup2'd copies are not
+	}
+	signal(SIGINT, SIG_DFL);                //Ignored by the zygote only
+	closeExtraFds();
+	environ = envp;                         //execvp searches the command's own PATH
+	execvp(argv[0], argv);
+	int error = errno;
+	perror(argv[0]);
+	_exit(error);
+}
+
+//Body of the zygote: spawn one command per request until the shell closes its end
+static void zygoteLoop(int sock) {
+	signal(SIGINT, SIG_IGN);                //Ctrl-C is meant for the commands, not for us
+	spawnRequest request;
+	int fds[ZYGOTE_FDS];
+	while (receiveRequest(sock, &request, fds)) {
+		char* strings = malloc(request.length);
+		char** argv = malloc(sizeof(char*) * (request.argc + 1));
+		char** envp = malloc(sizeof(char*) * (request.envc + 1));
+		if (!readFully(sock, strings, request.length)) {
+			_exit(EXIT_SUCCESS);
+		}
+		char* s = strings;
+		for (int i = 0; i < request.argc + request.envc; i++, s += strlen(s) + 1) {
+			if (i < request.argc) {
+				argv[i] = s;
+			}
+			else {
+				envp[i - request.argc] = s;
+			}
+		}
+		argv[request.argc] = NULL;
+		envp[request.envc] = NULL;
+
+		int pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, NULL, NULL, NULL, NULL); //Child of the shell, not of the zygote
+		if (pid == 0) {
+			execRequest(argv, envp, fds, request.pgid);
+		}
+		int reply = (pid < 0? -errno : pid);
+		writeFully(sock, &reply, sizeof(reply));
+
+		for (int i = 0; i < ZYGOTE_FDS; i++) {
+			close(fds[i]);
+		}
+		free(strings);
+		free(argv);
+		free(envp);
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+//Fork the zygote; on failure the shell just keeps forking commands itself
+void startZygote(void) {
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+		perror("zygote: socketpair");
+		return;
+	}
+	int pid = fork();
+	if (pid < 0) {
+		perror("zygote: fork");
+		close(sv[0]);
+		close(sv[1]);
+	}
+	else if (pid == 0) {
+		close(sv[0]);
+		zygoteLoop(sv[1]);
+	}
+	else {
+		close(sv[1]);
+		zygoteSocket = holdFd(sv[0]);
+		zygotePid = pid;
+		zygoteShell = getpid();
+	}
+}
+
+bool zygoteExited(int pid, int result) {
+	if (pid <= 0 || pid != zygotePid) {
+		return false;
+	}
+	fprintf(stderr, "zygote: exited (%d), commands are forked by the shell from now on\n", STATUS(result));
+	closeFd(zygoteSocket);                  //Not restarted: forked from the shell as it is now, it would be no smaller
+	zygoteSocket = -1;
+	zygotePid = 0;
+	return true;
+}
+
+//Ask the zygote to run ARGV with environment ENVP and stdio IN, OUT, ERR in the current directory and process group PGID
+//Returns the pid of the new process (a child of the shell) or -1 if it has to be forked instead
+int zygoteSpawn(char** argv, char** envp, int in, int out, int err, int pgid) {
+	if (zygoteSocket < 0 || getpid() != zygoteShell) { //Its processes would be children of the shell, not of a subshell
+		return -1;
+	}
+	spawnRequest request = {0, 0, pgid, 0};
+	for (char** p = argv; *p; p++, request.argc++) {
+		request.length += strlen(*p) + 1;
+	}
+	for (char** p = envp; *p; p++, request.envc++) {
+		request.length += strlen(*p) + 1;
+	}
+	char* strings = malloc(request.length);
+	char* s = strings;
+	for (char** p = argv; *p; p++) {
+		s = stpcpy(s, *p) + 1;
+	}
+	for (char** p = envp; *p; p++) {
+		s = stpcpy(s, *p) + 1;
+	}
+
+	int cwd = openFd(".", O_RDONLY | O_DIRECTORY, 0);
+	int fds[ZYGOTE_FDS] = {in, out, err, cwd};
+	int reply = -1;
+	bool sent = (cwd >= 0 && sendFds(zygoteSocket, &request, sizeof(request), fds, ZYGOTE_FDS)
+		&& writeFully(zygoteSocket, strings, request.length) && readFully(zygoteSocket, &reply, sizeof(reply)));
+	free(strings);
+	if (cwd >= 0) {
+		close(cwd);
+	}
+	if (!sent) {                            //Zygote is gone, stop using it (it is reaped as zygotePid)
+		closeFd(zygoteSocket);
+		zygoteSocket = -1;
+		return -1;
+	}
+	return (reply > 0? reply : -1);
+}
+
+//Does the environment entry ENTRY (NAME=VALUE) set variable NAME?
+static bool setsVariable(const char* entry, const char* name) {
+	size_t length = strlen(name);
+	return strncmp(entry, name, length) == 0 && entry[length] == '=';
+}
+
+//Environment for a command: the shell's environment with the NLOCAL assignments LOCVAR=LOCVAL applied
+//Returns a NULL-terminated array whose strings from index *OWNED on were allocated here
+char** commandEnvironment(int nLocal, char** locVar, char** locVal, int* owned) {
+	int count = 0;
+	while (environ[count] != NULL) {
+		count++;
+	}
+	char** envp = malloc(sizeof(char*) * (count + nLocal + 1));
+	count = 0;
+	for (char** entry = environ; *entry; entry++) {
+		bool overridden = false;
+		for (int i = 0; i < nLocal && !overridden; i++) {
+			overridden = setsVariable(*entry, locVar[i]);
+		}
+		if (!overridden) {
+			envp[count++] = *entry;
+		}
+	}
+	*owned = count;
+	for (int i = 0; i < nLocal; i++) {
+		bool reassigned = false;            //Last assignment to a name wins, as with setenv()
+		for (int j = i + 1; j < nLocal && !reassigned; j++) {
+			reassigned = (strcmp(locVar[i], locVar[j]) == 0);
+		}
+		if (!reassigned) {
+			envp[count] = malloc(strlen(locVar[i]) + strlen(locVal[i]) + 2);
+			sprintf(envp[count++], "%s=%s", locVar[i], locVal[i]);
+		}
+	}
+	envp[count] = NULL;
+	return envp;
+}
+
+//Free an environment built by commandEnvironment()
+void freeEnvironment(char** envp, int owned) {
+	for (char** entry = envp + owned; *entry; entry++) {
+		free(*entry);
+	}
+	free(envp);
+}